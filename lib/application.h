@@ -23,7 +23,7 @@
 #define MAX_REQUEST_SIZE 65536  // Increase to 64KB
 
 
-BPT* create_dataset(const char* name, int T);
+BPT* create_dataset(const char* name, int T, int storage, const TreePolicy* policy);
 void delete_dataset(const char* name);
 
 
@@ -32,6 +32,13 @@ int bulk_insert(BPT* tree, const cJSON* entries);
 
 cJSON* search_key(BPT* tree, int key);  
 cJSON* range_query_dataset(BPT* tree, int start_key, int end_key);  
+cJSON* count_range_dataset(BPT* tree, int start_key, int end_key);
+cJSON* rank_key_dataset(BPT* tree, int key);
+cJSON* select_index_dataset(BPT* tree, long long index);
+cJSON* policy_to_json(const TreePolicy* policy);
+void read_dataset_policy(BPT* tree, TreePolicy* policy);
+cJSON* get_dataset_policy(BPT* tree);
+int set_dataset_policy(BPT* tree, const TreePolicy* policy);
 int delete_from_dataset(BPT* tree, int key);  
 void log_request(const char* dataset_name, const char* raw_request, const char* client_ip, int client_port);
 
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Slab allocator for fixed-size blocks. Each size class carves its blocks
+// out of large cache-line-aligned slabs and keeps freed blocks on a free
+// list for reuse; nothing is returned to the system until the arena is
+// destroyed, which releases every slab at once.
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_SLAB_SIZE (256u * 1024u)
+#define ARENA_MIN_SLAB_BLOCKS 16
+#define ARENA_MAX_CLASSES 4
+
+typedef struct Arena Arena;
+
+Arena* arena_create(const size_t* class_sizes, int class_count);
+void* arena_alloc(Arena* arena, int size_class);
+void arena_free(Arena* arena, int size_class, void* block);
+void arena_destroy(Arena* arena);
+
+#endif
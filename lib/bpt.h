@@ -2,24 +2,146 @@
 #define BPT_H
 
 #include "node.h"
+#include "wal.h"
+#include "arena.h"
+#include "sync.h"
+#include "epoch.h"
+#include "versions.h"
+
+#define BULK_LOAD_FILL_FACTOR 0.9  // share of each node filled by bulk_load
+#define BPT_MAX_HEIGHT 64          // deepest path a writer keeps latched
+#define OLC_MAX_RESTARTS 16        // optimistic descents before latching instead
+#define BPT_APPEND_RUN 8           // inserts into the last leaf before appends skip the descent
+#define SPLIT_PERCENT_DEFAULT 50
+#define MERGE_PERCENT_DEFAULT 50
+#define HYSTERESIS_PERCENT_DEFAULT 0
+#define REBALANCE_INTERVAL_MS 200  // longest an underfull leaf waits for the rebalancer
+#define REBALANCE_BATCH 64         // queued leaves that wake the rebalancer early
+
+// How full a dataset keeps its leaves, each share in percent of the T - 1
+// keys a leaf holds. A splitting leaf keeps split_percent of them. A leaf
+// is rebalanced once it holds fewer than merge_percent, or none at all. A
+// borrow or merge only goes ahead if it leaves hysteresis_percent to
+// spare: the lender keeps that much above the merge threshold and the
+// merged leaf that much below full, so the next few writes do not undo it.
+typedef struct TreePolicy {
+    int split_percent;       // 1 to 99
+    int merge_percent;       // 0 to 50
+    int hysteresis_percent;  // 0 to 50
+} TreePolicy;
+
+// Leaves left underfull by deletes, for the rebalancer thread. Each is
+// noted by a key it held rather than by its address, since by the time the
+// rebalancer gets to it the leaf may have been merged away or split.
+typedef struct RebalanceQueue {
+    Mutex mutex;
+    CondVar wake;
+    Thread thread;
+    bool running;
+    bool stopping;
+    int *keys;
+    int count;
+    int capacity;
+} RebalanceQueue;
+
+// Data files of leaves merged away since the last checkpoint, which still
+// refers to them. They are removed once the next one is durable.
+typedef struct RetiredFiles {
+    Mutex mutex;
+    char **file_pointers;
+    int count;
+    int capacity;
+} RetiredFiles;
 
 typedef struct BPT{
     Node *root;
     int T;
+    int storage;
     char* dataset_name;
+    Wal* wal;
+    Lsn applied_lsn;  // last logged operation reflected in the tree
+    struct Snapshot *snapshot;
+    struct VersionStore *versions;  // images of records for open range scans
+    Arena* arena;     // every node of the tree is allocated here
+    RWLock tree_lock;   // shared by operations, exclusive for checkpoints and batches
+    RWLock root_latch;  // guards root; taken before the root's own latch
+    RWLock lineage_lock;  // over node counts and parents, see node.c; taken last
+    Mutex fault_mutex;  // one reader at a time replaces a stub
+    bool checkpoint_due;
+    unsigned int root_version;  // odd while root is being replaced
+    EpochList retired;          // unlinked nodes, freed once no operation can reach them
+    Node *rightmost;            // last leaf as of the latest insert there, or NULL
+    int append_run;             // inserts in a row into the last leaf
+    TreePolicy policy;          // changed only with tree_lock held exclusively
+    RebalanceQueue rebalance;
+    RetiredFiles retired_files;
 } BPT;
 
-BPT* create_BPT( const char *dataset_name, int T);
+typedef struct CursorEntry {
+    int key;
+    size_t offset;  // of its line in the cursor's text
+    size_t length;
+} CursorEntry;
+
+// Walks the keys of a tree in order as of the moment it was opened. It holds
+// a copy of the records of one leaf's range, [low, high), and moving past
+// either end finds the next range from the root by that bound, so no latch
+// is held between calls. The tree is held shared only while a range is
+// read; an open cursor keeps its pinned version, and the images written
+// since, for as long as it stays in its epoch, so it should be closed as
+// soon as the caller is done with it.
+typedef struct Cursor {
+    BPT *tree;
+    int epoch;
+    Version pinned;
+    long long low;
+    long long high;
+    CursorEntry *entries;
+    int count;
+    int capacity;
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+    int position;  // -1 before the first entry, count past the last
+    int last;      // highest key the caller will read; bounds the read-ahead
+} Cursor;
+
+BPT* create_BPT( const char *dataset_name, int T, int storage);
+void default_policy(TreePolicy *policy);
+bool valid_policy(const TreePolicy *policy);
 void insert(BPT *tree, int key, const char *line);
+void apply_insert_batch(BPT *tree, const int *keys, const char *const *lines, int count, Lsn lsn);
+int bulk_load(BPT *tree, const int *keys, const char *const *lines, int count, double fill_factor);
 int delete(BPT *tree, int key);
+void apply_insert(BPT *tree, int key, const char *line, Lsn lsn);
+int apply_delete(BPT *tree, int key, Lsn lsn);
 Node* search(BPT *tree, int key);
+Node* child_at(BPT *tree, Node *node, int c);
+Node* find_leaf(BPT *tree, int key);
+Node* find_leaf_shared(BPT *tree, int key, long long *upper);
+Node* find_leaf_optimistic(BPT *tree, int key);
+void reclaim_retired(BPT *tree);
+Node** find_trims(BPT *tree, int *count);
+void release_leftovers(BPT *tree, Node **trims, int count);
+void start_rebalancer(BPT *tree);
+void checkpoint_if_due(BPT *tree);
+Node* next_leaf(BPT *tree, Node *leaf);
 void print_tree(Node *node, int level);
 Node* get_first_leaf_node(BPT *tree);
 Node* get_last_leaf_node(BPT *tree);
 char** ranged_query(BPT *tree, int low_limit, int up_limit, int *low_offset, int *up_offset);
+void cursor_open(BPT *tree, Cursor *cursor);
+bool cursor_seek(Cursor *cursor, int key);
+bool cursor_next(Cursor *cursor);
+bool cursor_prev(Cursor *cursor);
+bool cursor_peek(Cursor *cursor, int *key, const char **line, size_t *length);
+void cursor_close(Cursor *cursor);
+long long rank_key(BPT *tree, int key);
+long long count_keys(BPT *tree, int low, int high);
+bool select_key(BPT *tree, long long index, int *key);
 void free_tree(BPT* tree);
-void free_node(Node *node, const char* dataset_name);
-void free_node_and_not_file(Node *node);
+void free_node(BPT *tree, Node *node);
+void free_node_and_not_file(BPT *tree, Node *node);
 
 #endif
 
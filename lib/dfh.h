@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include "node.h"
+#include "wal.h"
 #include <stdbool.h>
 
 #define DFH_SUCCESS 0
@@ -13,15 +14,71 @@
 
 #define MAX_LINE_SIZE 1024
 #define MAX_PATH_LENGTH 256
+#define DFH_FILE_POINTER_LENGTH 33
+#define DFH_FD_CACHE_SIZE 64  // open leaf files kept per dataset
+
+// Storage engines a dataset can be created with.
+#define STORAGE_FILES 0     // one indexed .dat file per leaf
+#define STORAGE_SEGMENTS 1  // append-only segment log, see segment.h
+#define STORAGE_PAGES 2     // page file with a buffer pool, see pager.h
+
+// Leaf data file layout:
+//   DfhHeader | DfhIndexEntry[count] | records
+// Each record is still a "key\tline\n" text line, ordered by key. The index
+// gives the byte offset (from the start of the file) and length of the line
+// payload that follows the tab, so a lookup is a seek and a single read.
+#define DFH_MAGIC 0x31484644u  // "DFH1"
+
+typedef struct DfhHeader {
+    unsigned int magic;
+    unsigned int count;
+} DfhHeader;
+
+typedef struct DfhIndexEntry {
+    int key;
+    unsigned int offset;
+    unsigned int length;
+} DfhIndexEntry;
+
+// Read-only view of one leaf's records. With the file engine the leaf file is
+// memory-mapped and lookups return pointers into the mapping; other engines
+// copy the record into buffer instead.
+typedef struct DfhMapping {
+    const char* data;
+    size_t size;
+    const DfhIndexEntry* index;
+    unsigned int count;
+    const char* dataset_name;
+    const char* file_pointer;
+    char buffer[MAX_LINE_SIZE];
+} DfhMapping;
+
+int dfh_open_dataset(const char* dataset_name, int storage);
+void dfh_close_dataset(const char* dataset_name);
+int dfh_flush_dataset(const char* dataset_name);
+void dfh_checkpoint_durable(const char* dataset_name);
+void dfh_attach_log(const char* dataset_name, Wal* wal);
+int dfh_sync_directory(const char* dataset_name);
+int dfh_storage_from_name(const char* name);
+const char* dfh_storage_name(int storage);
 
 char* get_full_path(const char* dataset_name, const char* file_pointer);
 int dfh_create_datafile(const char* dataset_name, const char* file_pointer);
 int dfh_write_line(const char* dataset_name, const char* file_pointer, int key, const char* line);
+int dfh_write_lines(const char* dataset_name, const char* file_pointer,
+                    const int* keys, const char* const* lines, int count);
 int dfh_read_line(const char* dataset_name, const char* file_pointer, int key, char* buffer, size_t buffer_size);
 int dfh_delete_lines(const char* dataset_name, const char* file_pointer, int* keys, int num_keys);
-int dfh_move_lines(const char* dataset_name, const char* source_fp, const char* dest_fp, int* keys, int num_keys);
-int dfh_merge_files(const char* dataset_name, const char* taker_fp, const char* giver_fp);
+int dfh_retain_lines(const char* dataset_name, const char* file_pointer, const int* keys, int num_keys);
+int dfh_copy_lines(const char* dataset_name, const char* source_fp, const char* dest_fp,
+                   const int* keys, int num_keys);
 int dfh_verify_file(const char* dataset_name, const char* file_pointer, int* keys, int num_keys);
 bool is_file_empty(const char* dataset_name, const char* file_pointer);
+int dfh_remove_datafile(const char* dataset_name, const char* file_pointer);
+int dfh_replace_file(const char* temp_path, const char* path);
+int dfh_map_leaf(const char* dataset_name, const char* file_pointer, DfhMapping* mapping);
+int dfh_mapping_find(DfhMapping* mapping, int key, const char** line, size_t* length);
+void dfh_unmap_leaf(DfhMapping* mapping);
+void dfh_prefetch_leaf(const char* dataset_name, const char* file_pointer);
 
-#endif
\ No newline at end of file
+#endif
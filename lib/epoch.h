@@ -0,0 +1,38 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include "sync.h"
+
+// Epoch-based reclamation. A thread enters an epoch before it reaches shared
+// objects that may be unlinked under it (tree nodes, a dataset's tree) and
+// leaves it once it holds no pointer to them. An unlinked object is retired
+// with the global epoch as its tag and freed once the global epoch is two
+// past it: the epoch only moves on once every thread inside has entered at
+// the current one, so by then every thread that could have seen the object
+// has left. Entering and leaving only touch the thread's own slot and never
+// wait for a reclaim.
+
+#define EPOCH_MAX_THREADS 256    // threads inside an epoch at once
+#define EPOCH_RECLAIM_BATCH 64   // retired objects gathered before a reclaim pass
+
+typedef unsigned long long Epoch;
+typedef void (*EpochFree)(void* context, void* object);
+
+typedef struct EpochList {
+    void** objects;
+    Epoch* epochs;  // global epoch each object was retired at
+    int count;
+    int capacity;
+    Mutex mutex;
+} EpochList;
+
+int epoch_enter(void);
+void epoch_exit(int slot);
+void epoch_synchronize(void);
+void epoch_list_init(EpochList* list);
+void epoch_list_destroy(EpochList* list);
+void epoch_retire(EpochList* list, void* object);
+int epoch_reclaim(EpochList* list, EpochFree free_object, void* context, bool everything);
+
+#endif
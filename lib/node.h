@@ -2,20 +2,54 @@
 #define NODE_H
 
 #include <stdbool.h>
+#include "arena.h"
+#include "sync.h"
+
+// A node is a single cache-line-aligned block: this header, then T keys,
+// then T + 1 child pointers and T + 1 counts for an internal node or the
+// file pointer for a leaf. keys, children, sums and file_pointer point into
+// the same block. Blocks
+// come from the tree's arena, one size class per variant; a node not read
+// from the snapshot yet is only the header.
+#define NODE_STUB 0
+#define NODE_LEAF 1
+#define NODE_INTERNAL 2
 
 typedef struct Node {
     int *keys;
-    struct Node **children;
+    struct Node **children;  // NULL for leaves
+    long long *sums;         // keys in each child's range, see node.c; NULL for leaves
     struct Node *parent;
-    struct Node *next;
-    char *file_pointer;
+    struct Node *next;       // right sibling on the same level, see bpt.c
+    char *file_pointer;      // NULL for internal nodes
     int n;
     bool is_leaf;
+    bool loaded;        // false until read from the index snapshot
+    bool dirty;         // changed since the last checkpoint
+    bool underfull;     // queued for the rebalancer, see bpt.c
+    bool trim;          // data still holds records that left the leaf, see bpt.c
+    unsigned int slot;  // position in the index snapshot, 0 if never written
+    RWLock latch;       // guards keys, children and next; unused in stubs
+    unsigned int version;  // odd while a writer changes the node, see bpt.c
+    long long high_key;    // every key below the node is less; LLONG_MAX on the right edge
+    long long count;       // keys in the node's range, see node.c
 } Node;
 
-Node* create_node(const char* dataset_name, bool is_leaf, int T);
+Arena* create_node_arena(int T);
+Node* allocate_node(Arena *arena, bool is_leaf, int T);
+Node* allocate_stub(Arena *arena);
+Node* create_node(Arena *arena, const char* dataset_name, bool is_leaf, int T);
+void deallocate_node(Arena *arena, Node *node);
+Node* get_parent(Node *child);
+void set_parent(Node *child, Node *parent);
+void add_count(RWLock *lineage, Node *node, int key, long long delta);
+long long count_before(Node *node, int c);
+int child_by_count(Node *node, long long *index);
+void unpack_counts(Node *node);
+void pack_counts(Node *node);
+void mark_dirty(Node *node);
 void insert_into_node(Node *node, int key);
 void insert_into_leaf(const char* dataset_name, Node *node, int key, const char* line);
-char* generate_file_pointer(void);
+void generate_file_pointer(char *file_pointer);
 
 #endif
\ No newline at end of file
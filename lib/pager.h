@@ -0,0 +1,71 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "wal.h"
+
+// Paged record store: every leaf of the dataset keeps its records in a chain
+// of fixed-size pages inside <dataset>/pages.db. Pages are accessed through
+// a buffer pool with CLOCK replacement; modified pages stay in memory until
+// they are evicted or the pool is flushed, so writes reach the disk as whole
+// page writes instead of one file rewrite per operation. The pool's mutex
+// is released while a page is read in, so a miss only holds up callers
+// that want the same page.
+//
+// Page 0 holds the PagerFileHeader. Every other page starts with a
+// PageHeader followed by packed records (PageRecord + payload). The owning
+// leaf is stored in each page, so the leaf -> first page directory is
+// rebuilt by scanning the page headers when the file is opened.
+//
+// With a log attached, no page is written back before the log is synced, so
+// the file never holds a change whose log record could still be lost.
+//
+// Pages unlinked from a chain are not reused until a checkpoint saved after
+// the unlink has been written back and made durable: pages are written in
+// eviction order, so a page marked free on disk may still be reachable from
+// a chain whose unlink has not been written yet. Opening the file cuts any
+// chain that runs into a page of another leaf and frees what no head reaches.
+
+#define PAGER_MAGIC 0x31474150u  // "PAG1"
+#define PAGER_PAGE_SIZE 8192
+#define PAGER_POOL_FRAMES 256
+#define PAGER_OWNER_LENGTH 33
+
+#define PAGE_HEAD 0x1u  // first page of a leaf's chain
+#define PAGE_FREE 0x2u  // on the free list
+
+typedef struct PagerFileHeader {
+    unsigned int magic;
+    unsigned int page_size;
+} PagerFileHeader;
+
+typedef struct PageHeader {
+    unsigned int next;  // next page of the chain, 0 if last
+    unsigned int flags;
+    unsigned short count;
+    unsigned short used;  // bytes of records after the header
+    char owner[PAGER_OWNER_LENGTH];
+} PageHeader;
+
+typedef struct PageRecord {
+    int key;
+    unsigned short length;
+} PageRecord;
+
+typedef struct Pager Pager;
+
+Pager* pager_open(const char* dataset_name);
+void pager_close(Pager* pager);
+int pager_flush(Pager* pager);
+void pager_attach_log(Pager* pager, Wal* wal);
+void pager_checkpointed(Pager* pager);
+int pager_create_leaf(Pager* pager, const char* owner);
+int pager_drop_leaf(Pager* pager, const char* owner);
+int pager_put(Pager* pager, const char* owner, int key, const char* line, size_t length);
+int pager_get(Pager* pager, const char* owner, int key, char* buffer, size_t buffer_size);
+int pager_filter(Pager* pager, const char* owner, const int* keys, int num_keys, bool keep);
+int pager_copy(Pager* pager, const char* source, const char* dest, const int* keys, int num_keys);
+bool pager_is_empty(Pager* pager, const char* owner);
+
+#endif
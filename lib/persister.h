@@ -5,11 +5,13 @@
 #include <cJSON.h>
 
 int save_tree_to_json(BPT *tree);
+int checkpoint_tree(BPT *tree);
 
 BPT* load_tree_from_json(const char *dataset_name);
+BPT* load_tree(const char *dataset_name);
 
 
 cJSON* node_to_json(Node* node);
-Node* json_to_node(const char *dataset_name, cJSON *json, Node *parent);
+Node* json_to_node(BPT *tree, cJSON *json, Node *parent);
 
 #endif 
\ No newline at end of file
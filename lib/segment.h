@@ -0,0 +1,36 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Log-structured record store: every write appends a record to the active
+// segment file under <dataset>/data/, and an in-memory directory maps each
+// key to the (segment, offset, length) of its latest record. Leaves address
+// records by key, so splits and merges move no data. A background compactor
+// rewrites the live records of mostly-dead segments and deletes them.
+
+#define SEGMENT_MAGIC 0x31474553u  // "SEG1"
+#define SEGMENT_TOMBSTONE 0x1u
+#define SEGMENT_MAX_SIZE (64u * 1024u * 1024u)
+#define SEGMENT_COMPACT_INTERVAL_MS 10000
+
+typedef struct SegmentRecordHeader {
+    unsigned int magic;
+    int key;
+    unsigned int length;
+    unsigned int flags;
+} SegmentRecordHeader;
+
+typedef struct SegmentStore SegmentStore;
+
+SegmentStore* segment_store_open(const char* dataset_name);
+void segment_store_close(SegmentStore* store);
+int segment_put(SegmentStore* store, int key, const char* line, size_t length);
+int segment_get(SegmentStore* store, int key, char* buffer, size_t buffer_size);
+int segment_delete(SegmentStore* store, int key);
+bool segment_contains(SegmentStore* store, int key);
+int segment_compact(SegmentStore* store);
+int segment_sync(SegmentStore* store);
+
+#endif
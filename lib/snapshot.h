@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "bpt.h"
+
+// Binary index snapshot: <dataset>/index.bin stores every node of the tree
+// in a fixed-size slot, children referring to each other by slot number.
+// A checkpoint writes only the nodes changed since the previous one, each to
+// a slot the durable snapshot does not use, and then commits by writing a
+// header that names the new root. Rewriting a node moves it, so its parent
+// is rewritten too, which keeps a checkpoint at O(height) nodes per change.
+// index.json is still written on request as a readable export.
+//
+// Loading maps the file and reads only the root; every other node starts as
+// a reference to its slot and is read when a traversal first reaches it.
+//
+// Two header copies are kept at the start of the file and written in turn;
+// loading uses the valid one with the highest generation, so a checkpoint
+// interrupted at any point leaves the previous one intact. Slots that no
+// longer belong to the tree are found at load time and reused.
+
+#define SNAPSHOT_MAGIC 0x34534E53u  // "SNS4"
+#define SNAPSHOT_HEADER_SIZE 512
+#define SNAPSHOT_LEAF 0x1u
+#define SNAPSHOT_NO_SLOT 0u
+
+typedef struct SnapshotHeader {
+    unsigned int magic;
+    unsigned int T;
+    unsigned int storage;
+    unsigned int root;        // slot of the root node
+    unsigned int slot_count;  // slots in use or free, numbered from 1
+    unsigned int split_percent;       // the dataset's TreePolicy
+    unsigned int merge_percent;
+    unsigned int hysteresis_percent;
+    unsigned int checksum;    // FNV-1a over every other field
+    unsigned long long generation;
+    Lsn checkpoint_lsn;
+} SnapshotHeader;
+
+// Start of each slot; followed by T keys, then T + 1 child slots and the
+// T + 1 key counts of those children for an internal node, or the file
+// pointer for a leaf.
+typedef struct SnapshotSlot {
+    unsigned int flags;
+    unsigned int n;
+} SnapshotSlot;
+
+typedef struct Snapshot Snapshot;
+
+int save_tree_snapshot(BPT* tree);
+BPT* load_tree_snapshot(const char* dataset_name);
+Node* snapshot_fault(Snapshot* snapshot, Node* stub);
+Node* snapshot_fault_subtree(Snapshot* snapshot, Node* node);
+void snapshot_release(Snapshot* snapshot, unsigned int slot);
+void snapshot_close(Snapshot* snapshot);
+
+#endif
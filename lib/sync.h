@@ -0,0 +1,106 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+// Thin portability layer over the Win32 and POSIX threading primitives used
+// by the storage modules.
+
+#ifdef _WIN32
+    #include <windows.h>
+
+    typedef CRITICAL_SECTION Mutex;
+    typedef CONDITION_VARIABLE CondVar;
+    typedef HANDLE Thread;
+    typedef SRWLOCK RWLock;
+
+    #define THREAD_PROC(name, arg) DWORD WINAPI name(LPVOID arg)
+    #define THREAD_RETURN return 0
+
+    #define MUTEX_INIT(m) InitializeCriticalSection(m)
+    #define MUTEX_DESTROY(m) DeleteCriticalSection(m)
+    #define MUTEX_LOCK(m) EnterCriticalSection(m)
+    #define MUTEX_UNLOCK(m) LeaveCriticalSection(m)
+
+    #define COND_INIT(c) InitializeConditionVariable(c)
+    #define COND_DESTROY(c) ((void)(c))
+    #define COND_WAIT(c, m) SleepConditionVariableCS(c, m, INFINITE)
+    #define COND_TIMEDWAIT(c, m, ms) SleepConditionVariableCS(c, m, ms)
+    #define COND_SIGNAL(c) WakeConditionVariable(c)
+    #define COND_BROADCAST(c) WakeAllConditionVariable(c)
+
+    #define RWLOCK_INITIALIZER SRWLOCK_INIT
+    #define RWLOCK_INIT(l) InitializeSRWLock(l)
+    #define RWLOCK_DESTROY(l) ((void)(l))
+    #define RWLOCK_READ_LOCK(l) AcquireSRWLockShared(l)
+    #define RWLOCK_READ_UNLOCK(l) ReleaseSRWLockShared(l)
+    #define RWLOCK_WRITE_LOCK(l) AcquireSRWLockExclusive(l)
+    #define RWLOCK_WRITE_UNLOCK(l) ReleaseSRWLockExclusive(l)
+
+    #define THREAD_START(t, fn, arg) ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL ? 0 : -1)
+    #define THREAD_JOIN(t) do { WaitForSingleObject(t, INFINITE); CloseHandle(t); } while (0)
+    #define THREAD_YIELD() SwitchToThread()
+#else
+    #include <pthread.h>
+    #include <sched.h>
+    #include <time.h>
+
+    typedef pthread_mutex_t Mutex;
+    typedef pthread_cond_t CondVar;
+    typedef pthread_t Thread;
+    typedef pthread_rwlock_t RWLock;
+
+    #define THREAD_PROC(name, arg) void* name(void* arg)
+    #define THREAD_RETURN return NULL
+
+    #define MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+    #define MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+    #define MUTEX_LOCK(m) pthread_mutex_lock(m)
+    #define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+
+    #define COND_INIT(c) pthread_cond_init(c, NULL)
+    #define COND_DESTROY(c) pthread_cond_destroy(c)
+    #define COND_WAIT(c, m) pthread_cond_wait(c, m)
+    #define COND_TIMEDWAIT(c, m, ms) cond_timedwait_ms(c, m, ms)
+    #define COND_SIGNAL(c) pthread_cond_signal(c)
+    #define COND_BROADCAST(c) pthread_cond_broadcast(c)
+
+    #define RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+    #define RWLOCK_INIT(l) rwlock_init_writer_first(l)
+    #define RWLOCK_DESTROY(l) pthread_rwlock_destroy(l)
+    #define RWLOCK_READ_LOCK(l) pthread_rwlock_rdlock(l)
+    #define RWLOCK_READ_UNLOCK(l) pthread_rwlock_unlock(l)
+    #define RWLOCK_WRITE_LOCK(l) pthread_rwlock_wrlock(l)
+    #define RWLOCK_WRITE_UNLOCK(l) pthread_rwlock_unlock(l)
+
+    #define THREAD_START(t, fn, arg) pthread_create(t, NULL, fn, arg)
+    #define THREAD_JOIN(t) pthread_join(t, NULL)
+    #define THREAD_YIELD() sched_yield()
+
+    // Waiting writers go ahead of new readers where glibc offers it, as SRW
+    // locks do on Windows, so a stream of readers cannot hold a latch off.
+    static inline int rwlock_init_writer_first(RWLock* lock) {
+        #ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            int result = pthread_rwlock_init(lock, &attr);
+            pthread_rwlockattr_destroy(&attr);
+            return result;
+        #else
+            return pthread_rwlock_init(lock, NULL);
+        #endif
+    }
+
+    static inline int cond_timedwait_ms(CondVar* cond, Mutex* mutex, unsigned long ms) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        return pthread_cond_timedwait(cond, mutex, &deadline);
+    }
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 void memory_allocation_failed();
+int key_upper_bound(const int *keys, int n, int key);
 int binary_search(int *arr, int n, int key);
 char** append(char **arr, int *size, int *capacity, char* str);
 
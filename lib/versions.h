@@ -0,0 +1,39 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Record versions for snapshot-consistent range scans. Every insert and
+// delete takes the next version while its leaf is latched. A scan pins the
+// version it starts at, and while any scan is open writers keep the image a
+// record had before them (its line, or its absence) under their version.
+// The scan reads the leaves as they are and then puts back, for each key
+// written since its pin, the oldest image newer than the pin, so it returns
+// the range as it stood when it started without ever holding writers off.
+//
+// Images are reclaimed by epoch: when a scan unpins, every image no newer
+// than the oldest remaining pin is freed, and none are kept while no scan
+// is open.
+
+typedef unsigned long long Version;
+
+typedef struct VersionImage {
+    int key;
+    bool present;  // the key was there at the pinned version
+    char* line;    // its line then, when present
+} VersionImage;
+
+typedef struct VersionStore VersionStore;
+
+VersionStore* versions_create(void);
+void versions_destroy(VersionStore* store);
+Version versions_pin(VersionStore* store);
+void versions_unpin(VersionStore* store, Version pinned);
+Version versions_next(VersionStore* store);
+bool versions_wanted(VersionStore* store);
+void versions_keep(VersionStore* store, Version version, int key, const char* line, size_t length);
+int versions_collect(VersionStore* store, Version pinned, int low_key, int high_key, VersionImage** images);
+void versions_free_images(VersionImage* images, int count);
+
+#endif
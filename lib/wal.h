@@ -0,0 +1,47 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+
+// Write-ahead log: every insert and delete is appended to <dataset>/wal.log
+// as a logical record before it is applied to the tree, and made durable
+// before it is acknowledged, so index.json only has to be rewritten at
+// checkpoints. A storage engine syncs the log before any change it holds
+// reaches the disk (see dfh_attach_log). Records are numbered
+// by a log sequence number (LSN); the checkpoint stores the last LSN it
+// covers and loading replays the records after it.
+//
+// Appends only copy the record into an in-memory buffer. wal_commit makes
+// the first waiting caller write and sync everything buffered so far while
+// the others wait for it, so concurrent requests share one fsync.
+
+#define WAL_MAGIC 0x314C4157u  // "WAL1"
+#define WAL_INSERT 1u
+#define WAL_DELETE 2u
+#define WAL_CHECKPOINT_SIZE (1024u * 1024u)
+
+typedef unsigned long long Lsn;
+
+typedef struct WalRecordHeader {
+    unsigned int magic;
+    unsigned int type;
+    Lsn lsn;
+    int key;
+    unsigned int length;
+    unsigned int checksum;  // FNV-1a over the header fields and payload
+} WalRecordHeader;
+
+typedef struct Wal Wal;
+
+typedef void (*WalApply)(void* context, unsigned int type, int key, const char* line, Lsn lsn);
+
+Wal* wal_open(const char* dataset_name);
+void wal_close(Wal* wal);
+Lsn wal_append(Wal* wal, unsigned int type, int key, const char* line);
+int wal_commit(Wal* wal, Lsn lsn);
+int wal_sync(Wal* wal);
+int wal_replay(Wal* wal, Lsn after_lsn, WalApply apply, void* context);
+int wal_truncate(Wal* wal, Lsn checkpoint_lsn);
+unsigned long wal_size(Wal* wal);
+
+#endif
@@ -7,7 +7,8 @@
 #include <errno.h>
 #include <time.h>
 
-BPT* create_dataset(const char* name, int T) {
+// policy may be NULL for the defaults.
+BPT* create_dataset(const char* name, int T, int storage, const TreePolicy* policy) {
     if (MKDIR(name) != 0) {
         printf("Error: Could not create directory %s\n", name);
         return NULL;
@@ -35,17 +36,26 @@ BPT* create_dataset(const char* name, int T) {
         
         fprintf(log_file, "=== Dataset Created: %s ===\n", timestamp);
         fprintf(log_file, "Order (T): %d\n", T);
+        fprintf(log_file, "Storage: %s\n", dfh_storage_name(storage));
+        if (policy) {
+            fprintf(log_file, "Policy: split %d%%, merge %d%%, hysteresis %d%%\n",
+                    policy->split_percent, policy->merge_percent, policy->hysteresis_percent);
+        }
         fprintf(log_file, "=====================================\n");
         fclose(log_file);
     }
 
-    BPT* tree = create_BPT(name, T);
+    BPT* tree = create_BPT(name, T, storage);
     if (!tree) {
         printf("Error: Could not create B+ tree\n");
         return NULL;
     }
+    if (policy) {
+        tree->policy = *policy;
+    }
 
-    save_tree_to_json(tree);
+    checkpoint_tree(tree);
+    start_rebalancer(tree);
     return tree;
 }
 
@@ -83,6 +93,34 @@ void delete_dataset(const char* name) {
                index_path, strerror(errno));
     }
 
+    char snapshot_path[MAX_PATH_LENGTH];
+    snprintf(snapshot_path, MAX_PATH_LENGTH, "%s/index.bin", name);
+    if (remove(snapshot_path) != 0 && errno != ENOENT) {
+        printf("Warning: Failed to delete index snapshot %s: %s\n", 
+               snapshot_path, strerror(errno));
+    }
+
+    char wal_path[MAX_PATH_LENGTH];
+    snprintf(wal_path, MAX_PATH_LENGTH, "%s/wal.log", name);
+    if (remove(wal_path) != 0 && errno != ENOENT) {
+        printf("Warning: Failed to delete log file %s: %s\n", 
+               wal_path, strerror(errno));
+    }
+
+    char pages_path[MAX_PATH_LENGTH];
+    snprintf(pages_path, MAX_PATH_LENGTH, "%s/pages.db", name);
+    if (remove(pages_path) != 0 && errno != ENOENT) {
+        printf("Warning: Failed to delete page file %s: %s\n", 
+               pages_path, strerror(errno));
+    }
+
+    char log_path[MAX_PATH_LENGTH];
+    snprintf(log_path, MAX_PATH_LENGTH, "%s/logs.txt", name);
+    if (remove(log_path) != 0 && errno != ENOENT) {
+        printf("Warning: Failed to delete request log %s: %s\n", 
+               log_path, strerror(errno));
+    }
+
 
     if (RMDIR(data_path) != 0 && errno != ENOENT) {
         printf("Warning: Failed to delete data directory %s: %s\n", 
@@ -95,12 +133,68 @@ void delete_dataset(const char* name) {
     }
 }
 
+// Sorted entries for a dataset that is still empty are bulk loaded bottom-up.
+static bool is_ascending(const int* keys, int count) {
+    for (int i = 1; i < count; i++) {
+        if (keys[i] <= keys[i - 1]) return false;
+    }
+    return true;
+}
+
+typedef struct BatchEntry {
+    int key;
+    int position;
+} BatchEntry;
+
+static int compare_batch_entries(const void* a, const void* b) {
+    const BatchEntry* x = a;
+    const BatchEntry* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+
+// Sorts the batch by key in place, keeping only the last entry for a key as
+// applying the entries in order would. Returns the number left.
+static int sort_batch(int* keys, const char** lines, int count) {
+    BatchEntry* order = malloc(count * sizeof(BatchEntry));
+    const char** sorted_lines = malloc(count * sizeof(char*));
+    if (!order || !sorted_lines) {
+        memory_allocation_failed();
+    }
+    for (int i = 0; i < count; i++) {
+        order[i].key = keys[i];
+        order[i].position = i;
+    }
+    qsort(order, count, sizeof(BatchEntry), compare_batch_entries);
+
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        if (i + 1 < count && order[i + 1].key == order[i].key) continue;
+        keys[distinct] = order[i].key;
+        sorted_lines[distinct] = lines[order[i].position];
+        distinct++;
+    }
+    memcpy(lines, sorted_lines, distinct * sizeof(char*));
+    free(sorted_lines);
+    free(order);
+    return distinct;
+}
+
 int bulk_insert(BPT* tree, const cJSON* entries) {
     if (!tree || !entries || !cJSON_IsArray(entries)) {
         printf("Error: Invalid parameters for bulk insert\n");
         return -1;
     }
 
+    int total = cJSON_GetArraySize(entries);
+    if (total == 0) return 0;
+
+    int* keys = malloc(total * sizeof(int));
+    const char** lines = malloc(total * sizeof(char*));
+    if (!keys || !lines) {
+        memory_allocation_failed();
+    }
+
     int count = 0;
     cJSON* entry = NULL;
     cJSON_ArrayForEach(entry, entries) {
@@ -111,88 +205,237 @@ int bulk_insert(BPT* tree, const cJSON* entries) {
             printf("Warning: Skipping invalid entry in bulk insert\n");
             continue;
         }
+        keys[count] = key_obj->valueint;
+        lines[count] = line_obj->valuestring;
+        count++;
+    }
 
-        int key = key_obj->valueint;
-        const char* line = line_obj->valuestring;
+    // A load into an empty dataset leaves reads running; it fails if the
+    // dataset is not empty, and the entries go in as a batch instead. It is
+    // not logged, so it is only durable once this checkpoint is written.
+    if (count > 0 && is_ascending(keys, count)) {
+        int epoch = epoch_enter();
+        RWLOCK_READ_LOCK(&tree->tree_lock);
+        int loaded = bulk_load(tree, keys, lines, count, BULK_LOAD_FILL_FACTOR);
+        RWLOCK_READ_UNLOCK(&tree->tree_lock);
+        epoch_exit(epoch);
+        if (loaded != -1) {
+            if (checkpoint_tree(tree) != 0) {
+                printf("Error: Could not make bulk load durable\n");
+                loaded = -1;
+            }
+            free(keys);
+            free(lines);
+            return loaded;
+        }
+    }
 
-        insert(tree, key, line);
-        count++;
+    // A batch rewrites leaves across the whole key range, so it takes the
+    // tree for itself rather than latching node by node.
+    RWLOCK_WRITE_LOCK(&tree->tree_lock);
+
+    // Log the whole batch first and apply it; it is committed once the tree
+    // is let go, with a single sync.
+    Lsn last_lsn = 0;
+    for (int i = 0; i < count; i++) {
+        last_lsn = wal_append(tree->wal, WAL_INSERT, keys[i], lines[i]);
+    }
+    if (count > 0) {
+        int distinct = sort_batch(keys, lines, count);
+        apply_insert_batch(tree, keys, lines, distinct, last_lsn);
     }
-    return count;
+    RWLOCK_WRITE_UNLOCK(&tree->tree_lock);
+
+    int result = count;
+    if (last_lsn != 0 && wal_commit(tree->wal, last_lsn) != DFH_SUCCESS) {
+        printf("Error: Could not log bulk insert\n");
+        result = -1;
+    }
+    checkpoint_if_due(tree);
+
+    free(keys);
+    free(lines);
+    return result;
+}
+
+// Builds a cJSON string straight from a record that is not NUL-terminated,
+// so the record is copied exactly once on its way into a response.
+static cJSON* create_line_item(const char* line, size_t length) {
+    cJSON* item = cJSON_CreateString("");
+    if (!item) return NULL;
+    char* copy = malloc(length + 1);
+    if (!copy) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    memcpy(copy, line, length);
+    copy[length] = '\0';
+    free(item->valuestring);
+    item->valuestring = copy;
+    return item;
+}
+
+static cJSON* create_record_entry(int key, const char* line, size_t length) {
+    cJSON* entry = cJSON_CreateObject();
+    if (entry) {
+        cJSON_AddNumberToObject(entry, "key", key);
+        cJSON_AddItemToObject(entry, "line", create_line_item(line, length));
+    }
+    return entry;
 }
 
 cJSON* search_key(BPT* tree, int key) {
     if (!tree) return NULL;
 
-    Node* leaf = search(tree, key);
-    if (!leaf) {
+    // The leaf stays latched until its record is copied out.
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    Node* leaf = find_leaf_optimistic(tree, key);
+    cJSON* response = NULL;
+    if (binary_search(leaf->keys, leaf->n, key) == -1) {
         printf("Key %d not found\n", key);
-        return NULL;
+    } else {
+        DfhMapping mapping;
+        const char* line;
+        size_t length;
+        if (dfh_map_leaf(tree->dataset_name, leaf->file_pointer, &mapping) != DFH_SUCCESS ||
+            dfh_mapping_find(&mapping, key, &line, &length) != DFH_SUCCESS) {
+            printf("Failed to read data for key %d\n", key);
+        } else {
+            response = create_record_entry(key, line, length);
+        }
+        dfh_unmap_leaf(&mapping);
     }
+    RWLOCK_READ_UNLOCK(&leaf->latch);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
 
-    int pos = binary_search(leaf->keys, leaf->n, key);
-    if (pos == -1) {
-        printf("Key %d not found\n", key);
+    return response;
+}
+
+cJSON* range_query_dataset(BPT* tree, int start_key, int end_key) {
+    if (!tree || start_key > end_key) {
+        printf("Invalid range query parameters\n");
         return NULL;
     }
 
-    char buffer[1024];
-    int result = dfh_read_line(tree->dataset_name, leaf->file_pointer, key, buffer, sizeof(buffer));
-    if (result != DFH_SUCCESS) {
-        printf("Failed to read data for key %d\n", key);
+    cJSON* results = cJSON_CreateArray();
+    if (!results) return NULL;
+
+    // The cursor starts at start_key from the root and reads the range as it
+    // stood when it was opened, so only the leaves in range are visited.
+    Cursor cursor;
+    cursor_open(tree, &cursor);
+    cursor.last = end_key;
+    int key;
+    const char* line;
+    size_t length;
+    for (bool found = cursor_seek(&cursor, start_key); found; found = cursor_next(&cursor)) {
+        cursor_peek(&cursor, &key, &line, &length);
+        if (key > end_key) break;
+        cJSON* entry = create_record_entry(key, line, length);
+        if (entry) cJSON_AddItemToArray(results, entry);
+    }
+    cursor_close(&cursor);
+    return results;
+}
+
+// Counts, ranks and selects are answered from the index alone, alongside
+// other operations on the tree.
+cJSON* count_range_dataset(BPT* tree, int start_key, int end_key) {
+    if (!tree || start_key > end_key) {
+        printf("Invalid count parameters\n");
         return NULL;
     }
 
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    long long count = count_keys(tree, start_key, end_key);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
+
     cJSON* response = cJSON_CreateObject();
     if (!response) return NULL;
+    cJSON_AddNumberToObject(response, "start", start_key);
+    cJSON_AddNumberToObject(response, "end", end_key);
+    cJSON_AddNumberToObject(response, "count", (double)count);
+    return response;
+}
 
-    cJSON_AddNumberToObject(response, "key", key);
-    cJSON_AddStringToObject(response, "line", buffer);
+cJSON* rank_key_dataset(BPT* tree, int key) {
+    if (!tree) return NULL;
 
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    long long rank = rank_key(tree, key);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
+
+    cJSON* response = cJSON_CreateObject();
+    if (!response) return NULL;
+    cJSON_AddNumberToObject(response, "key", key);
+    cJSON_AddNumberToObject(response, "rank", (double)rank);
     return response;
 }
 
-cJSON* range_query_dataset(BPT* tree, int start_key, int end_key) {
-    if (!tree || start_key > end_key) {
-        printf("Invalid range query parameters\n");
+cJSON* select_index_dataset(BPT* tree, long long index) {
+    if (!tree) return NULL;
+
+    int key;
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    bool found = select_key(tree, index, &key);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
+    if (!found) {
+        printf("Index %lld out of range\n", index);
         return NULL;
     }
 
-    cJSON* results = cJSON_CreateArray();
-    if (!results) return NULL;
+    cJSON* response = cJSON_CreateObject();
+    if (!response) return NULL;
+    cJSON_AddNumberToObject(response, "index", (double)index);
+    cJSON_AddNumberToObject(response, "key", key);
+    return response;
+}
 
-    Node* cursor = tree->root;
-    while (!cursor->is_leaf) {
-        cursor = cursor->children[0];
-    }
+cJSON* policy_to_json(const TreePolicy* policy) {
+    cJSON* response = cJSON_CreateObject();
+    if (!response) return NULL;
+    cJSON_AddNumberToObject(response, "split", policy->split_percent);
+    cJSON_AddNumberToObject(response, "merge", policy->merge_percent);
+    cJSON_AddNumberToObject(response, "hysteresis", policy->hysteresis_percent);
+    return response;
+}
 
-    while (cursor && cursor->keys[0] <= end_key) {
-        char buffer[1024];
-        
-        for (int i = 0; i < cursor->n; i++) {
-            int current_key = cursor->keys[i];
-            
-            if (current_key >= start_key && current_key <= end_key) {
-                if (dfh_read_line(tree->dataset_name, cursor->file_pointer, 
-                                current_key, buffer, sizeof(buffer)) == DFH_SUCCESS) {
-                    cJSON* entry = cJSON_CreateObject();
-                    if (entry) {
-                        cJSON_AddNumberToObject(entry, "key", current_key);
-                        cJSON_AddStringToObject(entry, "line", buffer);
-                        cJSON_AddItemToArray(results, entry);
-                    }
-                }
-            }
-            
-            if (current_key > end_key) {
-                return results;
-            }
-        }
-        
-        cursor = cursor->next;
+void read_dataset_policy(BPT* tree, TreePolicy* policy) {
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    *policy = tree->policy;
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+}
+
+cJSON* get_dataset_policy(BPT* tree) {
+    if (!tree) return NULL;
+
+    TreePolicy policy;
+    read_dataset_policy(tree, &policy);
+    return policy_to_json(&policy);
+}
+
+// Writers read the policy under the shared tree lock, so it changes with
+// the tree to itself. The checkpoint that follows makes it durable. Leaves
+// already past the new thresholds are left as they are until their next
+// write.
+int set_dataset_policy(BPT* tree, const TreePolicy* policy) {
+    if (!tree || !valid_policy(policy)) {
+        printf("Invalid split and merge policy\n");
+        return -1;
     }
 
-    return results;
+    RWLOCK_WRITE_LOCK(&tree->tree_lock);
+    tree->policy = *policy;
+    RWLOCK_WRITE_UNLOCK(&tree->tree_lock);
+    return checkpoint_tree(tree);
 }
 
 int delete_from_dataset(BPT* tree, int key) {
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+    #include <malloc.h>
+#endif
+#include "../lib/arena.h"
+#include "../lib/sync.h"
+#include "../lib/utils.h"
+
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct SizeClass {
+    size_t block_size;
+    size_t slab_size;
+    char* cursor;      // next unused block in the newest slab
+    char* limit;
+    FreeBlock* free;
+} SizeClass;
+
+struct Arena {
+    Mutex mutex;
+    SizeClass classes[ARENA_MAX_CLASSES];
+    int class_count;
+    Slab* slabs;
+};
+
+static size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static void* allocate_aligned(size_t size) {
+    #ifdef _WIN32
+        return _aligned_malloc(size, ARENA_ALIGNMENT);
+    #else
+        return aligned_alloc(ARENA_ALIGNMENT, size);
+    #endif
+}
+
+static void free_aligned(void* block) {
+    #ifdef _WIN32
+        _aligned_free(block);
+    #else
+        free(block);
+    #endif
+}
+
+Arena* arena_create(const size_t* class_sizes, int class_count) {
+    if (class_count <= 0 || class_count > ARENA_MAX_CLASSES) return NULL;
+
+    Arena* arena = calloc(1, sizeof(Arena));
+    if (!arena) {
+        memory_allocation_failed();
+    }
+    for (int i = 0; i < class_count; i++) {
+        SizeClass* size_class = &arena->classes[i];
+        size_class->block_size = align_up(class_sizes[i], ARENA_ALIGNMENT);
+        size_t blocks = ARENA_SLAB_SIZE / size_class->block_size;
+        if (blocks < ARENA_MIN_SLAB_BLOCKS) blocks = ARENA_MIN_SLAB_BLOCKS;
+        size_class->slab_size = blocks * size_class->block_size;
+    }
+    arena->class_count = class_count;
+    MUTEX_INIT(&arena->mutex);
+    return arena;
+}
+
+// Starts a new slab for size_class. Its first aligned block holds the slab
+// link, the rest are handed out in order.
+static void grow(Arena* arena, SizeClass* size_class) {
+    size_t header = align_up(sizeof(Slab), ARENA_ALIGNMENT);
+    char* slab = allocate_aligned(header + size_class->slab_size);
+    if (!slab) {
+        memory_allocation_failed();
+    }
+    ((Slab*)slab)->next = arena->slabs;
+    arena->slabs = (Slab*)slab;
+    size_class->cursor = slab + header;
+    size_class->limit = slab + header + size_class->slab_size;
+}
+
+void* arena_alloc(Arena* arena, int size_class) {
+    SizeClass* blocks = &arena->classes[size_class];
+    void* block;
+
+    MUTEX_LOCK(&arena->mutex);
+    if (blocks->free) {
+        block = blocks->free;
+        blocks->free = blocks->free->next;
+    } else {
+        if (blocks->cursor == blocks->limit) {
+            grow(arena, blocks);
+        }
+        block = blocks->cursor;
+        blocks->cursor += blocks->block_size;
+    }
+    MUTEX_UNLOCK(&arena->mutex);
+    return block;
+}
+
+void arena_free(Arena* arena, int size_class, void* block) {
+    if (!block) return;
+    FreeBlock* freed = block;
+
+    MUTEX_LOCK(&arena->mutex);
+    freed->next = arena->classes[size_class].free;
+    arena->classes[size_class].free = freed;
+    MUTEX_UNLOCK(&arena->mutex);
+}
+
+void arena_destroy(Arena* arena) {
+    if (!arena) return;
+    while (arena->slabs) {
+        Slab* next = arena->slabs->next;
+        free_aligned(arena->slabs);
+        arena->slabs = next;
+    }
+    MUTEX_DESTROY(&arena->mutex);
+    free(arena);
+}
@@ -2,29 +2,589 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include "../lib/bpt.h"
 #include "../lib/node.h"
 #include "../lib/utils.h"
 #include "../lib/dfh.h"
 #include "../lib/persister.h"
+#include "../lib/snapshot.h"
+#include "../lib/versions.h"
 
 // BPT CREATION 
 
 
 
-BPT* create_BPT(const char* dataset_name, int T) {
+BPT* create_BPT(const char* dataset_name, int T, int storage) {
+    if (dfh_open_dataset(dataset_name, storage) != DFH_SUCCESS) {
+        printf("Error: Could not open %s storage for %s\n", dfh_storage_name(storage), dataset_name);
+        return NULL;
+    }
+
     BPT *bpt = (BPT *)malloc(sizeof(BPT));
     if (bpt == NULL) {
         memory_allocation_failed();
     }
 
-    bpt->root = create_node(dataset_name, true, T);
+    bpt->wal = wal_open(dataset_name);
+    if (!bpt->wal) {
+        dfh_close_dataset(dataset_name);
+        free(bpt);
+        return NULL;
+    }
+    dfh_attach_log(dataset_name, bpt->wal);
+
+    bpt->arena = create_node_arena(T);
+    bpt->root = create_node(bpt->arena, dataset_name, true, T);
     bpt->T = T;
+    bpt->storage = storage;
     bpt->dataset_name = strdup(dataset_name);
+    bpt->applied_lsn = 0;
+    bpt->snapshot = NULL;
+    bpt->versions = versions_create();
+    bpt->checkpoint_due = false;
+    RWLOCK_INIT(&bpt->tree_lock);
+    RWLOCK_INIT(&bpt->root_latch);
+    RWLOCK_INIT(&bpt->lineage_lock);
+    MUTEX_INIT(&bpt->fault_mutex);
+    bpt->root_version = 0;
+    epoch_list_init(&bpt->retired);
+    bpt->rightmost = NULL;
+    bpt->append_run = 0;
+    default_policy(&bpt->policy);
+    MUTEX_INIT(&bpt->rebalance.mutex);
+    COND_INIT(&bpt->rebalance.wake);
+    bpt->rebalance.running = false;
+    bpt->rebalance.stopping = false;
+    bpt->rebalance.keys = NULL;
+    bpt->rebalance.count = 0;
+    bpt->rebalance.capacity = 0;
+    MUTEX_INIT(&bpt->retired_files.mutex);
+    bpt->retired_files.file_pointers = NULL;
+    bpt->retired_files.count = 0;
+    bpt->retired_files.capacity = 0;
 
     return bpt;
 }
 
+void default_policy(TreePolicy *policy) {
+    policy->split_percent = SPLIT_PERCENT_DEFAULT;
+    policy->merge_percent = MERGE_PERCENT_DEFAULT;
+    policy->hysteresis_percent = HYSTERESIS_PERCENT_DEFAULT;
+}
+
+bool valid_policy(const TreePolicy *policy) {
+    return policy->split_percent >= 1 && policy->split_percent <= 99 &&
+           policy->merge_percent >= 0 && policy->merge_percent <= 50 &&
+           policy->hysteresis_percent >= 0 && policy->hysteresis_percent <= 50;
+}
+
+// Marks the logged operation lsn as applied. The index is rewritten once
+// the log has grown past WAL_CHECKPOINT_SIZE; splits and merges leave their
+// records where the last checkpoint expects them too (see retire_file), so
+// they need no checkpoint of their own. A checkpoint needs the tree to
+// itself, so here it is only flagged; checkpoint_if_due takes it once the
+// operation has let go of the tree.
+static void finish_write(BPT *tree, Lsn lsn) {
+    Lsn applied = __atomic_load_n(&tree->applied_lsn, __ATOMIC_RELAXED);
+    while (lsn > applied &&
+           !__atomic_compare_exchange_n(&tree->applied_lsn, &applied, lsn, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    if (wal_size(tree->wal) >= WAL_CHECKPOINT_SIZE) {
+        __atomic_store_n(&tree->checkpoint_due, true, __ATOMIC_RELEASE);
+    }
+}
+
+// Must be called without holding tree_lock.
+void checkpoint_if_due(BPT *tree) {
+    if (__atomic_exchange_n(&tree->checkpoint_due, false, __ATOMIC_ACQ_REL)) {
+        checkpoint_tree(tree);
+    }
+}
+
+// A node unlinked while the tree is shared may still be read by an
+// optimistic reader, or its latch waited on. Every operation on a shared tree
+// runs inside an epoch, and the node is freed once all that were inside when
+// it was unlinked have left, or at the next checkpoint, which has the tree to
+// itself.
+static void retire_node(BPT *tree, Node *node) {
+    Node *expected = node;
+    __atomic_compare_exchange_n(&tree->rightmost, &expected, NULL, false,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    epoch_retire(&tree->retired, node);
+}
+
+static void free_retired_node(void *context, void *node) {
+    BPT *tree = context;
+    deallocate_node(tree->arena, node);
+}
+
+// The caller holds tree_lock exclusively.
+void reclaim_retired(BPT *tree) {
+    epoch_reclaim(&tree->retired, free_retired_node, tree, true);
+}
+
+// Called outside the epoch once an operation is done.
+static void reclaim_unreachable(BPT *tree) {
+    if (__atomic_load_n(&tree->retired.count, __ATOMIC_RELAXED) >= EPOCH_RECLAIM_BATCH) {
+        epoch_reclaim(&tree->retired, free_retired_node, tree, false);
+    }
+}
+
+// A split, borrow or merge copies records into the leaf that takes them
+// but leaves them where they were too: until a checkpoint that has them in
+// their new leaf is durable, a restart goes by the last one and looks for
+// them in the old. The leaves they left are flagged trim, and the data
+// files of leaves merged away are kept in retired_files; a checkpoint
+// finds both and lets go of the records once it is on disk.
+
+static void retire_file(BPT *tree, const char *file_pointer) {
+    RetiredFiles *files = &tree->retired_files;
+    MUTEX_LOCK(&files->mutex);
+    if (files->count == files->capacity) {
+        int capacity = files->capacity ? files->capacity * 2 : 16;
+        char **grown = realloc(files->file_pointers, capacity * sizeof(char *));
+        if (!grown) {
+            memory_allocation_failed();
+        }
+        files->file_pointers = grown;
+        files->capacity = capacity;
+    }
+    files->file_pointers[files->count] = strdup(file_pointer);
+    if (!files->file_pointers[files->count]) {
+        memory_allocation_failed();
+    }
+    files->count++;
+    MUTEX_UNLOCK(&files->mutex);
+}
+
+static void collect_trims(Node *node, Node ***trims, int *count, int *capacity) {
+    if (!node->dirty) return;
+    if (!node->is_leaf) {
+        for (int c = 0; c <= node->n; c++) {
+            collect_trims(node->children[c], trims, count, capacity);
+        }
+        return;
+    }
+    if (!node->trim) return;
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *trims = realloc(*trims, *capacity * sizeof(Node *));
+        if (!*trims) {
+            memory_allocation_failed();
+        }
+    }
+    (*trims)[(*count)++] = node;
+}
+
+// Leaves flagged trim. Every one was changed since the last checkpoint, so
+// they are found among the dirty nodes, before saving clears that. The
+// caller holds tree_lock exclusively.
+Node** find_trims(BPT *tree, int *count) {
+    Node **trims = NULL;
+    int capacity = 0;
+    *count = 0;
+    collect_trims(tree->root, &trims, count, &capacity);
+    return trims;
+}
+
+// Called once a checkpoint is durable, with the leaves find_trims returned
+// before it was saved; the caller still holds tree_lock exclusively.
+void release_leftovers(BPT *tree, Node **trims, int count) {
+    for (int i = 0; i < count; i++) {
+        if (dfh_retain_lines(tree->dataset_name, trims[i]->file_pointer,
+                             trims[i]->keys, trims[i]->n) == DFH_SUCCESS) {
+            trims[i]->trim = false;
+        }
+    }
+    RetiredFiles *files = &tree->retired_files;
+    for (int i = 0; i < files->count; i++) {
+        dfh_remove_datafile(tree->dataset_name, files->file_pointers[i]);
+        free(files->file_pointers[i]);
+    }
+    files->count = 0;
+}
+
+// A version is odd while the writer holding the node's exclusive latch (or
+// root_latch, for root_version) changes what it guards. A node that is
+// unlinked is left odd for good.
+static void version_begin(unsigned int *version) {
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void version_end(unsigned int *version) {
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+// Returns false if a writer is in the middle of a change.
+static bool version_read(const unsigned int *version, unsigned int *seen) {
+    *seen = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    return (*seen & 1) == 0;
+}
+
+// Whether everything read since version_read saw seen is still current.
+static bool version_valid(const unsigned int *version, unsigned int seen) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) == seen;
+}
+
+// ---------------------------------------------------------
+
+// BPT TRAVERSAL
+
+// Operations on one tree run concurrently under a shared tree_lock. The tree
+// is a B-link tree: every node has a right link (next) to its sibling on the
+// same level and a high key that every key below it is less than. A split
+// links the new node in on its own level first and inserts its separator
+// into the parent afterwards, so a descent that finds key at or past a
+// node's high key follows the right link instead of starting over.
+//
+// Nodes are latched top-down, and on one level left to right only, so
+// operations cannot deadlock. Readers crab with shared latches, holding at
+// most a node and its child or its right sibling. An insert crabs down the
+// same way and latches only the leaf exclusively; a split goes up one level
+// at a time, holding a single latch. A delete takes exclusive latches and
+// lets go of every ancestor once it reaches a node it cannot empty, since
+// nothing above changes then. root_latch guards tree->root and is the first
+// latch of every descent.
+//
+// find_leaf, search, next_leaf and ranged_query take no latches; they are for
+// code that has the tree to itself: log replay, loading and the batch paths.
+
+int index_in_parent(Node *node) {
+    Node *parent = node->parent;
+    for (int i = 0; i <= parent->n; i++) {
+        if (parent->children[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns child c of node, reading it from the index snapshot on first use.
+// Readers sharing the latch on node may get here together, so the stub is
+// replaced under fault_mutex. Another reader may still be looking at the
+// stub, so it is retired rather than freed.
+Node* child_at(BPT *tree, Node *node, int c) {
+    Node *child = __atomic_load_n(&node->children[c], __ATOMIC_ACQUIRE);
+    if (child->loaded) return child;
+
+    MUTEX_LOCK(&tree->fault_mutex);
+    child = node->children[c];
+    if (!child->loaded) {
+        Node *stub = child;
+        child = snapshot_fault(tree->snapshot, stub);
+        __atomic_store_n(&node->children[c], child, __ATOMIC_RELEASE);
+        retire_node(tree, stub);
+    }
+    MUTEX_UNLOCK(&tree->fault_mutex);
+    return child;
+}
+
+Node* find_leaf(BPT *tree, int key) {
+    Node *cursor = tree->root;
+    while (!cursor->is_leaf) {
+        cursor = child_at(tree, cursor, key_upper_bound(cursor->keys, cursor->n, key));
+    }
+    return cursor;
+}
+
+// Like find_leaf, also giving the separator to the right of the path, which
+// every key in the leaf is below (LLONG_MAX for the rightmost leaf).
+static Node* find_leaf_bounded(BPT *tree, int key, long long *upper) {
+    Node *cursor = tree->root;
+    *upper = LLONG_MAX;
+    while (!cursor->is_leaf) {
+        int c = key_upper_bound(cursor->keys, cursor->n, key);
+        if (c < cursor->n) {
+            *upper = cursor->keys[c];
+        }
+        cursor = child_at(tree, cursor, c);
+    }
+    return cursor;
+}
+
+// Follows right links from a latched node to the one whose range holds key,
+// latching each before letting go of the one before it. Only a split whose
+// separator has not reached the parent yet leaves key past the high key, so
+// this is rarely more than one step.
+static Node* move_right(Node *node, int key, bool exclusive) {
+    while (key >= node->high_key && node->next) {
+        Node *right = node->next;
+        if (exclusive) {
+            RWLOCK_WRITE_LOCK(&right->latch);
+            RWLOCK_WRITE_UNLOCK(&node->latch);
+        } else {
+            RWLOCK_READ_LOCK(&right->latch);
+            RWLOCK_READ_UNLOCK(&node->latch);
+        }
+        node = right;
+    }
+    return node;
+}
+
+// Like find_leaf_shared, also giving the bound the leaf was reached by from
+// the left: the separator left of the path, or the high key of the last node
+// passed on the way right (LLONG_MIN for the leftmost leaf). A borrow after
+// the descent may leave keys below it in the leaf.
+static Node* find_leaf_between(BPT *tree, int key, long long *lower, long long *upper) {
+    RWLOCK_READ_LOCK(&tree->root_latch);
+    Node *cursor = tree->root;
+    RWLOCK_READ_LOCK(&cursor->latch);
+    RWLOCK_READ_UNLOCK(&tree->root_latch);
+
+    *lower = LLONG_MIN;
+    for (;;) {
+        while (key >= cursor->high_key && cursor->next) {
+            Node *right = cursor->next;
+            RWLOCK_READ_LOCK(&right->latch);
+            RWLOCK_READ_UNLOCK(&cursor->latch);
+            *lower = cursor->high_key;
+            cursor = right;
+        }
+        if (cursor->is_leaf) break;
+        int c = key_upper_bound(cursor->keys, cursor->n, key);
+        if (c > 0) {
+            *lower = cursor->keys[c - 1];
+        }
+        Node *child = child_at(tree, cursor, c);
+        RWLOCK_READ_LOCK(&child->latch);
+        RWLOCK_READ_UNLOCK(&cursor->latch);
+        cursor = child;
+    }
+    *upper = cursor->high_key;
+    return cursor;
+}
+
+// Returns the leaf for key with its latch held shared; the caller releases
+// it with RWLOCK_READ_UNLOCK. upper, if given, receives the leaf's high key,
+// as in find_leaf_bounded.
+Node* find_leaf_shared(BPT *tree, int key, long long *upper) {
+    RWLOCK_READ_LOCK(&tree->root_latch);
+    Node *cursor = tree->root;
+    RWLOCK_READ_LOCK(&cursor->latch);
+    RWLOCK_READ_UNLOCK(&tree->root_latch);
+
+    for (;;) {
+        cursor = move_right(cursor, key, false);
+        if (cursor->is_leaf) break;
+        Node *child = child_at(tree, cursor, key_upper_bound(cursor->keys, cursor->n, key));
+        RWLOCK_READ_LOCK(&child->latch);
+        RWLOCK_READ_UNLOCK(&cursor->latch);
+        cursor = child;
+    }
+    if (upper) *upper = cursor->high_key;
+    return cursor;
+}
+
+// Returns the leaf for key latched shared, like find_leaf_shared, without
+// latching anything above it. Each internal node is read optimistically and
+// its version checked before the child or right sibling it led to is
+// trusted; a change by a writer restarts the descent. Stubs are read in
+// through the latched descent, which is also the fallback once restarts run
+// out.
+Node* find_leaf_optimistic(BPT *tree, int key) {
+    for (int attempt = 0; attempt < OLC_MAX_RESTARTS; attempt++) {
+        const unsigned int *parent_version = &tree->root_version;
+        unsigned int parent_seen;
+        if (!version_read(parent_version, &parent_seen)) continue;
+        Node *node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+
+        for (;;) {
+            if (node->is_leaf) {
+                RWLOCK_READ_LOCK(&node->latch);
+                if (version_valid(parent_version, parent_seen)) return move_right(node, key, false);
+                RWLOCK_READ_UNLOCK(&node->latch);
+                break;
+            }
+
+            unsigned int seen;
+            if (!version_read(&node->version, &seen) ||
+                !version_valid(parent_version, parent_seen)) break;
+            Node *child;
+            if (key >= __atomic_load_n(&node->high_key, __ATOMIC_RELAXED)) {
+                child = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+                if (!version_valid(&node->version, seen) || !child) break;
+            } else {
+                int n = __atomic_load_n(&node->n, __ATOMIC_RELAXED);
+                if (n < 0 || n > tree->T) break;
+                int c = key_upper_bound(node->keys, n, key);
+                child = __atomic_load_n(&node->children[c], __ATOMIC_ACQUIRE);
+                if (!version_valid(&node->version, seen)) break;
+                if (!child->loaded) return find_leaf_shared(tree, key, NULL);
+            }
+
+            parent_version = &node->version;
+            parent_seen = seen;
+            node = child;
+        }
+    }
+    return find_leaf_shared(tree, key, NULL);
+}
+
+// Exclusive latches a writer still holds, from the highest down to the leaf.
+// Entries of nodes the operation has freed are set to NULL.
+typedef struct LatchPath {
+    Node *nodes[BPT_MAX_HEIGHT];
+    int count;
+    bool root_latched;
+} LatchPath;
+
+static void release_latches(BPT *tree, LatchPath *path) {
+    if (path->root_latched) {
+        RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+        path->root_latched = false;
+    }
+    for (int i = 0; i < path->count; i++) {
+        if (path->nodes[i]) {
+            RWLOCK_WRITE_UNLOCK(&path->nodes[i]->latch);
+        }
+    }
+    path->count = 0;
+}
+
+static void forget_latch(LatchPath *path, Node *node) {
+    for (int i = 0; i < path->count; i++) {
+        if (path->nodes[i] == node) {
+            path->nodes[i] = NULL;
+        }
+    }
+}
+
+// Fewest keys a leaf other than the root holds before it is rebalanced.
+static int min_leaf_keys(BPT *tree) {
+    int min_keys = (tree->T - 1) * tree->policy.merge_percent / 100;
+    return min_keys > 0 ? min_keys : 1;
+}
+
+// Keys kept to spare by a borrow or merge, as the policy's hysteresis asks.
+static int spare_leaf_keys(BPT *tree) {
+    return (tree->T - 1) * tree->policy.hysteresis_percent / 100;
+}
+
+// A leaf above the minimum is not rebalanced. Internal nodes are never
+// rebalanced, only the root collapses once its last separator goes.
+static bool safe_for_delete(BPT *tree, Node *node, bool is_root) {
+    if (node->is_leaf) return node->n > min_leaf_keys(tree);
+    return !is_root || node->n > 1;
+}
+
+// Descends to the leaf for key with exclusive latches, keeping only those
+// of the nodes a delete may still change. Returns NULL with nothing latched
+// if key belongs to a node whose separator is not in its parent yet: a
+// delete does not rebalance around such a node, so it waits for the split
+// to finish and starts over.
+static Node* find_leaf_exclusive(BPT *tree, int key, LatchPath *path) {
+    path->count = 0;
+    path->root_latched = true;
+    RWLOCK_WRITE_LOCK(&tree->root_latch);
+
+    Node *cursor = tree->root;
+    bool is_root = true;
+    for (;;) {
+        RWLOCK_WRITE_LOCK(&cursor->latch);
+        if (key >= cursor->high_key) {
+            RWLOCK_WRITE_UNLOCK(&cursor->latch);
+            release_latches(tree, path);
+            return NULL;
+        }
+        if (safe_for_delete(tree, cursor, is_root)) {
+            release_latches(tree, path);
+        }
+        path->nodes[path->count++] = cursor;
+        if (cursor->is_leaf) return cursor;
+        cursor = child_at(tree, cursor, key_upper_bound(cursor->keys, cursor->n, key));
+        is_root = false;
+    }
+}
+
+// Descends with shared latches to the leaf for key and returns it latched
+// exclusively, for an insert or delete. Nothing above the leaf stays
+// latched: a split is passed up afterwards by insert_into_parent, and an
+// underfull leaf is left to the rebalancer.
+static Node* find_leaf_for_write(BPT *tree, int key) {
+    RWLOCK_READ_LOCK(&tree->root_latch);
+    Node *cursor = tree->root;
+    if (cursor->is_leaf) {
+        RWLOCK_WRITE_LOCK(&cursor->latch);
+    } else {
+        RWLOCK_READ_LOCK(&cursor->latch);
+    }
+    RWLOCK_READ_UNLOCK(&tree->root_latch);
+
+    for (;;) {
+        cursor = move_right(cursor, key, cursor->is_leaf);
+        if (cursor->is_leaf) return cursor;
+        Node *child = child_at(tree, cursor, key_upper_bound(cursor->keys, cursor->n, key));
+        if (child->is_leaf) {
+            RWLOCK_WRITE_LOCK(&child->latch);
+        } else {
+            RWLOCK_READ_LOCK(&child->latch);
+        }
+        RWLOCK_READ_UNLOCK(&cursor->latch);
+        cursor = child;
+    }
+}
+
+// Once inserts keep landing in the last leaf, they go straight to it,
+// latched on its own with no descent. The leaf is only trusted if it is
+// still in the tree, still last, and key is above its first key; otherwise
+// the caller descends as usual. A retired leaf is dropped from
+// tree->rightmost before it is retired, so the epoch keeps it readable here.
+static Node* find_leaf_for_append(BPT *tree, int key) {
+    if (__atomic_load_n(&tree->append_run, __ATOMIC_RELAXED) < BPT_APPEND_RUN) return NULL;
+    Node *leaf = __atomic_load_n(&tree->rightmost, __ATOMIC_ACQUIRE);
+    if (!leaf) return NULL;
+
+    RWLOCK_WRITE_LOCK(&leaf->latch);
+    if ((leaf->version & 1) == 0 && leaf->high_key == LLONG_MAX &&
+        leaf->n > 0 && key > leaf->keys[0]) {
+        return leaf;
+    }
+    RWLOCK_WRITE_UNLOCK(&leaf->latch);
+    return NULL;
+}
+
+// Counts inserts in a row into the last leaf, which is what decides whether
+// appends take the shortcut and split near the end. An insert anywhere else
+// ends the run.
+static bool note_append(BPT *tree, Node *leaf) {
+    if (leaf->high_key != LLONG_MAX) {
+        if (__atomic_load_n(&tree->append_run, __ATOMIC_RELAXED) != 0) {
+            __atomic_store_n(&tree->append_run, 0, __ATOMIC_RELAXED);
+        }
+        return false;
+    }
+    if (__atomic_load_n(&tree->rightmost, __ATOMIC_RELAXED) != leaf) {
+        __atomic_store_n(&tree->rightmost, leaf, __ATOMIC_RELEASE);
+    }
+    return __atomic_add_fetch(&tree->append_run, 1, __ATOMIC_RELAXED) >= BPT_APPEND_RUN;
+}
+
+// Leaves read lazily from the snapshot are not linked yet. The successor is
+// then found through the parents, and the link is kept for later scans.
+Node* next_leaf(BPT *tree, Node *leaf) {
+    if (leaf->next) return leaf->next;
+
+    Node *node = leaf;
+    while (node->parent) {
+        Node *parent = node->parent;
+        int index = index_in_parent(node);
+        if (index < parent->n) {
+            Node *cursor = child_at(tree, parent, index + 1);
+            while (!cursor->is_leaf) {
+                cursor = child_at(tree, cursor, 0);
+            }
+            leaf->next = cursor;
+            return cursor;
+        }
+        node = parent;
+    }
+    return NULL;
+}
+
 // ---------------------------------------------------------
 
 //BPT INSERTION 
@@ -33,116 +593,510 @@ BPT* create_BPT(const char* dataset_name, int T) {
 
 
 
-Node* split_leaf_node(BPT* tree, Node *node, int T, int *promote_key) {
-    int mid = (T - 1) / 2;
-    Node *new_leaf = create_node(tree->dataset_name, true, T);
+// Where a node that has overflowed to n keys splits: the left node keeps
+// mid keys. A leaf keeps the share the policy asks for, an internal node
+// half. A run of appends only adds to the last node of each level, so
+// there the left node keeps 90% of what it can hold, which leaves room for
+// keys that arrive slightly out of order and otherwise lets sequential keys
+// fill the tree.
+static int split_point(BPT *tree, int n, bool is_leaf, bool append) {
+    int mid;
+    if (append) {
+        mid = (n - 1) * 9 / 10;
+    } else if (is_leaf) {
+        mid = (n - 1) * tree->policy.split_percent / 100;
+    } else {
+        return n / 2;
+    }
+    if (mid > n - (is_leaf ? 1 : 2)) mid = n - (is_leaf ? 1 : 2);
+    return mid > 0 ? mid : 1;
+}
+
+Node* split_leaf_node(BPT* tree, Node *node, int mid, int *promote_key) {
+    Node *new_leaf = create_node(tree->arena, tree->dataset_name, true, tree->T);
     if (!new_leaf) return NULL;
 
     for (int i = mid; i < node->n; i++) {
         new_leaf->keys[i - mid] = node->keys[i];
     }
 
-    int *keys_to_move = malloc(sizeof(int) * (node->n - mid));
-    for (int i = 0; i < node->n - mid; i++) {
-        keys_to_move[i] = new_leaf->keys[i];
-    }
-    
-    if (dfh_move_lines(tree->dataset_name, node->file_pointer, new_leaf->file_pointer, 
-                       keys_to_move, node->n - mid) != DFH_SUCCESS) {
-        free(keys_to_move);
-        free_node_and_not_file(new_leaf);
+    if (dfh_copy_lines(tree->dataset_name, node->file_pointer, new_leaf->file_pointer,
+                       new_leaf->keys, node->n - mid) != DFH_SUCCESS) {
+        free_node(tree, new_leaf);
         return NULL;
     }
-    
-    free(keys_to_move);
 
+    version_begin(&node->version);
     new_leaf->n = node->n - mid;
     node->n = mid;
+    node->underfull = false;
+    node->trim = true;
+    mark_dirty(node);
 
     *promote_key = new_leaf->keys[0];
     new_leaf->next = node->next;
+    new_leaf->high_key = node->high_key;
+    new_leaf->count = new_leaf->n;
+    // An internal split that moves node to another parent takes the nodes
+    // linked after it along, so new_leaf is linked in under whichever parent
+    // node has at the time. Its keys stay counted in node's range there
+    // until its separator arrives.
+    RWLOCK_READ_LOCK(&tree->lineage_lock);
+    new_leaf->parent = node->parent;
+    node->count = node->n;
     node->next = new_leaf;
+    RWLOCK_READ_UNLOCK(&tree->lineage_lock);
+    node->high_key = *promote_key;
+    version_end(&node->version);
 
     return new_leaf;
 }
 
-Node* split_internal_node(const char* dataset_name, Node *node, int T, int *promote_key) {
-    int mid = node->n / 2;
-    Node *new_node = create_node(dataset_name, false, T);
+// Keys in the range of node and of the nodes linked after it that are
+// still waiting for their separators in parent, up to stop, the next child
+// of parent (NULL after the last). The caller holds the lineage lock
+// exclusively.
+static long long run_count(Node *node, Node *parent, Node *stop) {
+    long long count = 0;
+    for (; node && node != stop && node->parent == parent; node = node->next) {
+        count += node->count;
+    }
+    return count;
+}
 
+// Moves node under to, along with the nodes linked after it up to stop that
+// are still waiting for their separators in from.
+static void adopt_run(Node *node, Node *from, Node *to, Node *stop) {
+    while (node && node != stop && node->parent == from) {
+        Node *next = node->next;
+        set_parent(node, to);
+        node = next;
+    }
+}
+
+Node* split_internal_node(BPT* tree, Node *node, int mid, int *promote_key) {
+    Node *new_node = create_node(tree->arena, tree->dataset_name, false, tree->T);
+    // The moved children point at new_node before it is complete; a split
+    // climbing up from one of them waits on its latch until it is.
+    RWLOCK_WRITE_LOCK(&new_node->latch);
+
+    RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+    new_node->parent = node->parent;
+    version_begin(&node->version);
+    unpack_counts(node);
     for (int i = mid + 1; i < node->n; i++) {
         new_node->keys[i - mid - 1] = node->keys[i];
     }
 
     for (int i = mid + 1; i <= node->n; i++) {
         new_node->children[i - mid - 1] = node->children[i];
-        if (new_node->children[i - mid - 1]) {
-            new_node->children[i - mid - 1]->parent = new_node;
-        }
+        new_node->sums[i - mid - 1] = node->sums[i];
+    }
+    for (int i = mid + 1; i <= node->n; i++) {
+        adopt_run(node->children[i], node, new_node, i < node->n ? node->children[i + 1] : NULL);
         node->children[i] = NULL; 
     }
 
     *promote_key = node->keys[mid];
     new_node->n = node->n - mid - 1;
     node->n = mid;
+    pack_counts(node);
+    pack_counts(new_node);
+    new_node->next = node->next;
+    new_node->high_key = node->high_key;
+    node->next = new_node;
+    node->high_key = *promote_key;
+    RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+    mark_dirty(node);
+    version_end(&node->version);
+    RWLOCK_WRITE_UNLOCK(&new_node->latch);
 
     return new_node;
 }
 
-void propagate_up(BPT *tree, Node *child, Node *sibling, int promote_key) {
-    Node *parent = child->parent;
+// Inserts the separator for sibling, split off node with promote_key as its
+// lowest key, one level up, and carries on up while that level splits too.
+// The caller holds no latches; until the separator is in, sibling is found
+// through node's right link. The parent recorded in node may have split
+// since, so the separator goes to whichever node right of it now holds
+// promote_key. append says the split came from a run of appends, so a last
+// node that overflows here splits near its end as well.
+static void insert_into_parent(BPT *tree, Node *node, Node *sibling, int promote_key, bool append) {
+    for (;;) {
+        Node *parent = get_parent(node);
+        if (!parent) {
+            RWLOCK_WRITE_LOCK(&tree->root_latch);
+            if (tree->root == node) {
+                Node *new_root = create_node(tree->arena, tree->dataset_name, false, tree->T);
+                new_root->keys[0] = promote_key;
+                new_root->children[0] = node;
+                new_root->children[1] = sibling;
+                new_root->n = 1;
+                RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+                new_root->sums[0] = run_count(node, NULL, sibling);
+                new_root->sums[1] = run_count(sibling, NULL, NULL);
+                pack_counts(new_root);
+                adopt_run(node, NULL, new_root, sibling);
+                adopt_run(sibling, NULL, new_root, NULL);
+                RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+                version_begin(&tree->root_version);
+                __atomic_store_n(&tree->root, new_root, __ATOMIC_RELEASE);
+                version_end(&tree->root_version);
+                RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+                return;
+            }
+            RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+            // node was split off the old root, whose own split has not
+            // reached the new root yet.
+            THREAD_YIELD();
+            continue;
+        }
 
-    if (!parent) {
-        Node *new_root = create_node(tree->dataset_name, false, tree->T);
-        new_root->keys[0] = promote_key;
-        new_root->children[0] = child;
-        new_root->children[1] = sibling;
-        new_root->n = 1;
-        child->parent = new_root;
-        sibling->parent = new_root;
-        tree->root = new_root;
-    } else {
-        int i = parent->n - 1;
-        while (i >= 0 && parent->keys[i] > promote_key) {
-            parent->keys[i + 1] = parent->keys[i];
-            parent->children[i + 2] = parent->children[i + 1];
-            i--;
-        }
-        parent->keys[i + 1] = promote_key;
-        parent->children[i + 2] = sibling;
-        sibling->parent = parent;
+        RWLOCK_WRITE_LOCK(&parent->latch);
+        parent = move_right(parent, promote_key, true);
+        version_begin(&parent->version);
+        int i = key_upper_bound(parent->keys, parent->n, promote_key);
+        // sibling's range, and those of the nodes split off it since, now
+        // count under a child of their own.
+        RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+        unpack_counts(parent);
+        long long moved = run_count(sibling, parent, i < parent->n ? parent->children[i + 1] : NULL);
+        memmove(parent->keys + i + 1, parent->keys + i, (parent->n - i) * sizeof(int));
+        memmove(parent->children + i + 2, parent->children + i + 1, (parent->n - i) * sizeof(Node *));
+        memmove(parent->sums + i + 2, parent->sums + i + 1, (parent->n - i) * sizeof(long long));
+        parent->keys[i] = promote_key;
+        parent->children[i + 1] = sibling;
+        parent->sums[i] -= moved;
+        parent->sums[i + 1] = moved;
         parent->n++;
-
-        if (parent->n == tree->T) {
-            int new_promote_key;
-            Node *new_sibling = split_internal_node(tree->dataset_name, parent, tree->T, &new_promote_key);
-            propagate_up(tree, parent, new_sibling, new_promote_key);
+        pack_counts(parent);
+        RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+        mark_dirty(parent);
+        version_end(&parent->version);
+
+        if (parent->n < tree->T) {
+            RWLOCK_WRITE_UNLOCK(&parent->latch);
+            return;
         }
+        int next_promote_key;
+        int mid = split_point(tree, parent->n, false, append && i == parent->n - 1 && parent->high_key == LLONG_MAX);
+        Node *next_sibling = split_internal_node(tree, parent, mid, &next_promote_key);
+        RWLOCK_WRITE_UNLOCK(&parent->latch);
+        node = parent;
+        sibling = next_sibling;
+        promote_key = next_promote_key;
     }
 }
 
-void insert(BPT *tree, int key, const char* line) {
-    Node *cursor = tree->root;
+// Waits for the logged operation lsn to be durable before it is answered.
+// The caller holds no latch and has let go of the tree, so writers that
+// wait together share one sync.
+static int commit_write(BPT *tree, unsigned int type, int key, Lsn lsn) {
+    if (wal_commit(tree->wal, lsn) != DFH_SUCCESS) {
+        printf("Error: Could not log %s of key %d\n", type == WAL_INSERT ? "insert" : "delete", key);
+        return -1;
+    }
+    return 0;
+}
 
-    // Traverse to leaf node
-    while (!cursor->is_leaf) {
-        int i = 0;
-        while (i < cursor->n && key >= cursor->keys[i]) i++;
-        cursor = cursor->children[i];
+// Numbers a write to key in leaf, which is latched, and keeps the image it
+// replaces for the range scans that are open.
+static void keep_image(BPT *tree, Node *leaf, int key, bool present) {
+    Version version = versions_next(tree->versions);
+    if (!versions_wanted(tree->versions)) return;
+    if (!present) {
+        versions_keep(tree->versions, version, key, NULL, 0);
+        return;
     }
-    insert_into_leaf(tree->dataset_name, cursor, key, line);
 
-    
+    DfhMapping mapping;
+    const char *line;
+    size_t length;
+    if (dfh_map_leaf(tree->dataset_name, leaf->file_pointer, &mapping) == DFH_SUCCESS &&
+        dfh_mapping_find(&mapping, key, &line, &length) == DFH_SUCCESS) {
+        versions_keep(tree->versions, version, key, line, length);
+    }
+    dfh_unmap_leaf(&mapping);
+}
+
+// Applies an insert and returns its lsn. A new one has lsn 0 and is
+// appended to the log here, once its leaf is latched, so that writes to one
+// key reach the log in the order they are applied; the caller commits it.
+// An existing key only has its line replaced, so replaying a record the
+// index already covers is harmless.
+static Lsn write_insert(BPT *tree, int key, const char* line, Lsn lsn) {
+    Node *cursor = find_leaf_for_append(tree, key);
+    if (!cursor) {
+        cursor = find_leaf_for_write(tree, key);
+    }
+    if (lsn == 0) {
+        lsn = wal_append(tree->wal, WAL_INSERT, key, line);
+    }
+
+    bool exists = binary_search(cursor->keys, cursor->n, key) != -1;
+    keep_image(tree, cursor, key, exists);
+    if (exists) {
+        if (dfh_write_line(tree->dataset_name, cursor->file_pointer, key, line) != DFH_SUCCESS) {
+            printf("Failed to write data for key %d\n", key);
+        }
+        RWLOCK_WRITE_UNLOCK(&cursor->latch);
+        finish_write(tree, lsn);
+        return lsn;
+    }
+    bool append = note_append(tree, cursor);
+    int before = cursor->n;
+    insert_into_leaf(tree->dataset_name, cursor, key, line);
+    if (cursor->n > before) {
+        add_count(&tree->lineage_lock, cursor, key, 1);
+    }
 
     // Handle node splitting if necessary
+    int promote_key;
+    Node *new_leaf = NULL;
     if (cursor->n == tree->T) {
-        int promote_key;
-        Node *new_leaf = split_leaf_node(tree, cursor, tree->T, &promote_key);
-        propagate_up(tree, cursor, new_leaf, promote_key);
+        new_leaf = split_leaf_node(tree, cursor, split_point(tree, cursor->n, true, append), &promote_key);
+        if (new_leaf && new_leaf->high_key == LLONG_MAX) {
+            __atomic_store_n(&tree->rightmost, new_leaf, __ATOMIC_RELEASE);
+        }
+    }
+    RWLOCK_WRITE_UNLOCK(&cursor->latch);
+    if (new_leaf) {
+        insert_into_parent(tree, cursor, new_leaf, promote_key, append);
     }
+    finish_write(tree, lsn);
+    return lsn;
+}
+
+// Applies an insert that is already in the log.
+void apply_insert(BPT *tree, int key, const char* line, Lsn lsn) {
+    write_insert(tree, key, line, lsn);
+}
 
-    // Save tree state after insertion
-    save_tree_to_json(tree);
+void insert(BPT *tree, int key, const char* line) {
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    Lsn lsn = write_insert(tree, key, line, 0);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
+    commit_write(tree, WAL_INSERT, key, lsn);
+    reclaim_unreachable(tree);
+    checkpoint_if_due(tree);
+}
+
+// ---------------------------------------------------------
+
+// BPT BULK LOADING
+
+// Size of group g when count items are split into groups as evenly as
+// possible.
+static int group_size(int count, int groups, int g) {
+    return count / groups + (g < count % groups ? 1 : 0);
+}
+
+// Builds the tree bottom-up from records with strictly ascending keys. Leaves
+// are filled left to right to fill_factor of their capacity, each with one
+// sequential write of its data, then every internal level is made from the
+// one below. Returns -1 unless the tree is empty. The caller holds
+// tree_lock shared: root_latch keeps writers out until the new tree is
+// published, while readers still find the empty root. Nothing is logged:
+// the caller must checkpoint once it lets go of the tree, before the load
+// is acknowledged.
+int bulk_load(BPT *tree, const int *keys, const char *const *lines, int count, double fill_factor) {
+    for (int i = 1; i < count; i++) {
+        if (keys[i] <= keys[i - 1]) return -1;
+    }
+
+    RWLOCK_WRITE_LOCK(&tree->root_latch);
+    Node *empty_root = tree->root;
+    RWLOCK_WRITE_LOCK(&empty_root->latch);
+    bool empty = empty_root->is_leaf && empty_root->n == 0;
+    RWLOCK_WRITE_UNLOCK(&empty_root->latch);
+    if (!empty || count == 0) {
+        RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+        return empty ? 0 : -1;
+    }
+
+    if (fill_factor < 0.5 || fill_factor > 1.0) fill_factor = BULK_LOAD_FILL_FACTOR;
+    int leaf_capacity = (int)((tree->T - 1) * fill_factor);
+    if (leaf_capacity < 1) leaf_capacity = 1;
+    int fanout = (int)(tree->T * fill_factor);
+    if (fanout < 3) fanout = 3;
+    if (fanout > tree->T) fanout = tree->T;
+
+    int width = (count + leaf_capacity - 1) / leaf_capacity;
+    Node **level = malloc(width * sizeof(Node *));
+    int *low_keys = malloc(width * sizeof(int));
+    if (!level || !low_keys) {
+        memory_allocation_failed();
+    }
+
+    int start = 0;
+    for (int l = 0; l < width; l++) {
+        int size = group_size(count, width, l);
+        Node *leaf = create_node(tree->arena, tree->dataset_name, true, tree->T);
+        memcpy(leaf->keys, keys + start, size * sizeof(int));
+        leaf->n = size;
+        leaf->count = size;
+        if (dfh_write_lines(tree->dataset_name, leaf->file_pointer, keys + start, lines + start, size) != DFH_SUCCESS) {
+            printf("Error: Could not write leaf data during bulk load of %s\n", tree->dataset_name);
+            for (int i = 0; i <= l; i++) {
+                free_node(tree, i < l ? level[i] : leaf);
+            }
+            free(level);
+            free(low_keys);
+            RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+            return -1;
+        }
+        if (l > 0) {
+            level[l - 1]->next = leaf;
+            level[l - 1]->high_key = keys[start];
+        }
+        level[l] = leaf;
+        low_keys[l] = keys[start];
+        start += size;
+    }
+
+    // Each parent takes the next run of nodes; its separators are the
+    // smallest keys under every child but the first. Parents are stored
+    // over the level they were built from.
+    while (width > 1) {
+        int parents = (width + fanout - 1) / fanout;
+        int child = 0;
+        for (int p = 0; p < parents; p++) {
+            int size = group_size(width, parents, p);
+            Node *node = create_node(tree->arena, tree->dataset_name, false, tree->T);
+            for (int c = 0; c < size; c++) {
+                node->children[c] = level[child + c];
+                node->sums[c] = level[child + c]->count;
+                level[child + c]->parent = node;
+                if (c > 0) {
+                    node->keys[c - 1] = low_keys[child + c];
+                }
+            }
+            node->n = size - 1;
+            pack_counts(node);
+            if (p > 0) {
+                level[p - 1]->next = node;
+                level[p - 1]->high_key = low_keys[child];
+            }
+            level[p] = node;
+            low_keys[p] = low_keys[child];
+            child += size;
+        }
+        width = parents;
+    }
+
+    RWLOCK_WRITE_LOCK(&empty_root->latch);
+    version_begin(&tree->root_version);
+    version_begin(&empty_root->version);
+    __atomic_store_n(&tree->root, level[0], __ATOMIC_RELEASE);
+    version_end(&tree->root_version);
+    RWLOCK_WRITE_UNLOCK(&tree->root_latch);
+
+    dfh_remove_datafile(tree->dataset_name, empty_root->file_pointer);
+    snapshot_release(tree->snapshot, empty_root->slot);
+    RWLOCK_WRITE_UNLOCK(&empty_root->latch);
+    retire_node(tree, empty_root);
+    free(level);
+    free(low_keys);
+    return count;
+}
+
+// Merges a run of sorted, distinct keys that all belong in leaf: its data is
+// rewritten once, and if it overflows it is split once into as many leaves
+// as the keys need.
+static void insert_run(BPT *tree, Node *leaf, const int *keys, const char *const *lines, int count) {
+    // Cursors hold the tree only while they load a leaf, so one may be open
+    for (int i = 0; i < count; i++) {
+        keep_image(tree, leaf, keys[i], binary_search(leaf->keys, leaf->n, keys[i]) != -1);
+    }
+    if (dfh_write_lines(tree->dataset_name, leaf->file_pointer, keys, lines, count) != DFH_SUCCESS) {
+        printf("Failed to write data for keys %d to %d\n", keys[0], keys[count - 1]);
+        return;
+    }
+
+    int *merged = malloc((leaf->n + count) * sizeof(int));
+    if (!merged) {
+        memory_allocation_failed();
+    }
+    int total = 0, existing = 0, incoming = 0;
+    while (existing < leaf->n || incoming < count) {
+        if (incoming == count || (existing < leaf->n && leaf->keys[existing] < keys[incoming])) {
+            merged[total++] = leaf->keys[existing++];
+        } else {
+            if (existing < leaf->n && leaf->keys[existing] == keys[incoming]) existing++;
+            merged[total++] = keys[incoming++];
+        }
+    }
+
+    add_count(&tree->lineage_lock, leaf, keys[0], total - leaf->n);
+    int pieces = (total + tree->T - 2) / (tree->T - 1);
+    if (pieces <= 1) {
+        memcpy(leaf->keys, merged, total * sizeof(int));
+        leaf->n = total;
+        mark_dirty(leaf);
+        free(merged);
+        return;
+    }
+
+    Node **piece = malloc(pieces * sizeof(Node *));
+    if (!piece) {
+        memory_allocation_failed();
+    }
+    piece[0] = leaf;
+    int start = group_size(total, pieces, 0);
+    for (int j = 1; j < pieces; j++) {
+        int size = group_size(total, pieces, j);
+        piece[j] = create_node(tree->arena, tree->dataset_name, true, tree->T);
+        memcpy(piece[j]->keys, merged + start, size * sizeof(int));
+        piece[j]->n = size;
+        start += size;
+    }
+
+    for (int j = 1; j < pieces; j++) {
+        if (dfh_copy_lines(tree->dataset_name, leaf->file_pointer, piece[j]->file_pointer,
+                           piece[j]->keys, piece[j]->n) != DFH_SUCCESS) {
+            printf("Failed to move data for keys from %d\n", piece[j]->keys[0]);
+        }
+    }
+    memcpy(leaf->keys, merged, group_size(total, pieces, 0) * sizeof(int));
+    leaf->n = group_size(total, pieces, 0);
+    leaf->underfull = false;
+    leaf->trim = true;
+    mark_dirty(leaf);
+
+    piece[pieces - 1]->next = leaf->next;
+    piece[pieces - 1]->high_key = leaf->high_key;
+    for (int j = 1; j < pieces; j++) {
+        piece[j - 1]->next = piece[j];
+        piece[j - 1]->high_key = piece[j]->keys[0];
+        piece[j]->parent = leaf->parent;
+        piece[j]->count = piece[j]->n;
+    }
+    leaf->count = leaf->n;
+    for (int j = 1; j < pieces; j++) {
+        insert_into_parent(tree, piece[j - 1], piece[j], piece[j]->keys[0], false);
+    }
+
+    free(piece);
+    free(merged);
+}
+
+// Applies a batch that is already in the log, with keys sorted and
+// distinct. Each run of keys bound for the same leaf costs one descent and
+// one rewrite of that leaf; lsn is the last record of the batch. The caller
+// holds tree_lock exclusively, so no latches are taken.
+void apply_insert_batch(BPT *tree, const int *keys, const char *const *lines, int count, Lsn lsn) {
+    int i = 0;
+    while (i < count) {
+        long long upper;
+        Node *leaf = find_leaf_bounded(tree, keys[i], &upper);
+        int end = i + 1;
+        while (end < count && keys[end] < upper) end++;
+        insert_run(tree, leaf, keys + i, lines + i, end - i);
+        i = end;
+    }
+    finish_write(tree, lsn);
 }
 
 // ---------------------------------------------------------
@@ -150,12 +1104,7 @@ void insert(BPT *tree, int key, const char* line) {
 // BPT SEARCHING 
 
 Node* search(BPT *tree,int key) {
-    Node *cursor = tree->root;
-    while (!cursor->is_leaf) {
-        int i = 0;
-        while (i < cursor->n && key >= cursor->keys[i]) i++;
-        cursor = cursor->children[i];
-    }
+    Node *cursor = find_leaf(tree, key);
     int pos = binary_search(cursor->keys, cursor->n, key);
     if (pos == -1) {
         return NULL;
@@ -164,22 +1113,21 @@ Node* search(BPT *tree,int key) {
     }
 }
 
+// Lists the files of the leaves holding keys in [low_limit, up_limit],
+// NULL-terminated. The first key in range is at *low_offset in the first
+// leaf and the last at *up_offset in the last. Returns NULL when no key is
+// in range.
 char** ranged_query(BPT *tree, int low_limit, int up_limit, int *low_offset, int *up_offset) {
-    
-    Node *low_limit_node = search(tree, low_limit);
-    if (low_limit_node == NULL) {
-        return NULL;
-    }
-   
-
-    Node *up_limit_node = search(tree, up_limit);
-    if (up_limit_node == NULL) {
-        return NULL;
+    if (low_limit > up_limit) return NULL;
+
+    Node *first = find_leaf(tree, low_limit);
+    int low = low_limit == INT_MIN ? 0 : key_upper_bound(first->keys, first->n, low_limit - 1);
+    while (low == first->n) {
+        first = next_leaf(tree, first);
+        if (first == NULL) return NULL;
+        low = 0;
     }
-  
-
-    (*low_offset) = binary_search(low_limit_node->keys, low_limit_node->n, low_limit);
-    (*up_offset) = binary_search(up_limit_node->keys, up_limit_node->n, up_limit);
+    if (first->keys[low] > up_limit) return NULL;
 
     int size = 0, capacity = 50;
     char **result = (char **)malloc(sizeof(char *) * capacity);
@@ -187,35 +1135,317 @@ char** ranged_query(BPT *tree, int low_limit, int up_limit, int *low_offset, int
         memory_allocation_failed();
     }
 
-   
-    append(result, &size, &capacity, low_limit_node->file_pointer);
+    Node *last = first;
+    for (Node *cursor = first; cursor != NULL; cursor = next_leaf(tree, cursor)) {
+        if (cursor->n == 0) continue;
+        if (cursor->keys[0] > up_limit) break;
+        result = append(result, &size, &capacity, cursor->file_pointer);
+        last = cursor;
+    }
 
-    Node *cursor = low_limit_node->next;
-    while (cursor != up_limit_node) {
-        if (cursor == NULL) {
-            break;
+    *low_offset = low;
+    *up_offset = key_upper_bound(last->keys, last->n, up_limit) - 1;
+    result = append(result, &size, &capacity, NULL);  // Null terminate the array
+    return result;
+}
+
+// ---------------------------------------------------------
+
+// BPT CURSORS
+
+// Copies a record into the cursor's window; the window is filled in key
+// order.
+static void cursor_push(Cursor *cursor, int key, size_t offset, size_t length) {
+    if (cursor->count == cursor->capacity) {
+        cursor->capacity = cursor->capacity ? cursor->capacity * 2 : 64;
+        cursor->entries = realloc(cursor->entries, cursor->capacity * sizeof(CursorEntry));
+        if (!cursor->entries) {
+            memory_allocation_failed();
         }
-        append(result, &size, &capacity, cursor->file_pointer);
-        cursor = cursor->next;
     }
+    CursorEntry *entry = &cursor->entries[cursor->count++];
+    entry->key = key;
+    entry->offset = offset;
+    entry->length = length;
+}
 
-    if (cursor == up_limit_node) {
-        append(result, &size, &capacity, up_limit_node->file_pointer);
+static void cursor_add(Cursor *cursor, int key, const char *line, size_t length) {
+    if (cursor->text_size + length > cursor->text_capacity) {
+        while (cursor->text_size + length > cursor->text_capacity) {
+            cursor->text_capacity = cursor->text_capacity ? cursor->text_capacity * 2 : 4096;
+        }
+        cursor->text = realloc(cursor->text, cursor->text_capacity);
+        if (!cursor->text) {
+            memory_allocation_failed();
+        }
     }
+    memcpy(cursor->text + cursor->text_size, line, length);
+    cursor_push(cursor, key, cursor->text_size, length);
+    cursor->text_size += length;
+}
 
-    result[size] = NULL;  // Null terminate the array
-    return result;
+// Puts back, for each key of the window written since the cursor was
+// opened, the image it had then.
+static void cursor_restore(Cursor *cursor) {
+    int low_key = cursor->low < INT_MIN ? INT_MIN : (int)cursor->low;
+    int high_key = cursor->high > INT_MAX ? INT_MAX : (int)(cursor->high - 1);
+    VersionImage *images;
+    int count = versions_collect(cursor->tree->versions, cursor->pinned, low_key, high_key, &images);
+    if (count == 0) return;
+
+    CursorEntry *read = cursor->entries;
+    int read_count = cursor->count;
+    cursor->entries = NULL;
+    cursor->count = 0;
+    cursor->capacity = 0;
+    int i = 0, j = 0;
+    while (i < read_count || j < count) {
+        if (j < count && (i == read_count || images[j].key <= read[i].key)) {
+            if (images[j].present) {
+                cursor_add(cursor, images[j].key, images[j].line, strlen(images[j].line));
+            }
+            if (i < read_count && read[i].key == images[j].key) i++;
+            j++;
+        } else {
+            cursor_push(cursor, read[i].key, read[i].offset, read[i].length);
+            i++;
+        }
+    }
+    free(read);
+    versions_free_images(images, count);
+}
+
+// Fills the window with the keys of leaf in [from, to), and releases the
+// leaf's latch.
+static void cursor_fill(Cursor *cursor, Node *leaf, long long from, long long to) {
+    BPT *tree = cursor->tree;
+    cursor->count = 0;
+    cursor->text_size = 0;
+
+    DfhMapping mapping;
+    dfh_map_leaf(tree->dataset_name, leaf->file_pointer, &mapping);
+    for (int i = 0; i < leaf->n; i++) {
+        int key = leaf->keys[i];
+        // A merge or borrow since the last descent may have moved keys
+        // already passed into this leaf.
+        if (key < from || key >= to) continue;
+        const char *line;
+        size_t length;
+        if (dfh_mapping_find(&mapping, key, &line, &length) == DFH_SUCCESS) {
+            cursor_add(cursor, key, line, length);
+        } else {
+            printf("Failed to read data for key %d\n", key);
+        }
+    }
+    dfh_unmap_leaf(&mapping);
+    RWLOCK_READ_UNLOCK(&leaf->latch);
+}
+
+// Moves the window to the leaf holding from, starting at from. The leaf
+// after it is read ahead when the cursor is already walking forward and
+// the caller will read past this one. Like each load, it holds the tree
+// shared only while it reads the leaf.
+static void cursor_load_forward(Cursor *cursor, int from, bool walking) {
+    BPT *tree = cursor->tree;
+    long long lower, upper;
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    Node *leaf = find_leaf_between(tree, from, &lower, &upper);
+    // A leaf cannot be merged away while its left neighbour is latched.
+    if (walking && upper <= cursor->last && leaf->next) {
+        dfh_prefetch_leaf(tree->dataset_name, leaf->next->file_pointer);
+    }
+    cursor_fill(cursor, leaf, from, upper);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    cursor->low = from;
+    cursor->high = upper;
+    cursor_restore(cursor);
+}
+
+// Moves the window to the leaf holding the keys just below to, ending there.
+static void cursor_load_backward(Cursor *cursor, int to) {
+    BPT *tree = cursor->tree;
+    long long lower, upper;
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    Node *leaf = find_leaf_between(tree, to - 1, &lower, &upper);
+    if (leaf->n > 0 && leaf->keys[0] < lower) {
+        lower = leaf->keys[0];
+    }
+    cursor_fill(cursor, leaf, lower, to);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    cursor->low = lower;
+    cursor->high = to;
+    cursor_restore(cursor);
+}
+
+// Loads windows forward until one has an entry or the keys run out.
+static bool cursor_settle_forward(Cursor *cursor, bool walking) {
+    while (cursor->position >= cursor->count && cursor->high != LLONG_MAX) {
+        cursor_load_forward(cursor, (int)cursor->high, walking);
+        cursor->position = 0;
+    }
+    return cursor->position < cursor->count;
+}
+
+// Opens a cursor on tree placed before its first key, so that
+// cursor_next starts from the beginning. A caller that stops at a known key
+// can set last to it.
+void cursor_open(BPT *tree, Cursor *cursor) {
+    memset(cursor, 0, sizeof(Cursor));
+    cursor->tree = tree;
+    cursor->epoch = epoch_enter();
+    // Not in the middle of a batch, which keeps no latches
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    cursor->pinned = versions_pin(tree->versions);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    cursor->low = LLONG_MIN;
+    cursor->high = INT_MIN;
+    cursor->position = -1;
+    cursor->last = INT_MAX;
+}
+
+// Places the cursor at the first key >= key. Returns false, with the cursor
+// past the last key, when there is none.
+bool cursor_seek(Cursor *cursor, int key) {
+    cursor_load_forward(cursor, key, false);
+    cursor->position = 0;
+    return cursor_settle_forward(cursor, false);
+}
+
+bool cursor_next(Cursor *cursor) {
+    if (cursor->position < cursor->count) cursor->position++;
+    return cursor_settle_forward(cursor, true);
+}
+
+bool cursor_prev(Cursor *cursor) {
+    if (cursor->position >= 0) cursor->position--;
+    while (cursor->position < 0 && cursor->low > INT_MIN) {
+        cursor_load_backward(cursor, (int)cursor->low);
+        cursor->position = cursor->count - 1;
+    }
+    return cursor->position >= 0;
+}
+
+// Reads the record the cursor is at without moving it. line is not
+// NUL-terminated and stays valid until the cursor moves.
+bool cursor_peek(Cursor *cursor, int *key, const char **line, size_t *length) {
+    if (cursor->position < 0 || cursor->position >= cursor->count) return false;
+    CursorEntry *entry = &cursor->entries[cursor->position];
+    *key = entry->key;
+    *line = cursor->text + entry->offset;
+    *length = entry->length;
+    return true;
+}
+
+void cursor_close(Cursor *cursor) {
+    BPT *tree = cursor->tree;
+    versions_unpin(tree->versions, cursor->pinned);
+    epoch_exit(cursor->epoch);
+    free(cursor->entries);
+    free(cursor->text);
+    cursor->entries = NULL;
+    cursor->text = NULL;
 }
 
 // ---------------------------------------------------------
 
+// BPT ORDER STATISTICS
+
+// Each internal node keeps the count of every child's range as prefix
+// sums, so these walk one path from the root, O(log T) per level, and never
+// open a data file. They crab down with shared latches like any reader and
+// follow right links past nodes split off, counting each whole; see node.c
+// for how the counts are kept. While writes are in flight a count may take
+// in some of them and not others.
+
+// Keys below key, or up to it when inclusive.
+static long long rank_bound(BPT *tree, int key, bool inclusive) {
+    RWLOCK_READ_LOCK(&tree->root_latch);
+    Node *cursor = tree->root;
+    RWLOCK_READ_LOCK(&cursor->latch);
+    RWLOCK_READ_UNLOCK(&tree->root_latch);
+
+    long long rank = 0;
+    for (;;) {
+        while (key >= cursor->high_key && cursor->next) {
+            rank += cursor->is_leaf ? cursor->n : __atomic_load_n(&cursor->count, __ATOMIC_RELAXED);
+            Node *right = cursor->next;
+            RWLOCK_READ_LOCK(&right->latch);
+            RWLOCK_READ_UNLOCK(&cursor->latch);
+            cursor = right;
+        }
+        if (cursor->is_leaf) break;
+        int c = key_upper_bound(cursor->keys, cursor->n, key);
+        rank += count_before(cursor, c);
+        Node *child = child_at(tree, cursor, c);
+        RWLOCK_READ_LOCK(&child->latch);
+        RWLOCK_READ_UNLOCK(&cursor->latch);
+        cursor = child;
+    }
+    if (inclusive) {
+        rank += key_upper_bound(cursor->keys, cursor->n, key);
+    } else if (key != INT_MIN) {
+        rank += key_upper_bound(cursor->keys, cursor->n, key - 1);
+    }
+    RWLOCK_READ_UNLOCK(&cursor->latch);
+    return rank;
+}
+
+// Number of keys below key.
+long long rank_key(BPT *tree, int key) {
+    return rank_bound(tree, key, false);
+}
+
+// Number of keys in [low, high]. The bounds are ranked one after the
+// other, so a count that writes in between make negative is taken as 0.
+long long count_keys(BPT *tree, int low, int high) {
+    if (low > high) return 0;
+    long long below = rank_bound(tree, low, false);
+    long long count = rank_bound(tree, high, true) - below;
+    return count > 0 ? count : 0;
+}
+
+// Finds the key with index keys below it; false past the last key.
+bool select_key(BPT *tree, long long index, int *key) {
+    if (index < 0) return false;
+    RWLOCK_READ_LOCK(&tree->root_latch);
+    Node *cursor = tree->root;
+    RWLOCK_READ_LOCK(&cursor->latch);
+    RWLOCK_READ_UNLOCK(&tree->root_latch);
+
+    bool found = false;
+    for (;;) {
+        long long size = cursor->is_leaf ? cursor->n : __atomic_load_n(&cursor->count, __ATOMIC_RELAXED);
+        while (index >= size && cursor->next) {
+            index -= size;
+            Node *right = cursor->next;
+            RWLOCK_READ_LOCK(&right->latch);
+            RWLOCK_READ_UNLOCK(&cursor->latch);
+            cursor = right;
+            size = cursor->is_leaf ? cursor->n : __atomic_load_n(&cursor->count, __ATOMIC_RELAXED);
+        }
+        if (cursor->is_leaf) {
+            if (index < cursor->n) {
+                *key = cursor->keys[index];
+                found = true;
+            }
+            break;
+        }
+        int c = child_by_count(cursor, &index);
+        Node *child = child_at(tree, cursor, c);
+        RWLOCK_READ_LOCK(&child->latch);
+        RWLOCK_READ_UNLOCK(&cursor->latch);
+        cursor = child;
+    }
+    RWLOCK_READ_UNLOCK(&cursor->latch);
+    return found;
+}
+
 // BPT GETTING LEAF NODES 
 
 Node* get_last_leaf_node(BPT *tree) {
-    int key = tree->root->keys[tree->root->n - 1];
-    Node *cursor = search(tree, key);
-    while (cursor->next) {
-        cursor = cursor->next;
+    Node *cursor = tree->root;
+    while (!cursor->is_leaf) {
+        cursor = child_at(tree, cursor, cursor->n);
     }
     return cursor;
 }
@@ -223,7 +1453,7 @@ Node* get_last_leaf_node(BPT *tree) {
 Node* get_first_leaf_node(BPT *tree) {
     Node *cursor = tree->root;
     while (!cursor->is_leaf) {
-        cursor = cursor->children[0];
+        cursor = child_at(tree, cursor, 0);
     }
     return cursor;
 }
@@ -235,6 +1465,10 @@ Node* get_first_leaf_node(BPT *tree) {
 
 void print_tree(Node *node, int level) {
     if (node == NULL) return;  
+    if (!node->loaded) {
+        printf("Level %d: (not loaded)\n", level);
+        return;
+    }
 
     printf("Level %d: ", level);
     for (int i = 0; i < node->n; i++) {
@@ -255,19 +1489,10 @@ void print_tree(Node *node, int level) {
 
 // BPT DELETION 
 
-int index_in_parent(Node *node) {
-    Node *parent = node->parent;
-    for (int i = 0; i <= parent->n; i++) {
-        if (parent->children[i] == node) {
-            return i;
-        }
-    }
-    return -1;
-}
-
 void delete_key(Node *node, int key) {
     if (node->n == 1 && node->keys[0] == key) {
         node->n = 0;
+        mark_dirty(node);
         return;
     }
     int pos = binary_search(node->keys, node->n, key);
@@ -278,6 +1503,7 @@ void delete_key(Node *node, int key) {
         node->keys[i] = node->keys[i + 1];
     }
     node->n--;
+    mark_dirty(node);
 }
 
 void delete_child(Node *node, int child_index) {
@@ -285,156 +1511,101 @@ void delete_child(Node *node, int child_index) {
         node->children[i] = node->children[i + 1];
     }
     node->children[node->n] = NULL;
+    mark_dirty(node);
 }
 
-void merge(Node *taker, Node *giver, Node *parent, const char* dataset_name) {
-   
-    
+// Moves giver into taker and retires it; the giver's latch is released.
+void merge(BPT *tree, Node *taker, Node *giver, Node *parent) {
     if (taker->is_leaf) {
-        char* new_file = generate_file_pointer();
-        dfh_create_datafile(dataset_name, new_file);
-        
-        // Copy all entries from taker
-        for (int i = 0; i < taker->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( dataset_name, taker->file_pointer, taker->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( dataset_name, new_file, taker->keys[i], buffer);
-        }
-        
-        // Copy all entries from giver
-        for (int i = 0; i < giver->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( dataset_name, giver->file_pointer, giver->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( dataset_name, new_file, giver->keys[i], buffer);
-        }
-        
-        // Delete old files
-        char* old_taker = taker->file_pointer;
-        char* old_giver = giver->file_pointer;
-        taker->file_pointer = new_file;
-        
-        char* full_path = get_full_path(dataset_name, old_taker);
-        remove(full_path);
-        free(full_path);
-        
-        full_path = get_full_path(dataset_name, old_giver);
-        remove(full_path);
-        free(full_path);
+        dfh_copy_lines(tree->dataset_name, giver->file_pointer, taker->file_pointer, giver->keys, giver->n);
+        retire_file(tree, giver->file_pointer);
     }
     
+    version_begin(&taker->version);
+    version_begin(&giver->version);
+    version_begin(&parent->version);
+    RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+    unpack_counts(parent);
+    if (!taker->is_leaf) {
+        unpack_counts(taker);
+        unpack_counts(giver);
+    }
     for (int i = 0; i < giver->n; i++) {
         insert_into_node(taker, giver->keys[i]);
     }
-    if (!taker->is_leaf) {
+    if (taker->is_leaf) {
+        taker->count = taker->n;
+    } else {
         for (int i = 0; i <= giver->n; i++) {
             taker->children[taker->n + i] = giver->children[i];
-            if (giver->children[i]) {
-                giver->children[i]->parent = taker;
-            }
+            taker->sums[taker->n + i] = giver->sums[i];
+            adopt_run(giver->children[i], giver, taker, i < giver->n ? giver->children[i + 1] : NULL);
         }
+        pack_counts(taker);
+        mark_dirty(taker);
     }
-    if (taker->is_leaf) {
-        taker->next = giver->next;
-    }
+    taker->next = giver->next;
+    taker->high_key = giver->high_key;
     
     int giver_index = index_in_parent(giver);
+    parent->sums[index_in_parent(taker)] += parent->sums[giver_index];
+    memmove(parent->sums + giver_index, parent->sums + giver_index + 1,
+            (parent->n - giver_index) * sizeof(long long));
     delete_child(parent, giver_index);
     if (giver_index > 0) {
         delete_key(parent, parent->keys[giver_index - 1]);
     } else {
         delete_key(parent, parent->keys[0]);
     }
-    free(giver->keys);
-    free(giver->children);
-    free(giver);
+    pack_counts(parent);
+    RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+    version_end(&parent->version);
+    version_end(&taker->version);
+    snapshot_release(tree->snapshot, giver->slot);
+    RWLOCK_WRITE_UNLOCK(&giver->latch);
+    retire_node(tree, giver);
 }
 
-void borrow_keys(Node *lender, Node *borrower, Node *parent, bool borrow_from_right, const char* dataset_name) {
-   
-   
-    // Create a new data file for the merged result
-    char* new_file = generate_file_pointer();
-    dfh_create_datafile(dataset_name, new_file);
-    
+// Moves the lender's first or last key into borrower. Its record is copied
+// first, as in merge, so no file is touched under the lineage lock.
+void borrow_keys(BPT *tree, Node *lender, Node *borrower, Node *parent, bool borrow_from_right) {
+    int key = borrow_from_right ? lender->keys[0] : lender->keys[lender->n - 1];
+    if (lender->is_leaf) {
+        dfh_copy_lines(tree->dataset_name, lender->file_pointer, borrower->file_pointer, &key, 1);
+        lender->trim = true;
+    }
+
+    version_begin(&lender->version);
+    version_begin(&borrower->version);
+    version_begin(&parent->version);
+    RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+    unpack_counts(parent);
+    parent->sums[index_in_parent(lender)]--;
+    parent->sums[index_in_parent(borrower)]++;
     if (borrow_from_right) {
-        int key = lender->keys[0];
-      
-        if (lender->is_leaf) {
-            // Copy all borrower's current entries to new file
-            for (int i = 0; i < borrower->n; i++) {
-                char buffer[MAX_LINE_SIZE];
-                dfh_read_line(dataset_name, borrower->file_pointer, borrower->keys[i], buffer, MAX_LINE_SIZE);
-                dfh_write_line(dataset_name, new_file, borrower->keys[i], buffer);
-               
-            }
-            
-            // Copy the borrowed key
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line(dataset_name, lender->file_pointer, key, buffer, MAX_LINE_SIZE);
-            dfh_write_line(dataset_name, new_file, key, buffer);
-         
-            
-            // Delete old borrower file
-            char* old_borrower = borrower->file_pointer;
-            borrower->file_pointer = new_file;
-            
-            char* full_path = get_full_path(dataset_name, old_borrower);
-            remove(full_path);
-            free(full_path);
-            
-            // Update lender's file
-            dfh_delete_lines(dataset_name, lender->file_pointer, &key, 1);
-        }
-        
         insert_into_node(borrower, key);
         delete_key(lender, key);
         int borrower_index = index_in_parent(borrower);
         parent->keys[borrower_index] = lender->keys[0];
+        borrower->high_key = lender->keys[0];
+        mark_dirty(parent);
     } else {
-        int key = lender->keys[lender->n - 1];
-        if (lender->is_leaf) {
-            // Copy all borrower's current entries to new file
-            for (int i = 0; i < borrower->n; i++) {
-                char buffer[MAX_LINE_SIZE];
-                dfh_read_line(dataset_name, borrower->file_pointer, borrower->keys[i], buffer, MAX_LINE_SIZE);
-                dfh_write_line( dataset_name, new_file, borrower->keys[i], buffer);
-            }
-            
-            // Copy the borrowed key
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line(dataset_name, lender->file_pointer, key, buffer, MAX_LINE_SIZE);
-            dfh_write_line(dataset_name, new_file, key, buffer);
-            
-            // Delete old borrower file
-            char* old_borrower = borrower->file_pointer;
-            borrower->file_pointer = new_file;
-            
-            char* full_path = get_full_path(dataset_name, old_borrower);
-            remove(full_path);
-            free(full_path);
-            
-            // Update lender's file
-            dfh_delete_lines(dataset_name, lender->file_pointer, &key, 1);
-        }
-        
         insert_into_node(borrower, key);
         delete_key(lender, key);
         int lender_index = index_in_parent(lender);
         parent->keys[lender_index] = borrower->keys[0];
+        lender->high_key = borrower->keys[0];
+        mark_dirty(parent);
     }
-}
-
-void propagate_up_deletion(Node *node, int deleted_key, int replace_key) {
-    if (node == NULL) return;
-    int pos = binary_search(node->keys, node->n, deleted_key);
-    if (pos != -1) {
-        node->keys[pos] = replace_key;
-        propagate_up_deletion(node->parent, deleted_key, replace_key);
-    } else {
-        if (node->parent) {
-            propagate_up_deletion(node->parent, deleted_key, replace_key);
-        }
-    }
+    lender->count = lender->n;
+    borrower->count = borrower->n;
+    pack_counts(parent);
+    RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+    // A key queued for the lender may now lead to the borrower
+    lender->underfull = false;
+    version_end(&parent->version);
+    version_end(&borrower->version);
+    version_end(&lender->version);
 }
 
 bool can_lend(Node *node, int T) {
@@ -444,196 +1615,315 @@ bool can_lend(Node *node, int T) {
     return false;
 }
 
-int delete(BPT *tree, int key) {
-    Node *cursor = tree->root;
-    while (!cursor->is_leaf) {
-        int i = 0;
-        while (i < cursor->n && key >= cursor->keys[i]) i++;
-        cursor = cursor->children[i];
+// Notes the leaf that held key for the rebalancer. The caller holds the
+// leaf's latch and has just set its underfull flag, so a leaf is queued
+// once however many deletes it takes.
+static void queue_rebalance(BPT *tree, int key) {
+    RebalanceQueue *queue = &tree->rebalance;
+    MUTEX_LOCK(&queue->mutex);
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : REBALANCE_BATCH;
+        int *keys = realloc(queue->keys, capacity * sizeof(int));
+        if (!keys) {
+            memory_allocation_failed();
+        }
+        queue->keys = keys;
+        queue->capacity = capacity;
     }
+    queue->keys[queue->count++] = key;
+    if (queue->count >= REBALANCE_BATCH) {
+        COND_SIGNAL(&queue->wake);
+    }
+    MUTEX_UNLOCK(&queue->mutex);
+}
+
+// Applies a delete; like write_insert, a new one has *lsn 0 and is
+// appended to the log under its latch, and *lsn is set for the caller to
+// commit. A key that is not there is not logged. Only the leaf is
+// latched and only the key goes: a leaf left underfull is queued for the
+// rebalancer, so the time a delete takes does not depend on its neighbours.
+static int write_delete(BPT *tree, int key, Lsn *lsn) {
+    Node *cursor = find_leaf_for_write(tree, key);
 
     int pos = binary_search(cursor->keys, cursor->n, key);
-    if (pos == -1) return -1;
+    if (pos == -1) {
+        RWLOCK_WRITE_UNLOCK(&cursor->latch);
+        if (*lsn != 0) {
+            finish_write(tree, *lsn);
+        }
+        return -1;
+    }
+    if (*lsn == 0) {
+        *lsn = wal_append(tree->wal, WAL_DELETE, key, NULL);
+    }
+
+    keep_image(tree, cursor, key, true);
 
     // Remove the entry from data file before deleting the key
-    if (cursor->is_leaf) {
-        dfh_delete_lines( tree->dataset_name, cursor->file_pointer, &key, 1);
+    dfh_delete_lines(tree->dataset_name, cursor->file_pointer, &key, 1);
+    delete_key(cursor, key);
+    add_count(&tree->lineage_lock, cursor, key, -1);
+
+    // A separator equal to the deleted key is left as it is: it still sends
+    // every key to the right leaf, which is how the rebalancer finds it.
+    if (cursor->n < min_leaf_keys(tree) && !cursor->underfull &&
+        cursor != __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE)) {
+        cursor->underfull = true;
+        queue_rebalance(tree, key);
     }
+    RWLOCK_WRITE_UNLOCK(&cursor->latch);
+    finish_write(tree, *lsn);
+    return 0;
+}
 
-    if (cursor == tree->root) {
-        delete_key(cursor, key);
-        save_tree_to_json(tree);
-        return 0;
+// Borrows into or merges the leaf for key if it is still underfull, and
+// collapses the root once its last separator is gone. Returns whether the
+// tree changed shape; the leaf may still be underfull if it did.
+static bool rebalance_leaf(BPT *tree, int key) {
+    LatchPath path;
+    Node *cursor;
+    while (!(cursor = find_leaf_exclusive(tree, key, &path))) {
+        THREAD_YIELD();
     }
 
-    delete_key(cursor, key);
-
-    int min_keys = (tree->T - 1) / 2;
-    if (cursor->n >= min_keys) {
-        if (pos == 0) {
-            propagate_up_deletion(cursor->parent, key, cursor->keys[0]);
-        }
-        save_tree_to_json(tree);
-        return 0;
+    // An underfull leaf that is not the root was unsafe on the way down, so
+    // its parent is still latched.
+    int min_keys = min_leaf_keys(tree);
+    cursor->underfull = false;
+    if (cursor->n >= min_keys || path.count < 2) {
+        release_latches(tree, &path);
+        return false;
     }
 
-    Node *parent = cursor->parent;
+    Node *parent = path.nodes[path.count - 2];
     int cursor_index = index_in_parent(cursor);
-    Node *left_sibling = cursor_index > 0 ? parent->children[cursor_index - 1] : NULL;
-    Node *right_sibling = cursor_index < parent->n ? parent->children[cursor_index + 1] : NULL;
-
-    // Try to borrow or merge
-    if (left_sibling && left_sibling->n > min_keys) {
-        borrow_keys(left_sibling, cursor, parent, false, tree->dataset_name);
-    } else if (right_sibling && right_sibling->n > min_keys) {
-        borrow_keys(right_sibling, cursor, parent, true, tree->dataset_name);
-    } else if (left_sibling) {
-        // Merge with left sibling
-        char* merged_file = generate_file_pointer();
-        dfh_create_datafile( tree->dataset_name, merged_file);
-        
-        // Copy all entries from left sibling to new file
-        for (int i = 0; i < left_sibling->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( tree->dataset_name, left_sibling->file_pointer, left_sibling->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( tree->dataset_name, merged_file, left_sibling->keys[i], buffer);
-        }
-        
-        // Copy all entries from current node to new file
-        for (int i = 0; i < cursor->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( tree->dataset_name, cursor->file_pointer, cursor->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( tree->dataset_name, merged_file, cursor->keys[i], buffer);
-        }
-        
-        // Delete old files
-        char* old_left = left_sibling->file_pointer;
-        char* old_cursor = cursor->file_pointer;
-        
-        // Update file pointer in left sibling
-        left_sibling->file_pointer = merged_file;
-        
-        // Merge nodes in tree
-        merge(left_sibling, cursor, parent, tree->dataset_name);
-        
-        // Remove old data files
-        char* full_path = get_full_path( tree->dataset_name, old_left);
-        remove(full_path);
-        free(full_path);
-        
-        full_path = get_full_path( tree->dataset_name, old_cursor);
-        remove(full_path);
-        free(full_path);
-        
+    Node *left_sibling = cursor_index > 0 ? child_at(tree, parent, cursor_index - 1) : NULL;
+    Node *right_sibling = cursor_index < parent->n ? child_at(tree, parent, cursor_index + 1) : NULL;
+    // Latches on one level are taken left to right, so the leaf is let go
+    // and taken again after its left sibling. Only a write that came through
+    // a right link can reach it meanwhile, since the parent stays latched.
+    if (left_sibling) {
+        RWLOCK_WRITE_UNLOCK(&cursor->latch);
+        RWLOCK_WRITE_LOCK(&left_sibling->latch);
+        RWLOCK_WRITE_LOCK(&cursor->latch);
+    }
+    if (right_sibling) RWLOCK_WRITE_LOCK(&right_sibling->latch);
+
+    // A node whose split has not reached the parent yet has a high key below
+    // its separator, and its right link skips the next child: keys must not
+    // move across that gap.
+    bool left_linked = left_sibling && left_sibling->high_key == parent->keys[cursor_index - 1];
+    bool right_linked = right_sibling && cursor->high_key == parent->keys[cursor_index];
+
+    // Try to borrow or merge. Either leaves the policy's spare keys, though
+    // an empty leaf can always go since the merge adds nothing to its
+    // neighbour. A leaf that can do neither stays underfull until a later
+    // delete queues it again.
+    int lend_above = min_keys + spare_leaf_keys(tree);
+    int merge_within = cursor->n == 0 ? tree->T - 1 : tree->T - 1 - spare_leaf_keys(tree);
+    bool restructured = true;
+    if (cursor->n >= min_keys) {
+        // Refilled by an insert while the leaf was let go
+        restructured = false;
+    } else if (left_linked && left_sibling->n > lend_above) {
+        borrow_keys(tree, left_sibling, cursor, parent, false);
+    } else if (right_linked && right_sibling->n > lend_above) {
+        borrow_keys(tree, right_sibling, cursor, parent, true);
+    } else if (left_linked && left_sibling->n + cursor->n <= merge_within) {
+        forget_latch(&path, cursor);
+        merge(tree, left_sibling, cursor, parent);
         cursor = left_sibling;
-    } else if (right_sibling) {
-        // Merge with right sibling
-        char* merged_file = generate_file_pointer();
-        dfh_create_datafile( tree->dataset_name, merged_file);
-        
-        // Copy all entries from current node to new file
-        for (int i = 0; i < cursor->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( tree->dataset_name, cursor->file_pointer, cursor->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( tree->dataset_name, merged_file, cursor->keys[i], buffer);
-        }
-        
-        // Copy all entries from right sibling to new file
-        for (int i = 0; i < right_sibling->n; i++) {
-            char buffer[MAX_LINE_SIZE];
-            dfh_read_line( tree->dataset_name, right_sibling->file_pointer, right_sibling->keys[i], buffer, MAX_LINE_SIZE);
-            dfh_write_line( tree->dataset_name, merged_file, right_sibling->keys[i], buffer);
-        }
-        
-        // Delete old files
-        char* old_cursor = cursor->file_pointer;
-        char* old_right = right_sibling->file_pointer;
-        
-        // Update file pointer in cursor
-        cursor->file_pointer = merged_file;
-        
-        // Merge nodes in tree
-        merge(cursor, right_sibling, parent, tree->dataset_name);
-        
-        // Remove old data files
-        char* full_path = get_full_path( tree->dataset_name, old_cursor);
-        remove(full_path);
-        free(full_path);
-        
-        full_path = get_full_path( tree->dataset_name, old_right);
-        remove(full_path);
-        free(full_path);
-    }
-
-    if (parent->n == 0 && parent == tree->root) {
-        tree->root = parent->children[0];
-        tree->root->parent = NULL;
-        free(parent->keys);
-        free(parent->children);
-        free(parent);
-    }
-
-    // After deleting the key, check if the leaf node's file is empty
+    } else if (right_linked && cursor->n + right_sibling->n <= merge_within) {
+        merge(tree, cursor, right_sibling, parent);
+        right_sibling = NULL;
+    } else {
+        restructured = false;
+    }
+
+    // A leaf that is still empty gives its file back
     if (cursor->is_leaf && is_file_empty( tree->dataset_name, cursor->file_pointer)) {
-        char* full_path = get_full_path( tree->dataset_name, cursor->file_pointer);
-        if (full_path) {
-            remove(full_path);
-            free(full_path);
+        dfh_remove_datafile(tree->dataset_name, cursor->file_pointer);
+    }
+
+    // The root keeps root_latch held until its last separator can go, and
+    // goes only once no split below or beside it is still on its way up.
+    if (path.root_latched && parent == tree->root && parent->n == 0 &&
+        parent->high_key == LLONG_MAX && parent->children[0]->high_key == LLONG_MAX) {
+        version_begin(&tree->root_version);
+        version_begin(&parent->version);
+        __atomic_store_n(&tree->root, parent->children[0], __ATOMIC_RELEASE);
+        version_end(&tree->root_version);
+        RWLOCK_WRITE_LOCK(&tree->lineage_lock);
+        set_parent(tree->root, NULL);
+        RWLOCK_WRITE_UNLOCK(&tree->lineage_lock);
+        forget_latch(&path, parent);
+        snapshot_release(tree->snapshot, parent->slot);
+        RWLOCK_WRITE_UNLOCK(&parent->latch);
+        retire_node(tree, parent);
+        restructured = true;
+    }
+
+    if (left_sibling) RWLOCK_WRITE_UNLOCK(&left_sibling->latch);
+    if (right_sibling) RWLOCK_WRITE_UNLOCK(&right_sibling->latch);
+    release_latches(tree, &path);
+    return restructured;
+}
+
+int apply_delete(BPT *tree, int key, Lsn lsn) {
+    return write_delete(tree, key, &lsn);
+}
+
+int delete(BPT *tree, int key) {
+    int epoch = epoch_enter();
+    RWLOCK_READ_LOCK(&tree->tree_lock);
+    Lsn lsn = 0;
+    int result = write_delete(tree, key, &lsn);
+    RWLOCK_READ_UNLOCK(&tree->tree_lock);
+    epoch_exit(epoch);
+    if (result == 0) {
+        result = commit_write(tree, WAL_DELETE, key, lsn);
+    }
+    reclaim_unreachable(tree);
+    checkpoint_if_due(tree);
+    return result;
+}
+
+// ---------------------------------------------------------
+
+// BPT REBALANCING
+
+static int compare_keys(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Rebalances the leaves noted by keys, left to right, each as an operation
+// of its own so deletes and inserts go on in between.
+static void rebalance_leaves(BPT *tree, int *keys, int count) {
+    qsort(keys, count, sizeof(int), compare_keys);
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && keys[i] == keys[i - 1]) continue;
+        if (__atomic_load_n(&tree->rebalance.stopping, __ATOMIC_ACQUIRE)) break;
+        // Deletes that went ahead of the rebalancer may have emptied a
+        // leaf and its neighbours alike, so one borrow or merge need not be
+        // enough.
+        int epoch = epoch_enter();
+        RWLOCK_READ_LOCK(&tree->tree_lock);
+        while (rebalance_leaf(tree, keys[i])) {
         }
+        RWLOCK_READ_UNLOCK(&tree->tree_lock);
+        epoch_exit(epoch);
+        reclaim_unreachable(tree);
     }
+    checkpoint_if_due(tree);
+}
 
-    // Save tree state after deletion
-    save_tree_to_json(tree);
-    return 0;
+// Wakes every REBALANCE_INTERVAL_MS, or as soon as REBALANCE_BATCH leaves
+// are queued, and takes the whole queue.
+static THREAD_PROC(rebalancer, arg) {
+    BPT *tree = (BPT *)arg;
+    RebalanceQueue *queue = &tree->rebalance;
+    MUTEX_LOCK(&queue->mutex);
+    while (!queue->stopping) {
+        if (queue->count < REBALANCE_BATCH) {
+            COND_TIMEDWAIT(&queue->wake, &queue->mutex, REBALANCE_INTERVAL_MS);
+        }
+        if (queue->stopping) break;
+        if (queue->count == 0) continue;
+        int *keys = queue->keys;
+        int count = queue->count;
+        queue->keys = NULL;
+        queue->count = 0;
+        queue->capacity = 0;
+        MUTEX_UNLOCK(&queue->mutex);
+        rebalance_leaves(tree, keys, count);
+        free(keys);
+        MUTEX_LOCK(&queue->mutex);
+    }
+    MUTEX_UNLOCK(&queue->mutex);
+    THREAD_RETURN;
+}
+
+// Started once the tree is complete, after any log replay. Until then,
+// and if the thread cannot be started, underfull leaves stay as they are.
+void start_rebalancer(BPT *tree) {
+    if (THREAD_START(&tree->rebalance.thread, rebalancer, tree) == 0) {
+        tree->rebalance.running = true;
+    } else {
+        printf("Warning: Could not start rebalancer for %s\n", tree->dataset_name);
+    }
 }
 
-void free_node(Node *node, const char *dataset_name) {
+// Leaves still queued are dropped with the tree. The flag is not saved, so
+// after a reload the next delete in each queues it again.
+static void stop_rebalancer(BPT *tree) {
+    RebalanceQueue *queue = &tree->rebalance;
+    if (queue->running) {
+        MUTEX_LOCK(&queue->mutex);
+        __atomic_store_n(&queue->stopping, true, __ATOMIC_RELEASE);
+        COND_SIGNAL(&queue->wake);
+        MUTEX_UNLOCK(&queue->mutex);
+        THREAD_JOIN(queue->thread);
+        queue->running = false;
+    }
+    MUTEX_DESTROY(&queue->mutex);
+    COND_DESTROY(&queue->wake);
+    free(queue->keys);
+}
+
+void free_node(BPT *tree, Node *node) {
     if (!node) return;
     
-    if (!node->is_leaf) {
+    if (node->loaded && !node->is_leaf) {
         for (int i = 0; i <= node->n; i++) {
             if (node->children[i]) {
-                free_node(node->children[i], dataset_name);
+                free_node(tree, node->children[i]);
             }
         }
-    } else if (node->file_pointer) {
+    } else if (node->loaded) {
         // Always try to remove the file when freeing a leaf node
-        char* full_path = get_full_path(dataset_name, node->file_pointer);
-        if (full_path) {
-            remove(full_path);
-            free(full_path);
-        }
-        free(node->file_pointer);
+        dfh_remove_datafile(tree->dataset_name, node->file_pointer);
     }
     
-    free(node->keys);
-    free(node->children);
-    free(node);
+    deallocate_node(tree->arena, node);
 }
 
-void free_node_and_not_file(Node *node) {
+void free_node_and_not_file(BPT *tree, Node *node) {
     if (!node) return;
     
-    if (!node->is_leaf) {
+    if (node->loaded && !node->is_leaf) {
         for (int i = 0; i <= node->n; i++) {
             if (node->children[i]) {
-                free_node_and_not_file(node->children[i]);
+                free_node_and_not_file(tree, node->children[i]);
             }
         }
-    } else if (node->file_pointer) {
-        free(node->file_pointer);
     }
     
-    free(node->keys);
-    free(node->children);
-    free(node);
+    deallocate_node(tree->arena, node);
 }
 
+// Every node lives in the tree's arena, so the whole index is released at
+// once without walking it.
 void free_tree(BPT *tree) {
     if (!tree) return;
-    if (tree->root) {
-        free_node_and_not_file(tree->root);
+    stop_rebalancer(tree);
+    arena_destroy(tree->arena);
+    epoch_list_destroy(&tree->retired);
+    RWLOCK_DESTROY(&tree->tree_lock);
+    RWLOCK_DESTROY(&tree->root_latch);
+    RWLOCK_DESTROY(&tree->lineage_lock);
+    MUTEX_DESTROY(&tree->fault_mutex);
+    snapshot_close(tree->snapshot);
+    versions_destroy(tree->versions);
+    for (int i = 0; i < tree->retired_files.count; i++) {
+        free(tree->retired_files.file_pointers[i]);
     }
+    free(tree->retired_files.file_pointers);
+    MUTEX_DESTROY(&tree->retired_files.mutex);
+    dfh_attach_log(tree->dataset_name, NULL);
+    wal_close(tree->wal);
+    dfh_close_dataset(tree->dataset_name);
     free(tree->dataset_name);
     free(tree);
 }
@@ -2,17 +2,727 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #ifdef _WIN32
     #include <windows.h>
-    
+    #include <direct.h>
     #include <unistd.h>
    
+#else
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
 #endif
+#include <dirent.h>
 #include "../lib/dfh.h"
+#include "../lib/segment.h"
+#include "../lib/pager.h"
+#include "../lib/sync.h"
 #include "../lib/utils.h"
 
 #define MAX_LINE_SIZE 1024
 
+#ifdef _WIN32
+    typedef HANDLE DfhFd;
+    #define DFH_NO_FD INVALID_HANDLE_VALUE
+#else
+    typedef int DfhFd;
+    #define DFH_NO_FD (-1)
+#endif
+
+// Returned by dfh_acquire when the leaf has no data file.
+#define DFH_MISSING 1
+
+// Bytes read from the front of a leaf file by a point read: the header and,
+// for leaves of up to a few hundred keys, the whole index.
+#define DFH_READ_PREFIX 4096
+
+// Open descriptors of one dataset's leaf files, keyed by file pointer.
+// Entries in use are never closed; the least recently used idle entry is
+// replaced when the cache is full.
+typedef struct DfhOpenFile {
+    char file_pointer[DFH_FILE_POINTER_LENGTH];
+    DfhFd fd;
+    int users;
+    bool stale;  // file was removed while in use; close on last release
+    unsigned long last_used;
+} DfhOpenFile;
+
+// A leaf rewritten since the last flush. Its current records are in
+// <file pointer>.new, next to the data file that still holds what the last
+// checkpoint saw, until dfh_flush_dataset renames one over the other.
+typedef struct DfhPending {
+    char file_pointer[DFH_FILE_POINTER_LENGTH];
+    struct DfhPending* next;
+} DfhPending;
+
+typedef struct DfhFileCache {
+    DfhOpenFile entries[DFH_FD_CACHE_SIZE];
+    unsigned long clock;
+    DfhPending** pending;
+    unsigned int pending_buckets;
+    unsigned int pending_count;
+    Mutex mutex;
+} DfhFileCache;
+
+typedef struct DfhFile {
+    DfhFd fd;
+    DfhOpenFile* entry;  // NULL when opened outside the cache
+    DfhFileCache* cache;
+} DfhFile;
+
+// DATASET STORAGE REGISTRY
+
+typedef struct DfhDataset {
+    char name[MAX_PATH_LENGTH];
+    int storage;
+    int refs;
+    SegmentStore* segments;
+    Pager* pages;
+    DfhFileCache* files;
+    Wal* log;  // synced before changes reach the disk, or NULL
+    struct DfhDataset* next;
+} DfhDataset;
+
+static DfhDataset* open_datasets = NULL;
+static RWLock registry_lock = RWLOCK_INITIALIZER;
+
+static DfhDataset* dfh_find_dataset(const char* dataset_name) {
+    for (DfhDataset* dataset = open_datasets; dataset; dataset = dataset->next) {
+        if (strcmp(dataset->name, dataset_name) == 0) {
+            return dataset;
+        }
+    }
+    return NULL;
+}
+
+// Returns the segment store of a dataset using the segment engine, or NULL
+// when its leaves live in per-leaf data files.
+static SegmentStore* dfh_segments(const char* dataset_name) {
+    RWLOCK_READ_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    SegmentStore* segments = dataset ? dataset->segments : NULL;
+    RWLOCK_READ_UNLOCK(&registry_lock);
+    return segments;
+}
+
+// Returns the pager of a dataset using the paged engine, or NULL.
+static Pager* dfh_pages(const char* dataset_name) {
+    RWLOCK_READ_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    Pager* pages = dataset ? dataset->pages : NULL;
+    RWLOCK_READ_UNLOCK(&registry_lock);
+    return pages;
+}
+
+// Returns the open file cache of a dataset using the file engine, or NULL.
+static DfhFileCache* dfh_files(const char* dataset_name) {
+    RWLOCK_READ_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    DfhFileCache* files = dataset ? dataset->files : NULL;
+    RWLOCK_READ_UNLOCK(&registry_lock);
+    return files;
+}
+
+static void dfh_os_close(DfhFd fd);
+
+static DfhFileCache* dfh_file_cache_create(void) {
+    DfhFileCache* cache = calloc(1, sizeof(DfhFileCache));
+    if (!cache) {
+        memory_allocation_failed();
+    }
+    for (int i = 0; i < DFH_FD_CACHE_SIZE; i++) {
+        cache->entries[i].fd = DFH_NO_FD;
+    }
+    cache->pending_buckets = 64;
+    cache->pending = calloc(cache->pending_buckets, sizeof(DfhPending*));
+    if (!cache->pending) {
+        memory_allocation_failed();
+    }
+    MUTEX_INIT(&cache->mutex);
+    return cache;
+}
+
+static void dfh_pending_clear(DfhFileCache* cache);
+static int dfh_pending_publish(const char* dataset_name, DfhFileCache* cache);
+
+// Removes the new images a dataset was left with. They hold writes made after
+// its last checkpoint, which replaying the log redoes, and may be torn.
+static void dfh_discard_images(const char* dataset_name) {
+    char data_path[MAX_PATH_LENGTH];
+    snprintf(data_path, sizeof(data_path), "%s/data", dataset_name);
+    DIR* dir = opendir(data_path);
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length > 4 && strcmp(entry->d_name + length - 4, ".new") == 0) {
+            char path[2 * MAX_PATH_LENGTH];
+            snprintf(path, sizeof(path), "%s/%s", data_path, entry->d_name);
+            remove(path);
+        }
+    }
+    closedir(dir);
+}
+
+static void dfh_file_cache_destroy(DfhFileCache* cache) {
+    if (!cache) return;
+    for (int i = 0; i < DFH_FD_CACHE_SIZE; i++) {
+        if (cache->entries[i].fd != DFH_NO_FD) {
+            dfh_os_close(cache->entries[i].fd);
+        }
+    }
+    dfh_pending_clear(cache);
+    free(cache->pending);
+    MUTEX_DESTROY(&cache->mutex);
+    free(cache);
+}
+
+int dfh_open_dataset(const char* dataset_name, int storage) {
+    RWLOCK_WRITE_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    if (dataset) {
+        dataset->refs++;
+        RWLOCK_WRITE_UNLOCK(&registry_lock);
+        return DFH_SUCCESS;
+    }
+
+    dataset = calloc(1, sizeof(DfhDataset));
+    if (!dataset) {
+        memory_allocation_failed();
+    }
+    strncpy(dataset->name, dataset_name, MAX_PATH_LENGTH - 1);
+    dataset->storage = storage;
+    dataset->refs = 1;
+
+    if (storage == STORAGE_SEGMENTS) {
+        dataset->segments = segment_store_open(dataset_name);
+        if (!dataset->segments) {
+            free(dataset);
+            RWLOCK_WRITE_UNLOCK(&registry_lock);
+            return DFH_ERROR_OPEN;
+        }
+    } else if (storage == STORAGE_PAGES) {
+        dataset->pages = pager_open(dataset_name);
+        if (!dataset->pages) {
+            free(dataset);
+            RWLOCK_WRITE_UNLOCK(&registry_lock);
+            return DFH_ERROR_OPEN;
+        }
+    } else {
+        dataset->files = dfh_file_cache_create();
+        dfh_discard_images(dataset_name);
+    }
+
+    dataset->next = open_datasets;
+    open_datasets = dataset;
+    RWLOCK_WRITE_UNLOCK(&registry_lock);
+    return DFH_SUCCESS;
+}
+
+void dfh_close_dataset(const char* dataset_name) {
+    RWLOCK_WRITE_LOCK(&registry_lock);
+    DfhDataset** link = &open_datasets;
+    while (*link && strcmp((*link)->name, dataset_name) != 0) {
+        link = &(*link)->next;
+    }
+    DfhDataset* dataset = *link;
+    if (!dataset || --dataset->refs > 0) {
+        RWLOCK_WRITE_UNLOCK(&registry_lock);
+        return;
+    }
+    *link = dataset->next;
+    RWLOCK_WRITE_UNLOCK(&registry_lock);
+
+    segment_store_close(dataset->segments);
+    pager_close(dataset->pages);
+    dfh_file_cache_destroy(dataset->files);
+    free(dataset);
+}
+
+// Gives a dataset the log its writes are recorded in. Writes are applied
+// before their records are durable, so nothing they change may reach the
+// disk until the log is synced: the pager syncs it before a page is written
+// back, and a flush before anything else. wal is NULL to detach it.
+void dfh_attach_log(const char* dataset_name, Wal* wal) {
+    RWLOCK_WRITE_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    if (dataset) {
+        dataset->log = wal;
+        if (dataset->pages) pager_attach_log(dataset->pages, wal);
+    }
+    RWLOCK_WRITE_UNLOCK(&registry_lock);
+}
+
+// Writes back everything a storage engine buffers in memory and syncs it,
+// so a checkpoint saved afterwards never refers to records that are not on
+// disk. With the file engine, the new image of each leaf becomes its data
+// file.
+int dfh_flush_dataset(const char* dataset_name) {
+    RWLOCK_READ_LOCK(&registry_lock);
+    DfhDataset* dataset = dfh_find_dataset(dataset_name);
+    Wal* log = dataset ? dataset->log : NULL;
+    RWLOCK_READ_UNLOCK(&registry_lock);
+    if (log && wal_sync(log) != DFH_SUCCESS) return DFH_ERROR_WRITE;
+
+    SegmentStore* segments = dfh_segments(dataset_name);
+    if (segments) return segment_sync(segments);
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_flush(pages);
+    DfhFileCache* files = dfh_files(dataset_name);
+    return files ? dfh_pending_publish(dataset_name, files) : DFH_SUCCESS;
+}
+
+// Called once a checkpoint is durable, so storage it no longer refers to
+// can be reused.
+void dfh_checkpoint_durable(const char* dataset_name) {
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) pager_checkpointed(pages);
+}
+
+int dfh_storage_from_name(const char* name) {
+    if (!name || strcmp(name, "files") == 0) return STORAGE_FILES;
+    if (strcmp(name, "segments") == 0) return STORAGE_SEGMENTS;
+    if (strcmp(name, "pages") == 0) return STORAGE_PAGES;
+    return -1;
+}
+
+const char* dfh_storage_name(int storage) {
+    if (storage == STORAGE_SEGMENTS) return "segments";
+    if (storage == STORAGE_PAGES) return "pages";
+    return "files";
+}
+
+// ---------------------------------------------------------
+
+// POSITIONED FILE I/O
+
+static DfhFd dfh_os_open(const char* path, bool create) {
+    #ifdef _WIN32
+        return CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                           create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    #else
+        return open(path, O_RDWR | (create ? O_CREAT : 0), 0666);
+    #endif
+}
+
+// Opens path empty, creating it if needed.
+static DfhFd dfh_os_create(const char* path) {
+    #ifdef _WIN32
+        return CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    #else
+        return open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    #endif
+}
+
+static int dfh_os_rename(const char* from, const char* to) {
+    #ifdef _WIN32
+        return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #else
+        return rename(from, to) == 0 ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #endif
+}
+
+// Makes files created, renamed or removed in a dataset's data directory
+// durable. Windows commits directory changes with the files themselves.
+int dfh_sync_directory(const char* dataset_name) {
+    #ifdef _WIN32
+        (void)dataset_name;
+        return DFH_SUCCESS;
+    #else
+        char data_path[MAX_PATH_LENGTH];
+        snprintf(data_path, sizeof(data_path), "%s/data", dataset_name);
+        int fd = open(data_path, O_RDONLY);
+        if (fd < 0) return DFH_ERROR_OPEN;
+        int result = fsync(fd) == 0 ? DFH_SUCCESS : DFH_ERROR_WRITE;
+        close(fd);
+        return result;
+    #endif
+}
+
+static int dfh_os_sync(DfhFd fd) {
+    #ifdef _WIN32
+        return FlushFileBuffers(fd) ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #else
+        return fsync(fd) == 0 ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #endif
+}
+
+static bool dfh_os_missing(void) {
+    #ifdef _WIN32
+        DWORD error = GetLastError();
+        return error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND;
+    #else
+        return errno == ENOENT;
+    #endif
+}
+
+static void dfh_os_close(DfhFd fd) {
+    #ifdef _WIN32
+        CloseHandle(fd);
+    #else
+        close(fd);
+    #endif
+}
+
+static long dfh_os_size(DfhFd fd) {
+    #ifdef _WIN32
+        LARGE_INTEGER size;
+        return GetFileSizeEx(fd, &size) ? (long)size.QuadPart : -1;
+    #else
+        struct stat st;
+        return fstat(fd, &st) == 0 ? (long)st.st_size : -1;
+    #endif
+}
+
+// Reads up to length bytes at offset; returns the number read or -1.
+static long dfh_pread(DfhFd fd, void* buffer, size_t length, unsigned long offset) {
+    #ifdef _WIN32
+        OVERLAPPED position = {0};
+        position.Offset = (DWORD)offset;
+        DWORD read = 0;
+        if (!ReadFile(fd, buffer, (DWORD)length, &read, &position)) {
+            return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+        }
+        return (long)read;
+    #else
+        size_t done = 0;
+        while (done < length) {
+            ssize_t read = pread(fd, (char*)buffer + done, length - done, (off_t)(offset + done));
+            if (read < 0 && errno == EINTR) continue;
+            if (read < 0) return -1;
+            if (read == 0) break;
+            done += (size_t)read;
+        }
+        return (long)done;
+    #endif
+}
+
+static int dfh_pwrite(DfhFd fd, const void* data, size_t length, unsigned long offset) {
+    #ifdef _WIN32
+        OVERLAPPED position = {0};
+        position.Offset = (DWORD)offset;
+        DWORD written = 0;
+        if (!WriteFile(fd, data, (DWORD)length, &written, &position) || written != length) {
+            return DFH_ERROR_WRITE;
+        }
+    #else
+        size_t done = 0;
+        while (done < length) {
+            ssize_t written = pwrite(fd, (const char*)data + done, length - done, (off_t)(offset + done));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return DFH_ERROR_WRITE;
+            done += (size_t)written;
+        }
+    #endif
+    return DFH_SUCCESS;
+}
+
+static int dfh_os_truncate(DfhFd fd, unsigned long size) {
+    #ifdef _WIN32
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)size;
+        if (!SetFilePointerEx(fd, end, NULL, FILE_BEGIN) || !SetEndOfFile(fd)) {
+            return DFH_ERROR_WRITE;
+        }
+    #else
+        if (ftruncate(fd, (off_t)size) != 0) {
+            return DFH_ERROR_WRITE;
+        }
+    #endif
+    return DFH_SUCCESS;
+}
+
+// ---------------------------------------------------------
+
+// OPEN FILE CACHE
+
+static DfhOpenFile* dfh_cache_find(DfhFileCache* cache, const char* file_pointer) {
+    for (int i = 0; i < DFH_FD_CACHE_SIZE; i++) {
+        DfhOpenFile* entry = &cache->entries[i];
+        if (entry->fd != DFH_NO_FD && !entry->stale &&
+            strcmp(entry->file_pointer, file_pointer) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Picks a free slot, or closes the least recently used idle descriptor.
+static DfhOpenFile* dfh_cache_victim(DfhFileCache* cache) {
+    DfhOpenFile* victim = NULL;
+    for (int i = 0; i < DFH_FD_CACHE_SIZE; i++) {
+        DfhOpenFile* entry = &cache->entries[i];
+        if (entry->fd == DFH_NO_FD) return entry;
+        if (entry->users == 0 && (!victim || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (victim) {
+        dfh_os_close(victim->fd);
+        victim->fd = DFH_NO_FD;
+    }
+    return victim;
+}
+
+// Caches fd for its first user, or returns NULL when every slot is in use.
+static DfhOpenFile* dfh_cache_insert(DfhFileCache* cache, const char* file_pointer, DfhFd fd) {
+    DfhOpenFile* entry = dfh_cache_victim(cache);
+    if (entry) {
+        strncpy(entry->file_pointer, file_pointer, DFH_FILE_POINTER_LENGTH - 1);
+        entry->file_pointer[DFH_FILE_POINTER_LENGTH - 1] = '\0';
+        entry->fd = fd;
+        entry->users = 1;
+        entry->stale = false;
+        entry->last_used = ++cache->clock;
+    }
+    return entry;
+}
+
+// Stops handing out the cached descriptor of a leaf file, closing it now
+// unless it is in use.
+static void dfh_cache_drop(DfhFileCache* cache, const char* file_pointer) {
+    DfhOpenFile* entry = dfh_cache_find(cache, file_pointer);
+    if (entry) {
+        entry->stale = true;
+        if (entry->users == 0) {
+            dfh_os_close(entry->fd);
+            entry->fd = DFH_NO_FD;
+        }
+    }
+}
+
+// LEAVES WITH A NEW IMAGE
+
+static unsigned int dfh_hash(const char* file_pointer) {
+    unsigned int hash = 5381;
+    while (*file_pointer) {
+        hash = hash * 33 + (unsigned char)*file_pointer++;
+    }
+    return hash;
+}
+
+static DfhPending** dfh_pending_link(DfhFileCache* cache, const char* file_pointer) {
+    DfhPending** link = &cache->pending[dfh_hash(file_pointer) & (cache->pending_buckets - 1)];
+    while (*link && strcmp((*link)->file_pointer, file_pointer) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void dfh_pending_add(DfhFileCache* cache, const char* file_pointer) {
+    if (cache->pending_count >= cache->pending_buckets) {
+        unsigned int buckets = cache->pending_buckets * 2;
+        DfhPending** grown = calloc(buckets, sizeof(DfhPending*));
+        if (!grown) {
+            memory_allocation_failed();
+        }
+        for (unsigned int i = 0; i < cache->pending_buckets; i++) {
+            DfhPending* pending = cache->pending[i];
+            while (pending) {
+                DfhPending* next = pending->next;
+                unsigned int bucket = dfh_hash(pending->file_pointer) & (buckets - 1);
+                pending->next = grown[bucket];
+                grown[bucket] = pending;
+                pending = next;
+            }
+        }
+        free(cache->pending);
+        cache->pending = grown;
+        cache->pending_buckets = buckets;
+    }
+
+    DfhPending* pending = malloc(sizeof(DfhPending));
+    if (!pending) {
+        memory_allocation_failed();
+    }
+    strncpy(pending->file_pointer, file_pointer, DFH_FILE_POINTER_LENGTH - 1);
+    pending->file_pointer[DFH_FILE_POINTER_LENGTH - 1] = '\0';
+    unsigned int bucket = dfh_hash(file_pointer) & (cache->pending_buckets - 1);
+    pending->next = cache->pending[bucket];
+    cache->pending[bucket] = pending;
+    cache->pending_count++;
+}
+
+static bool dfh_pending_remove(DfhFileCache* cache, const char* file_pointer) {
+    DfhPending** link = dfh_pending_link(cache, file_pointer);
+    if (!*link) return false;
+    DfhPending* pending = *link;
+    *link = pending->next;
+    free(pending);
+    cache->pending_count--;
+    return true;
+}
+
+static void dfh_pending_clear(DfhFileCache* cache) {
+    for (unsigned int i = 0; i < cache->pending_buckets; i++) {
+        while (cache->pending[i]) {
+            DfhPending* pending = cache->pending[i];
+            cache->pending[i] = pending->next;
+            free(pending);
+        }
+    }
+    cache->pending_count = 0;
+}
+
+static void dfh_image_path(const char* dataset_name, const char* file_pointer, char* path) {
+    snprintf(path, MAX_PATH_LENGTH, "%s/data/%s.new", dataset_name, file_pointer);
+}
+
+// Syncs the new image of a leaf, through its cached descriptor if it has one.
+static int dfh_sync_image(DfhFileCache* cache, const char* file_pointer, const char* image_path) {
+    DfhOpenFile* entry = dfh_cache_find(cache, file_pointer);
+    if (entry) return dfh_os_sync(entry->fd);
+    DfhFd fd = dfh_os_open(image_path, false);
+    if (fd == DFH_NO_FD) return DFH_ERROR_OPEN;
+    int result = dfh_os_sync(fd);
+    dfh_os_close(fd);
+    return result;
+}
+
+// Syncs each new image and renames it over its leaf's data file, then syncs
+// the directory so the renames are durable too. A descriptor cached for the
+// image stays valid across the rename, so the cache needs no change.
+static int dfh_pending_publish(const char* dataset_name, DfhFileCache* cache) {
+    int result = DFH_SUCCESS;
+    MUTEX_LOCK(&cache->mutex);
+    for (unsigned int i = 0; i < cache->pending_buckets; i++) {
+        DfhPending** link = &cache->pending[i];
+        while (*link) {
+            DfhPending* pending = *link;
+            char image_path[MAX_PATH_LENGTH];
+            char data_path[MAX_PATH_LENGTH];
+            dfh_image_path(dataset_name, pending->file_pointer, image_path);
+            snprintf(data_path, sizeof(data_path), "%s/data/%s.dat", dataset_name, pending->file_pointer);
+            if (dfh_sync_image(cache, pending->file_pointer, image_path) != DFH_SUCCESS ||
+                dfh_os_rename(image_path, data_path) != DFH_SUCCESS) {
+                printf("Warning: Failed to replace %s: %s\n", data_path, strerror(errno));
+                result = DFH_ERROR_WRITE;
+                link = &pending->next;
+                continue;
+            }
+            *link = pending->next;
+            free(pending);
+            cache->pending_count--;
+        }
+    }
+    MUTEX_UNLOCK(&cache->mutex);
+    if (dfh_sync_directory(dataset_name) != DFH_SUCCESS) {
+        result = DFH_ERROR_WRITE;
+    }
+    return result;
+}
+
+// Opens a leaf file through the dataset's cache: its new image when it has
+// one, else its data file. Returns DFH_MISSING when the file does not exist
+// and create is false.
+static int dfh_acquire(const char* dataset_name, const char* file_pointer, bool create, DfhFile* file) {
+    file->cache = dfh_files(dataset_name);
+    file->entry = NULL;
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/data/%s.dat", dataset_name, file_pointer);
+    if (file->cache) {
+        MUTEX_LOCK(&file->cache->mutex);
+        DfhOpenFile* entry = dfh_cache_find(file->cache, file_pointer);
+        if (entry) {
+            entry->users++;
+            entry->last_used = ++file->cache->clock;
+            file->entry = entry;
+            file->fd = entry->fd;
+            MUTEX_UNLOCK(&file->cache->mutex);
+            return DFH_SUCCESS;
+        }
+        if (*dfh_pending_link(file->cache, file_pointer)) {
+            dfh_image_path(dataset_name, file_pointer, path);
+        }
+    }
+
+    file->fd = dfh_os_open(path, create);
+    if (file->fd == DFH_NO_FD) {
+        bool missing = dfh_os_missing();
+        if (file->cache) MUTEX_UNLOCK(&file->cache->mutex);
+        return missing ? DFH_MISSING : DFH_ERROR_OPEN;
+    }
+
+    if (file->cache) {
+        file->entry = dfh_cache_insert(file->cache, file_pointer, file->fd);
+        MUTEX_UNLOCK(&file->cache->mutex);
+    }
+    return DFH_SUCCESS;
+}
+
+// Opens the file a leaf's records are rewritten into. The first rewrite
+// since the last flush starts a new image, so the data file keeps what the
+// last checkpoint saw and a torn rewrite never reaches it; *fresh tells
+// whether this call started one.
+static int dfh_acquire_image(const char* dataset_name, const char* file_pointer, DfhFile* file, bool* fresh) {
+    *fresh = false;
+    DfhFileCache* cache = dfh_files(dataset_name);
+    if (!cache) return dfh_acquire(dataset_name, file_pointer, true, file);
+
+    MUTEX_LOCK(&cache->mutex);
+    if (*dfh_pending_link(cache, file_pointer)) {
+        MUTEX_UNLOCK(&cache->mutex);
+        return dfh_acquire(dataset_name, file_pointer, true, file);
+    }
+    char path[MAX_PATH_LENGTH];
+    dfh_image_path(dataset_name, file_pointer, path);
+    file->fd = dfh_os_create(path);
+    if (file->fd == DFH_NO_FD) {
+        MUTEX_UNLOCK(&cache->mutex);
+        return DFH_ERROR_OPEN;
+    }
+    dfh_cache_drop(cache, file_pointer);
+    dfh_pending_add(cache, file_pointer);
+    file->cache = cache;
+    file->entry = dfh_cache_insert(cache, file_pointer, file->fd);
+    *fresh = true;
+    MUTEX_UNLOCK(&cache->mutex);
+    return DFH_SUCCESS;
+}
+
+static void dfh_release(DfhFile* file) {
+    if (!file->entry) {
+        dfh_os_close(file->fd);
+        return;
+    }
+    MUTEX_LOCK(&file->cache->mutex);
+    DfhOpenFile* entry = file->entry;
+    if (--entry->users == 0 && entry->stale) {
+        dfh_os_close(entry->fd);
+        entry->fd = DFH_NO_FD;
+    }
+    MUTEX_UNLOCK(&file->cache->mutex);
+}
+
+// Drops the cached descriptor of a leaf file and removes the file along with
+// any new image of it. Both happen under the cache mutex, so an open racing
+// with the removal (a scan prefetching the leaf) cannot cache a descriptor
+// to an unlinked file.
+static int dfh_unlink(const char* dataset_name, const char* file_pointer, const char* full_path) {
+    DfhFileCache* cache = dfh_files(dataset_name);
+    if (cache) {
+        MUTEX_LOCK(&cache->mutex);
+        dfh_cache_drop(cache, file_pointer);
+        if (dfh_pending_remove(cache, file_pointer)) {
+            char image_path[MAX_PATH_LENGTH];
+            dfh_image_path(dataset_name, file_pointer, image_path);
+            remove(image_path);
+        }
+    }
+    int result = (remove(full_path) == 0 || errno == ENOENT) ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    if (cache) MUTEX_UNLOCK(&cache->mutex);
+    return result;
+}
+
+// ---------------------------------------------------------
+
+// LEAF DATA FILES
+
 char* get_full_path(const char* dataset_name, const char* file_pointer) {
     char* full_path = malloc(MAX_PATH_LENGTH);
     if (!full_path) return NULL;
@@ -23,6 +733,10 @@ char* get_full_path(const char* dataset_name, const char* file_pointer) {
 }
 
 int dfh_create_datafile(const char* dataset_name, const char* file_pointer) {
+    if (dfh_segments(dataset_name)) return DFH_SUCCESS;
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_create_leaf(pages, file_pointer);
+
     char data_dir[MAX_PATH_LENGTH];
     snprintf(data_dir, MAX_PATH_LENGTH, "%s/data", dataset_name);
     
@@ -32,181 +746,459 @@ int dfh_create_datafile(const char* dataset_name, const char* file_pointer) {
         mkdir(data_dir, 0777);
     #endif
     
-    char* full_path = get_full_path(dataset_name, file_pointer);
-    if (!full_path) return DFH_ERROR_OPEN;
-    
-    
-    FILE* file = fopen(full_path, "w");
-    if (!file) {
+    DfhFile file;
+    if (dfh_acquire(dataset_name, file_pointer, true, &file) != DFH_SUCCESS) {
         printf("Failed to create file. Error: %s\n", strerror(errno));
-        free(full_path);
         return DFH_ERROR_OPEN;
     }
     
-    fclose(file);
-  
+    DfhHeader header = { DFH_MAGIC, 0 };
+    int result = dfh_pwrite(file.fd, &header, sizeof(header), 0);
+    if (result == DFH_SUCCESS) {
+        result = dfh_os_truncate(file.fd, sizeof(header));
+    }
+    dfh_release(&file);
+    return result;
+}
 
-    
-    free(full_path);
+typedef struct DfhLeaf {
+    DfhIndexEntry* index;
+    char* data;
+    unsigned int count;
+} DfhLeaf;
+
+typedef struct DfhRecord {
+    int key;
+    const char* line;
+    unsigned int length;
+} DfhRecord;
+
+static void dfh_free_leaf(DfhLeaf* leaf) {
+    free(leaf->index);
+    free(leaf->data);
+    leaf->index = NULL;
+    leaf->data = NULL;
+    leaf->count = 0;
+}
+
+// Returns the position of key in the index, or -(insertion point) - 1.
+static int dfh_find_entry(const DfhIndexEntry* index, unsigned int count, int key) {
+    int low = 0, high = (int)count - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (index[mid].key == key) {
+            return mid;
+        } else if (index[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return -low - 1;
+}
+
+// Builds an index over a data file written before offset tables existed
+// ("key\tline\n" lines only). The file is rewritten in the indexed format on
+// its next modification.
+static int dfh_index_legacy(DfhLeaf* leaf, size_t size) {
+    size_t out = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (leaf->data[i] == '\r' && i + 1 < size && leaf->data[i + 1] == '\n') continue;
+        leaf->data[out++] = leaf->data[i];
+    }
+    leaf->data[out] = '\0';
+
+    unsigned int capacity = 0;
+    char* cursor = leaf->data;
+    char* end = leaf->data + out;
+    while (cursor < end) {
+        char* newline = memchr(cursor, '\n', end - cursor);
+        char* line_end = newline ? newline + 1 : end;
+        char* tab = memchr(cursor, '\t', line_end - cursor);
+        int key;
+        if (tab && sscanf(cursor, "%d", &key) == 1) {
+            if (leaf->count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                DfhIndexEntry* grown = realloc(leaf->index, capacity * sizeof(DfhIndexEntry));
+                if (!grown) return DFH_ERROR_READ;
+                leaf->index = grown;
+            }
+            leaf->index[leaf->count].key = key;
+            leaf->index[leaf->count].offset = (unsigned int)(tab + 1 - leaf->data);
+            leaf->index[leaf->count].length = (unsigned int)(line_end - tab - 1);
+            leaf->count++;
+        }
+        cursor = line_end;
+    }
     return DFH_SUCCESS;
 }
 
-int dfh_write_line(const char* dataset_name, const char* file_pointer, int key, const char* line) {
-    char* full_path = get_full_path(dataset_name, file_pointer);
-    if (!full_path) return DFH_ERROR_OPEN;
-    
-    
-    char temp_path[MAX_PATH_LENGTH];
-    snprintf(temp_path, MAX_PATH_LENGTH, "%s/data/temp_%s.dat", 
-             dataset_name, file_pointer);
-    
-    FILE* read_file = fopen(full_path, "a+");
-    if (!read_file) {
-        free(full_path);
-        return DFH_ERROR_OPEN;
+// Loads a whole data file. A missing file is an empty leaf.
+static int dfh_load_leaf(const char* dataset_name, const char* file_pointer, DfhLeaf* leaf) {
+    leaf->index = NULL;
+    leaf->data = NULL;
+    leaf->count = 0;
+
+    DfhFile file;
+    int opened = dfh_acquire(dataset_name, file_pointer, false, &file);
+    if (opened != DFH_SUCCESS) {
+        return opened == DFH_MISSING ? DFH_SUCCESS : DFH_ERROR_OPEN;
     }
-    rewind(read_file);  
-    FILE* temp_file = fopen(temp_path, "w");
-    if (!temp_file) {
-        fclose(read_file);
-        free(full_path);
-        return DFH_ERROR_OPEN;
+
+    long size = dfh_os_size(file.fd);
+    if (size < 0) {
+        dfh_release(&file);
+        return DFH_ERROR_SEEK;
     }
 
-    bool key_written = false;
-    char buffer[MAX_LINE_SIZE];
-    int current_key;
-    
-    while (fgets(buffer, sizeof(buffer), read_file)) {
-        sscanf(buffer, "%d", &current_key);
-        if (!key_written && key < current_key) {
-            fprintf(temp_file, "%d\t%s%s", key, line, 
-                    (line[strlen(line)-1] != '\n') ? "\n" : "");
-            key_written = true;
-        }
-        if (current_key != key) {
-            fputs(buffer, temp_file);
-        }
-    } 
-    if (!key_written) {
-        fprintf(temp_file, "%d\t%s%s", key, line, 
-                (line[strlen(line)-1] != '\n') ? "\n" : "");
-    }
-    fclose(read_file);
-    fclose(temp_file);
-    
-    if (remove(full_path) != 0 && errno != ENOENT) {  
-        printf("Error removing original file: %s\n", full_path);
-        free(full_path);
-        return DFH_ERROR_WRITE;
+    leaf->data = malloc((size_t)size + 1);
+    if (!leaf->data) {
+        dfh_release(&file);
+        return DFH_ERROR_READ;
     }
-    
-    if (rename(temp_path, full_path) != 0) {
-        printf("Error renaming temp file to original\n");
-        free(full_path);
-        return DFH_ERROR_WRITE;
+    long read = dfh_pread(file.fd, leaf->data, (size_t)size, 0);
+    dfh_release(&file);
+    if (read != size) {
+        dfh_free_leaf(leaf);
+        return DFH_ERROR_READ;
     }
-    
-    free(full_path);
+    leaf->data[size] = '\0';
+
+    DfhHeader header;
+    if ((size_t)size < sizeof(header)) {
+        int result = dfh_index_legacy(leaf, (size_t)size);
+        if (result != DFH_SUCCESS) dfh_free_leaf(leaf);
+        return result;
+    }
+    memcpy(&header, leaf->data, sizeof(header));
+    if (header.magic != DFH_MAGIC) {
+        int result = dfh_index_legacy(leaf, (size_t)size);
+        if (result != DFH_SUCCESS) dfh_free_leaf(leaf);
+        return result;
+    }
+
+    size_t index_size = (size_t)header.count * sizeof(DfhIndexEntry);
+    if (sizeof(header) + index_size > (size_t)size) {
+        dfh_free_leaf(leaf);
+        return DFH_ERROR_READ;
+    }
+    if (header.count > 0) {
+        leaf->index = malloc(index_size);
+        if (!leaf->index) {
+            dfh_free_leaf(leaf);
+            return DFH_ERROR_READ;
+        }
+        memcpy(leaf->index, leaf->data + sizeof(header), index_size);
+    }
+    leaf->count = header.count;
     return DFH_SUCCESS;
 }
 
-int dfh_read_line(const char* dataset_name, const char* file_pointer, int key, char* buffer, size_t buffer_size) {
-    char* full_path = get_full_path(dataset_name, file_pointer);
-    if (!full_path) return DFH_ERROR_OPEN;
-    
-    FILE* file = fopen(full_path, "r");
-    free(full_path);
-    
-    if (!file) return DFH_ERROR_OPEN;
-
-    char line[MAX_LINE_SIZE];
-    int found_key;
-    while (fgets(line, sizeof(line), file)) {
-        if (sscanf(line, "%d", &found_key) == 1 && found_key == key) {
-            char* tab_pos = strchr(line, '\t');
-            if (tab_pos) {
-                tab_pos++; 
-                strncpy(buffer, tab_pos, buffer_size - 1);
-                buffer[buffer_size - 1] = '\0';
-                fclose(file);
-                return DFH_SUCCESS;
-            }
+static int dfh_key_prefix_length(int key) {
+    char prefix[16];
+    return snprintf(prefix, sizeof(prefix), "%d\t", key);
+}
+
+// Writes records (sorted by key) as the leaf's new image. It is built in
+// memory and written with one positioned write, then the file is cut to the
+// new length. The data file itself only changes when dfh_flush_dataset
+// renames the image over it.
+static int dfh_store_records(const char* dataset_name, const char* file_pointer,
+                             const DfhRecord* records, unsigned int count) {
+    size_t size = sizeof(DfhHeader) + count * sizeof(DfhIndexEntry);
+    for (unsigned int i = 0; i < count; i++) {
+        size += dfh_key_prefix_length(records[i].key) + records[i].length + 1;
+    }
+
+    char* image = malloc(size);
+    if (!image) return DFH_ERROR_WRITE;
+
+    DfhHeader header = { DFH_MAGIC, count };
+    memcpy(image, &header, sizeof(header));
+    DfhIndexEntry* index = (DfhIndexEntry*)(image + sizeof(header));
+    unsigned int offset = sizeof(DfhHeader) + count * sizeof(DfhIndexEntry);
+    for (unsigned int i = 0; i < count; i++) {
+        bool has_newline = records[i].length > 0 && records[i].line[records[i].length - 1] == '\n';
+        offset += snprintf(image + offset, size - offset, "%d\t", records[i].key);
+        DfhIndexEntry entry = { records[i].key, offset, records[i].length + (has_newline ? 0 : 1) };
+        memcpy(&index[i], &entry, sizeof(entry));
+        memcpy(image + offset, records[i].line, records[i].length);
+        if (!has_newline) {
+            image[offset + records[i].length] = '\n';
         }
+        offset += entry.length;
     }
 
-    fclose(file);
-    return DFH_ERROR_READ;
+    DfhFile file;
+    bool fresh;
+    if (dfh_acquire_image(dataset_name, file_pointer, &file, &fresh) != DFH_SUCCESS) {
+        free(image);
+        return DFH_ERROR_OPEN;
+    }
+    int result = dfh_pwrite(file.fd, image, offset, 0);
+    if (result == DFH_SUCCESS) {
+        result = dfh_os_truncate(file.fd, offset);
+    }
+    dfh_release(&file);
+    free(image);
+    if (result != DFH_SUCCESS && fresh) {
+        // Fall back to the data file rather than leave a partial image.
+        MUTEX_LOCK(&file.cache->mutex);
+        dfh_cache_drop(file.cache, file_pointer);
+        dfh_pending_remove(file.cache, file_pointer);
+        char image_path[MAX_PATH_LENGTH];
+        dfh_image_path(dataset_name, file_pointer, image_path);
+        remove(image_path);
+        MUTEX_UNLOCK(&file.cache->mutex);
+    }
+    return result;
 }
 
-int dfh_move_lines(const char* dataset_name, const char* source_fp, const char* dest_fp, int* keys, int num_keys) {
-    char buffer[MAX_LINE_SIZE];
-    
+int dfh_write_line(const char* dataset_name, const char* file_pointer, int key, const char* line) {
+    SegmentStore* segments = dfh_segments(dataset_name);
+    if (segments) return segment_put(segments, key, line, strlen(line));
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_put(pages, file_pointer, key, line, strlen(line));
 
-    for (int i = 0; i < num_keys; i++) {
-        if (dfh_read_line(dataset_name, source_fp, keys[i], buffer, sizeof(buffer)) == DFH_SUCCESS) {
-            if (dfh_write_line(dataset_name, dest_fp, keys[i], buffer) != DFH_SUCCESS) {
-                return DFH_ERROR_WRITE;
-            }
-        } else {
-            return DFH_ERROR_READ;
+    DfhLeaf leaf;
+    int result = dfh_load_leaf(dataset_name, file_pointer, &leaf);
+    if (result != DFH_SUCCESS) return result;
+
+    DfhRecord* records = malloc((leaf.count + 1) * sizeof(DfhRecord));
+    if (!records) {
+        dfh_free_leaf(&leaf);
+        return DFH_ERROR_WRITE;
+    }
+
+    // Copy existing records around the new one, replacing an existing key.
+    int pos = dfh_find_entry(leaf.index, leaf.count, key);
+    unsigned int insert_at = pos >= 0 ? (unsigned int)pos : (unsigned int)(-pos - 1);
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < leaf.count; i++) {
+        if (i == insert_at) {
+            records[count].key = key;
+            records[count].line = line;
+            records[count].length = (unsigned int)strlen(line);
+            count++;
         }
+        if (pos >= 0 && i == (unsigned int)pos) continue;
+        records[count].key = leaf.index[i].key;
+        records[count].line = leaf.data + leaf.index[i].offset;
+        records[count].length = leaf.index[i].length;
+        count++;
     }
-    
-    // Then delete them from source - ensure this happens
-    int delete_result = dfh_delete_lines(dataset_name, source_fp, keys, num_keys);
-    if (delete_result != DFH_SUCCESS) {
-        printf("Failed to delete moved lines from source file\n");
-        return delete_result;
+    if (insert_at == leaf.count) {
+        records[count].key = key;
+        records[count].line = line;
+        records[count].length = (unsigned int)strlen(line);
+        count++;
     }
-    
-    return DFH_SUCCESS;
+
+    result = dfh_store_records(dataset_name, file_pointer, records, count);
+    free(records);
+    dfh_free_leaf(&leaf);
+    return result;
 }
 
-int dfh_merge_files(const char* dataset_name, const char* taker_fp, const char* giver_fp) {
-    char* taker_path = get_full_path(dataset_name, taker_fp);
-    char* giver_path = get_full_path(dataset_name, giver_fp);
-    
-    if (!taker_path || !giver_path) {
-        free(taker_path);
-        free(giver_path);
-        return DFH_ERROR_OPEN;
+// Merges records with sorted, distinct keys into a leaf with one rewrite of
+// its data, replacing records that have the same key.
+int dfh_write_lines(const char* dataset_name, const char* file_pointer,
+                    const int* keys, const char* const* lines, int count) {
+    SegmentStore* segments = dfh_segments(dataset_name);
+    Pager* pages = dfh_pages(dataset_name);
+    if (segments || pages) {
+        for (int i = 0; i < count; i++) {
+            int result = segments ? segment_put(segments, keys[i], lines[i], strlen(lines[i]))
+                                  : pager_put(pages, file_pointer, keys[i], lines[i], strlen(lines[i]));
+            if (result != DFH_SUCCESS) return result;
+        }
+        return DFH_SUCCESS;
     }
-    
-    FILE* giver = fopen(giver_path, "r");
-    if (!giver) {
-        free(taker_path);
-        free(giver_path);
+
+    DfhLeaf leaf;
+    int result = dfh_load_leaf(dataset_name, file_pointer, &leaf);
+    if (result != DFH_SUCCESS) return result;
+
+    DfhRecord* records = malloc((leaf.count + count + 1) * sizeof(DfhRecord));
+    if (!records) {
+        dfh_free_leaf(&leaf);
+        return DFH_ERROR_WRITE;
+    }
+
+    unsigned int total = 0, existing = 0;
+    int incoming = 0;
+    while (existing < leaf.count || incoming < count) {
+        if (incoming == count ||
+            (existing < leaf.count && leaf.index[existing].key < keys[incoming])) {
+            records[total].key = leaf.index[existing].key;
+            records[total].line = leaf.data + leaf.index[existing].offset;
+            records[total].length = leaf.index[existing].length;
+            existing++;
+        } else {
+            if (existing < leaf.count && leaf.index[existing].key == keys[incoming]) existing++;
+            records[total].key = keys[incoming];
+            records[total].line = lines[incoming];
+            records[total].length = (unsigned int)strlen(lines[incoming]);
+            incoming++;
+        }
+        total++;
+    }
+
+    result = dfh_store_records(dataset_name, file_pointer, records, total);
+    free(records);
+    dfh_free_leaf(&leaf);
+    return result;
+}
+
+int dfh_read_line(const char* dataset_name, const char* file_pointer, int key, char* buffer, size_t buffer_size) {
+    SegmentStore* segments = dfh_segments(dataset_name);
+    if (segments) return segment_get(segments, key, buffer, buffer_size);
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_get(pages, file_pointer, key, buffer, buffer_size);
+
+    DfhFile file;
+    if (dfh_acquire(dataset_name, file_pointer, false, &file) != DFH_SUCCESS) {
         return DFH_ERROR_OPEN;
     }
 
-    char line[MAX_LINE_SIZE];
-    int key;
-    char content[MAX_LINE_SIZE];
-    
-    while (fgets(line, sizeof(line), giver)) {
-        if (sscanf(line, "%d\t%[^\n]", &key, content) == 2) {
-            if (dfh_write_line(dataset_name, taker_fp, key, content) != DFH_SUCCESS) {
-                fclose(giver);
-                free(taker_path);
-                free(giver_path);
-                return DFH_ERROR_WRITE;
-            }
+    // One read brings in the header and usually the whole index, and for a
+    // small leaf the record as well; otherwise a second reads the record.
+    char prefix[DFH_READ_PREFIX];
+    long prefix_size = dfh_pread(file.fd, prefix, sizeof(prefix), 0);
+    DfhHeader header;
+    if (prefix_size >= (long)sizeof(header)) {
+        memcpy(&header, prefix, sizeof(header));
+    }
+    if (prefix_size < (long)sizeof(header) || header.magic != DFH_MAGIC) {
+        // Not indexed yet: fall back to parsing the whole file.
+        dfh_release(&file);
+        DfhLeaf leaf;
+        int result = dfh_load_leaf(dataset_name, file_pointer, &leaf);
+        if (result != DFH_SUCCESS) return result;
+        int pos = dfh_find_entry(leaf.index, leaf.count, key);
+        if (pos < 0) {
+            dfh_free_leaf(&leaf);
+            return DFH_ERROR_READ;
         }
+        size_t length = leaf.index[pos].length < buffer_size - 1 ? leaf.index[pos].length : buffer_size - 1;
+        memcpy(buffer, leaf.data + leaf.index[pos].offset, length);
+        buffer[length] = '\0';
+        dfh_free_leaf(&leaf);
+        return DFH_SUCCESS;
     }
 
-    fclose(giver);
+    // The index is searched in the prefix already read; entries past it are
+    // read one at a time.
+    int low = 0, high = (int)header.count - 1;
+    DfhIndexEntry entry;
+    bool found = false;
+    while (low <= high && !found) {
+        int mid = low + (high - low) / 2;
+        unsigned long offset = sizeof(DfhHeader) + (unsigned long)mid * sizeof(DfhIndexEntry);
+        if (offset + sizeof(entry) <= (unsigned long)prefix_size) {
+            memcpy(&entry, prefix + offset, sizeof(entry));
+        } else if (dfh_pread(file.fd, &entry, sizeof(entry), offset) != (long)sizeof(entry)) {
+            break;
+        }
+        if (entry.key == key) {
+            found = true;
+        } else if (entry.key < key) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    if (!found) {
+        dfh_release(&file);
+        return DFH_ERROR_READ;
+    }
 
-    if (remove(giver_path) != 0) {
-        printf("Warning: Failed to delete giver file %s\n", giver_path);
+    size_t length = entry.length < buffer_size - 1 ? entry.length : buffer_size - 1;
+    long read;
+    if ((unsigned long)entry.offset + length <= (unsigned long)prefix_size) {
+        memcpy(buffer, prefix + entry.offset, length);
+        read = (long)length;
+    } else {
+        read = dfh_pread(file.fd, buffer, length, entry.offset);
     }
+    buffer[read > 0 ? read : 0] = '\0';
+    dfh_release(&file);
+    return read == (long)length ? DFH_SUCCESS : DFH_ERROR_READ;
+}
 
-    free(taker_path);
-    free(giver_path);
-    return DFH_SUCCESS;
+static int dfh_compare_keys(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Copies the records of keys (sorted) from source to dest, replacing those
+// dest already has for them, so a restructure can place records in their new
+// leaf while the old one still holds them for the last checkpoint. Both
+// files are key-ordered, so the copies are merged into dest in one pass and
+// only dest is written. source keeps its copies until dfh_retain_lines.
+int dfh_copy_lines(const char* dataset_name, const char* source_fp, const char* dest_fp,
+                   const int* keys, int num_keys) {
+    // Segment records are addressed by key, not by leaf.
+    if (dfh_segments(dataset_name)) return DFH_SUCCESS;
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_copy(pages, source_fp, dest_fp, keys, num_keys);
+
+    DfhLeaf source, dest;
+    int result = dfh_load_leaf(dataset_name, source_fp, &source);
+    if (result == DFH_SUCCESS) {
+        result = dfh_load_leaf(dataset_name, dest_fp, &dest);
+        if (result != DFH_SUCCESS) dfh_free_leaf(&source);
+    }
+    if (result != DFH_SUCCESS) return result;
+
+    DfhRecord* merged = malloc((source.count + dest.count + 1) * sizeof(DfhRecord));
+    if (!merged) {
+        dfh_free_leaf(&source);
+        dfh_free_leaf(&dest);
+        return DFH_ERROR_WRITE;
+    }
+
+    unsigned int copied = 0, merged_count = 0, d = 0;
+    for (unsigned int i = 0; i < source.count; i++) {
+        const DfhIndexEntry* entry = &source.index[i];
+        if (!bsearch(&entry->key, keys, num_keys, sizeof(int), dfh_compare_keys)) continue;
+        while (d < dest.count && dest.index[d].key < entry->key) {
+            DfhRecord existing = { dest.index[d].key, dest.data + dest.index[d].offset, dest.index[d].length };
+            merged[merged_count++] = existing;
+            d++;
+        }
+        if (d < dest.count && dest.index[d].key == entry->key) d++;
+        DfhRecord record = { entry->key, source.data + entry->offset, entry->length };
+        merged[merged_count++] = record;
+        copied++;
+    }
+    for (; d < dest.count; d++) {
+        DfhRecord existing = { dest.index[d].key, dest.data + dest.index[d].offset, dest.index[d].length };
+        merged[merged_count++] = existing;
+    }
+
+    if (copied > 0) {
+        result = dfh_store_records(dataset_name, dest_fp, merged, merged_count);
+    }
+    free(merged);
+    dfh_free_leaf(&source);
+    dfh_free_leaf(&dest);
+    return result;
 }
 
 int dfh_verify_file(const char* dataset_name, const char* file_pointer, int* keys, int num_keys) {
+    SegmentStore* segments = dfh_segments(dataset_name);
+    if (segments) {
+        for (int i = 0; i < num_keys; i++) {
+            if (!segment_contains(segments, keys[i])) {
+                printf("Failed to verify key %d in file %s\n", keys[i], file_pointer);
+                return DFH_ERROR_READ;
+            }
+        }
+        return DFH_SUCCESS;
+    }
+
     char buffer[MAX_LINE_SIZE];
     for (int i = 0; i < num_keys; i++) {
         if (dfh_read_line(dataset_name, file_pointer, keys[i], buffer, MAX_LINE_SIZE) != DFH_SUCCESS) {
@@ -218,75 +1210,223 @@ int dfh_verify_file(const char* dataset_name, const char* file_pointer, int* key
 }
 
 bool is_file_empty(const char* dataset_name, const char* file_pointer) {
-    char* full_path = get_full_path(dataset_name, file_pointer);
-    if (!full_path) return true;
-    
-    FILE* file = fopen(full_path, "r");
-    if (!file) {
-        free(full_path);
+    // With the segment engine a leaf never owns a file of its own.
+    if (dfh_segments(dataset_name)) return true;
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_is_empty(pages, file_pointer);
+
+    DfhFile file;
+    if (dfh_acquire(dataset_name, file_pointer, false, &file) != DFH_SUCCESS) {
         return true;
     }
     
-    char buffer[MAX_LINE_SIZE];
-    bool is_empty = (fgets(buffer, sizeof(buffer), file) == NULL);
+    DfhHeader header;
+    long read = dfh_pread(file.fd, &header, sizeof(header), 0);
+    bool is_empty;
+    if (read == (long)sizeof(header) && header.magic == DFH_MAGIC) {
+        is_empty = header.count == 0;
+    } else {
+        is_empty = read <= 0;
+    }
     
-    fclose(file);
-    free(full_path);
+    dfh_release(&file);
     return is_empty;
 }
 
-int dfh_delete_lines(const char* dataset_name, const char* file_pointer, int* keys, int num_keys) {
-    char* full_path = get_full_path(dataset_name, file_pointer);
-    if (!full_path) return DFH_ERROR_OPEN;
-    
-    FILE* original = fopen(full_path, "r");
-    if (!original) {
-        free(full_path);
+// Drops the records whose key is in keys (sorted), or with keep set those
+// whose key is not. A leaf file left without records is removed.
+static int dfh_filter_lines(const char* dataset_name, const char* file_pointer,
+                            const int* keys, int num_keys, bool keep) {
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_filter(pages, file_pointer, keys, num_keys, keep);
+
+    DfhLeaf leaf;
+    if (dfh_load_leaf(dataset_name, file_pointer, &leaf) != DFH_SUCCESS) {
         return DFH_ERROR_OPEN;
     }
-    
-    char temp_path[1024];
-    snprintf(temp_path, sizeof(temp_path), "%s.tmp", full_path);
-    FILE* temp = fopen(temp_path, "w");
-    
-    if (!temp) {
-        fclose(original);
-        free(full_path);
-        return DFH_ERROR_OPEN;
+
+    DfhRecord* records = malloc((leaf.count + 1) * sizeof(DfhRecord));
+    if (!records) {
+        dfh_free_leaf(&leaf);
+        return DFH_ERROR_WRITE;
     }
 
-    char line[MAX_LINE_SIZE];
-    int current_key;
-    bool has_content = false;
-    
-    while (fgets(line, sizeof(line), original)) {
-        bool should_keep = true;
-        sscanf(line, "%d", &current_key);
-        
-        for (int i = 0; i < num_keys; i++) {
-            if (current_key == keys[i]) {
-                should_keep = false;
-                break;
-            }
-        }
-        
-        if (should_keep) {
-            fputs(line, temp);
-            has_content = true;
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < leaf.count; i++) {
+        bool listed = bsearch(&leaf.index[i].key, keys, num_keys, sizeof(int), dfh_compare_keys) != NULL;
+        if (listed == keep) {
+            records[count].key = leaf.index[i].key;
+            records[count].line = leaf.data + leaf.index[i].offset;
+            records[count].length = leaf.index[i].length;
+            count++;
         }
     }
 
-    fclose(original);
-    fclose(temp);
-    
-    if (!has_content) {
-        remove(full_path);
-        remove(temp_path);
-    } else {
-        remove(full_path);
-        rename(temp_path, full_path);
+    int result = DFH_SUCCESS;
+    if (count == 0) {
+        dfh_remove_datafile(dataset_name, file_pointer);
+    } else if (count != leaf.count) {
+        result = dfh_store_records(dataset_name, file_pointer, records, count);
     }
     
+    free(records);
+    dfh_free_leaf(&leaf);
+    return result;
+}
+
+int dfh_delete_lines(const char* dataset_name, const char* file_pointer, int* keys, int num_keys) {
+    SegmentStore* segments = dfh_segments(dataset_name);
+    if (segments) {
+        for (int i = 0; i < num_keys; i++) {
+            int result = segment_delete(segments, keys[i]);
+            if (result != DFH_SUCCESS) return result;
+        }
+        return DFH_SUCCESS;
+    }
+    qsort(keys, num_keys, sizeof(int), dfh_compare_keys);
+    return dfh_filter_lines(dataset_name, file_pointer, keys, num_keys, false);
+}
+
+// Drops every record of a leaf but those of keys (sorted), the ones it holds
+// now. Called once the records copied out of it are no longer needed there.
+int dfh_retain_lines(const char* dataset_name, const char* file_pointer, const int* keys, int num_keys) {
+    if (dfh_segments(dataset_name)) return DFH_SUCCESS;
+    return dfh_filter_lines(dataset_name, file_pointer, keys, num_keys, true);
+}
+
+int dfh_remove_datafile(const char* dataset_name, const char* file_pointer) {
+    if (dfh_segments(dataset_name)) return DFH_SUCCESS;
+    Pager* pages = dfh_pages(dataset_name);
+    if (pages) return pager_drop_leaf(pages, file_pointer);
+
+    char* full_path = get_full_path(dataset_name, file_pointer);
+    if (!full_path) return DFH_ERROR_OPEN;
+    int result = dfh_unlink(dataset_name, file_pointer, full_path);
     free(full_path);
+    return result;
+}
+
+// Renames a fully written temp_path over path, so readers see either the
+// old file or the new one.
+int dfh_replace_file(const char* temp_path, const char* path) {
+    #ifdef _WIN32
+        if (MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING)) return DFH_SUCCESS;
+    #else
+        if (rename(temp_path, path) == 0) return DFH_SUCCESS;
+    #endif
+    remove(temp_path);
+    return DFH_ERROR_WRITE;
+}
+
+// ---------------------------------------------------------
+
+// MAPPED READS
+
+static bool dfh_mapping_valid(const DfhMapping* mapping) {
+    DfhHeader header;
+    if (mapping->size < sizeof(header)) return false;
+    memcpy(&header, mapping->data, sizeof(header));
+    return header.magic == DFH_MAGIC &&
+           sizeof(header) + (size_t)header.count * sizeof(DfhIndexEntry) <= mapping->size;
+}
+
+static void dfh_unmap_view(DfhMapping* mapping) {
+    if (!mapping->data) return;
+    #ifdef _WIN32
+        UnmapViewOfFile(mapping->data);
+    #else
+        munmap((void*)mapping->data, mapping->size);
+    #endif
+    mapping->data = NULL;
+    mapping->size = 0;
+}
+
+// Maps a leaf file read-only. Leaves that cannot be mapped (other engines,
+// legacy text files, empty files) are served through dfh_read_line.
+int dfh_map_leaf(const char* dataset_name, const char* file_pointer, DfhMapping* mapping) {
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->index = NULL;
+    mapping->count = 0;
+    mapping->dataset_name = dataset_name;
+    mapping->file_pointer = file_pointer;
+    if (dfh_segments(dataset_name) || dfh_pages(dataset_name)) return DFH_SUCCESS;
+
+    DfhFile file;
+    if (dfh_acquire(dataset_name, file_pointer, false, &file) != DFH_SUCCESS) {
+        return DFH_ERROR_OPEN;
+    }
+
+    // The view outlives the descriptor, which goes back to the cache.
+    long size = dfh_os_size(file.fd);
+    if (size > 0) {
+        #ifdef _WIN32
+            HANDLE map = CreateFileMappingA(file.fd, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (map) {
+                mapping->data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+                mapping->size = mapping->data ? (size_t)size : 0;
+                CloseHandle(map);
+            }
+        #else
+            void* data = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, file.fd, 0);
+            if (data != MAP_FAILED) {
+                mapping->data = data;
+                mapping->size = (size_t)size;
+                madvise(data, mapping->size, MADV_WILLNEED);
+            }
+        #endif
+    }
+    dfh_release(&file);
+
+    if (mapping->data && !dfh_mapping_valid(mapping)) {
+        dfh_unmap_view(mapping);
+    }
+    if (mapping->data) {
+        DfhHeader header;
+        memcpy(&header, mapping->data, sizeof(header));
+        mapping->index = (const DfhIndexEntry*)(mapping->data + sizeof(header));
+        mapping->count = header.count;
+    }
     return DFH_SUCCESS;
-} 
\ No newline at end of file
+}
+
+// Points *line at the record of key. The pointer stays valid until the next
+// lookup or dfh_unmap_leaf, and the record is not NUL-terminated.
+int dfh_mapping_find(DfhMapping* mapping, int key, const char** line, size_t* length) {
+    if (!mapping->data) {
+        int result = dfh_read_line(mapping->dataset_name, mapping->file_pointer, key,
+                                   mapping->buffer, sizeof(mapping->buffer));
+        if (result != DFH_SUCCESS) return result;
+        *line = mapping->buffer;
+        *length = strlen(mapping->buffer);
+        return DFH_SUCCESS;
+    }
+
+    int pos = dfh_find_entry(mapping->index, mapping->count, key);
+    if (pos < 0) return DFH_ERROR_READ;
+    const DfhIndexEntry* entry = &mapping->index[pos];
+    if ((size_t)entry->offset + entry->length > mapping->size) return DFH_ERROR_READ;
+    *line = mapping->data + entry->offset;
+    *length = entry->length;
+    return DFH_SUCCESS;
+}
+
+void dfh_unmap_leaf(DfhMapping* mapping) {
+    dfh_unmap_view(mapping);
+    mapping->index = NULL;
+    mapping->count = 0;
+}
+
+// Asks the kernel to start reading a leaf file that a scan will visit next.
+void dfh_prefetch_leaf(const char* dataset_name, const char* file_pointer) {
+    if (!file_pointer || dfh_segments(dataset_name) || dfh_pages(dataset_name)) return;
+
+    #ifndef _WIN32
+        // Opening through the cache also leaves the descriptor ready for
+        // the dfh_map_leaf call that follows.
+        DfhFile file;
+        if (dfh_acquire(dataset_name, file_pointer, false, &file) != DFH_SUCCESS) return;
+        posix_fadvise(file.fd, 0, 0, POSIX_FADV_WILLNEED);
+        dfh_release(&file);
+    #endif
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../lib/epoch.h"
+#include "../lib/utils.h"
+
+// Each slot holds the epoch its thread entered at, or 0 while it is free.
+static Epoch slots[EPOCH_MAX_THREADS];
+static Epoch global_epoch = 1;
+static unsigned int next_slot = 0;
+
+// Retiring reads the global epoch under the shared side and advancing takes
+// the exclusive side, so whatever was unlinked before an object was tagged is
+// unreachable for a thread that enters after the epoch moves past the tag.
+static RWLock advance_lock = RWLOCK_INITIALIZER;
+
+int epoch_enter(void) {
+    unsigned int start = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+    for (unsigned int i = 0;; i++) {
+        int slot = (int)((start + i) % EPOCH_MAX_THREADS);
+        Epoch free_slot = 0;
+        Epoch epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+        if (__atomic_compare_exchange_n(&slots[slot], &free_slot, epoch, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            // The slot is visible before any pointer the thread reads next
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            return slot;
+        }
+        if (i % EPOCH_MAX_THREADS == EPOCH_MAX_THREADS - 1) {
+            THREAD_YIELD();
+        }
+    }
+}
+
+void epoch_exit(int slot) {
+    __atomic_store_n(&slots[slot], 0, __ATOMIC_RELEASE);
+}
+
+// Moves the global epoch on if every thread inside entered at the current
+// one. The caller holds advance_lock exclusively.
+static void try_advance(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    Epoch epoch = global_epoch;
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        Epoch entered = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+        if (entered != 0 && entered != epoch) return;
+    }
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+static Epoch current_epoch(void) {
+    RWLOCK_READ_LOCK(&advance_lock);
+    Epoch epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    RWLOCK_READ_UNLOCK(&advance_lock);
+    return epoch;
+}
+
+// Waits until every thread that entered before the call has left, so that
+// whatever was unlinked before it can be freed. The caller must not be
+// inside an epoch itself.
+void epoch_synchronize(void) {
+    Epoch target = current_epoch() + 2;
+    for (;;) {
+        RWLOCK_WRITE_LOCK(&advance_lock);
+        try_advance();
+        bool done = global_epoch >= target;
+        RWLOCK_WRITE_UNLOCK(&advance_lock);
+        if (done) return;
+        THREAD_YIELD();
+    }
+}
+
+void epoch_list_init(EpochList* list) {
+    list->objects = NULL;
+    list->epochs = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    MUTEX_INIT(&list->mutex);
+}
+
+// Objects still on the list are left to their owner.
+void epoch_list_destroy(EpochList* list) {
+    free(list->objects);
+    free(list->epochs);
+    MUTEX_DESTROY(&list->mutex);
+}
+
+// The object must already be unreachable for threads entering from now on.
+void epoch_retire(EpochList* list, void* object) {
+    Epoch epoch = current_epoch();
+    MUTEX_LOCK(&list->mutex);
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->objects = realloc(list->objects, list->capacity * sizeof(void*));
+        list->epochs = realloc(list->epochs, list->capacity * sizeof(Epoch));
+        if (!list->objects || !list->epochs) {
+            memory_allocation_failed();
+        }
+    }
+    list->objects[list->count] = object;
+    list->epochs[list->count] = epoch;
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELAXED);
+    MUTEX_UNLOCK(&list->mutex);
+}
+
+// Frees the objects on list that no thread can reach any more, or all of
+// them when everything is set because the caller knows no one holds any.
+// Returns the number freed.
+int epoch_reclaim(EpochList* list, EpochFree free_object, void* context, bool everything) {
+    Epoch reached = 0;
+    if (!everything) {
+        RWLOCK_WRITE_LOCK(&advance_lock);
+        try_advance();
+        reached = global_epoch;
+        RWLOCK_WRITE_UNLOCK(&advance_lock);
+    }
+
+    MUTEX_LOCK(&list->mutex);
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (everything || list->epochs[i] + 2 <= reached) {
+            free_object(context, list->objects[i]);
+        } else {
+            list->objects[kept] = list->objects[i];
+            list->epochs[kept] = list->epochs[i];
+            kept++;
+        }
+    }
+    int freed = list->count - kept;
+    __atomic_store_n(&list->count, kept, __ATOMIC_RELAXED);
+    MUTEX_UNLOCK(&list->mutex);
+    return freed;
+}
@@ -1,67 +1,212 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <limits.h>
 #include "../lib/node.h"
 #include "../lib/utils.h"
 #include "../lib/dfh.h"
 
-char* generate_file_pointer() {
+// A node's count is the number of keys in its range: a leaf's own, and for
+// an internal node also those under children split off whose separators
+// have not reached it yet. An internal node keeps in sums how many of them
+// fall in the range of each child, as a Fenwick tree over its n + 1
+// children, so the keys before any child add up in O(log T) steps. A node
+// split off is counted in the range of the child it came from until its
+// separator is inserted, which is also how a descent by key finds it.
+//
+// The counts are exact whenever no write is in flight. Writers add to
+// their ancestors' counts together, with atomic adds under the tree's
+// lineage lock held shared, and find their way in each ancestor by key, so
+// its separators must stay put meanwhile. Whatever changes the keys,
+// children or parents of internal nodes holds the lock exclusively, with
+// the sums of the nodes it changes unpacked into one count per child.
+
+// Leaves split concurrently, so each name comes from its own generator
+// rather than the shared state behind rand().
+void generate_file_pointer(char *file_pointer) {
     static unsigned int counter = 0;
-    srand((unsigned int)time(NULL) + clock() + (counter++));
-    
-    char *file_pointer = (char *)malloc(33 * sizeof(char)); 
-    if (file_pointer == NULL) {
-        memory_allocation_failed();
-    }
+    unsigned int state = (unsigned int)time(NULL) + (unsigned int)clock() +
+                         __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED) * 2654435761u;
 
     const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-    for (int i = 0; i < 32; i++) {
-        file_pointer[i] = charset[rand() % (sizeof(charset) - 1)];
+    for (int i = 0; i < DFH_FILE_POINTER_LENGTH - 1; i++) {
+        state = state * 1103515245u + 12345u;
+        file_pointer[i] = charset[(state >> 16) % (sizeof(charset) - 1)];
     }
-    file_pointer[32] = '\0';
+    file_pointer[DFH_FILE_POINTER_LENGTH - 1] = '\0';
+}
 
-    return file_pointer;
+static size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
 }
 
-Node* create_node(const char* dataset_name, bool is_leaf, int T) {
-    Node *node = (Node *)malloc(sizeof(Node));
-    if (node == NULL) {
-       memory_allocation_failed();
-    }
+// A node briefly holds T keys (T + 1 children) before it is split.
+static size_t tail_offset(int T) {
+    return align_up(sizeof(Node) + (size_t)T * sizeof(int), sizeof(Node *));
+}
+
+static size_t internal_size(int T) {
+    return tail_offset(T) + (size_t)(T + 1) * (sizeof(Node *) + sizeof(long long));
+}
 
-    node->keys = (int *)malloc((T - 1) * sizeof(int));
-    if (node->keys == NULL) {
-        memory_allocation_failed();
+Arena* create_node_arena(int T) {
+    size_t sizes[3];
+    sizes[NODE_STUB] = sizeof(Node);
+    sizes[NODE_LEAF] = tail_offset(T) + DFH_FILE_POINTER_LENGTH;
+    sizes[NODE_INTERNAL] = internal_size(T);
+    return arena_create(sizes, 3);
+}
+
+// Allocates an empty node with no data file behind it.
+Node* allocate_node(Arena *arena, bool is_leaf, int T) {
+    size_t size = is_leaf ? tail_offset(T) + DFH_FILE_POINTER_LENGTH : internal_size(T);
+    char *block = arena_alloc(arena, is_leaf ? NODE_LEAF : NODE_INTERNAL);
+    memset(block, 0, size);
+
+    Node *node = (Node *)block;
+    node->keys = (int *)(block + sizeof(Node));
+    if (is_leaf) {
+        node->file_pointer = block + tail_offset(T);
+    } else {
+        node->children = (Node **)(block + tail_offset(T));
+        node->sums = (long long *)(node->children + T + 1);
     }
+    node->is_leaf = is_leaf;
+    node->loaded = true;
+    node->dirty = true;
+    node->high_key = LLONG_MAX;
+    RWLOCK_INIT(&node->latch);
 
-    node->children = (Node **)malloc(T * sizeof(Node *));
-    if (node->children == NULL) {
-        memory_allocation_failed();
+    return node;
+}
+
+Node* allocate_stub(Arena *arena) {
+    Node *stub = arena_alloc(arena, NODE_STUB);
+    memset(stub, 0, sizeof(Node));
+    stub->high_key = LLONG_MAX;
+    return stub;
+}
+
+// The node must be unlatched and unreachable from the tree.
+void deallocate_node(Arena *arena, Node *node) {
+    int size_class = !node->loaded ? NODE_STUB : node->is_leaf ? NODE_LEAF : NODE_INTERNAL;
+    if (node->loaded) {
+        RWLOCK_DESTROY(&node->latch);
     }
+    arena_free(arena, size_class, node);
+}
 
-    node->is_leaf = is_leaf;
-    node->n = 0;
-    node->parent = NULL;
-    node->next = NULL;
+Node* create_node(Arena *arena, const char* dataset_name, bool is_leaf, int T) {
+    Node *node = allocate_node(arena, is_leaf, T);
     if (is_leaf) {
-        node->file_pointer = generate_file_pointer();
+        generate_file_pointer(node->file_pointer);
         dfh_create_datafile(dataset_name, node->file_pointer);
-    } else {
-        node->file_pointer = NULL;
     }
-
     return node;
 }
 
-void insert_into_node(Node *node, int key) {
-    int i = node->n - 1;
-    while (i >= 0 && node->keys[i] > key) {
-        node->keys[i + 1] = node->keys[i];
-        i--;
+// Flags node for the next checkpoint, along with its ancestors: each of them
+// refers to the slot of the node below, which moves when that is rewritten.
+// It stops at a node already flagged, whose ancestors are flagged by the
+// write that flagged it before the next checkpoint can start. Nodes a walk
+// passes after their writer let go are kept from being freed by the epoch
+// the caller is in.
+void mark_dirty(Node *node) {
+    while (node && !__atomic_load_n(&node->dirty, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&node->dirty, true, __ATOMIC_RELAXED);
+        node = __atomic_load_n(&node->parent, __ATOMIC_ACQUIRE);
+    }
+}
+
+Node* get_parent(Node *child) {
+    return __atomic_load_n(&child->parent, __ATOMIC_ACQUIRE);
+}
+
+// The caller holds the lineage lock exclusively, or has the tree to itself.
+void set_parent(Node *child, Node *parent) {
+    __atomic_store_n(&child->parent, parent, __ATOMIC_RELEASE);
+}
+
+// Counts delta keys added to or taken from leaf node, in whose range key is.
+void add_count(RWLock *lineage, Node *node, int key, long long delta) {
+    RWLOCK_READ_LOCK(lineage);
+    __atomic_add_fetch(&node->count, delta, __ATOMIC_RELAXED);
+    for (Node *parent = node->parent; parent; parent = parent->parent) {
+        int size = parent->n + 1;
+        for (int i = key_upper_bound(parent->keys, parent->n, key) + 1; i <= size; i += i & -i) {
+            __atomic_add_fetch(&parent->sums[i - 1], delta, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&parent->count, delta, __ATOMIC_RELAXED);
+    }
+    RWLOCK_READ_UNLOCK(lineage);
+}
+
+// Keys in the ranges of the children of node before child c.
+long long count_before(Node *node, int c) {
+    long long count = 0;
+    for (int i = c; i > 0; i -= i & -i) {
+        count += __atomic_load_n(&node->sums[i - 1], __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// Returns the child of node whose range holds the key with index keys
+// before it, and leaves index counting from the start of that range. An
+// index past the last key ends up in the last child.
+int child_by_count(Node *node, long long *index) {
+    int size = node->n + 1;
+    int step = 1;
+    while (step * 2 <= size) step *= 2;
+
+    int c = 0;
+    for (; step > 0; step /= 2) {
+        if (c + step > size) continue;
+        long long sum = __atomic_load_n(&node->sums[c + step - 1], __ATOMIC_RELAXED);
+        if (sum <= *index) {
+            c += step;
+            *index -= sum;
+        }
+    }
+    if (c == size) {
+        c = node->n;
+        *index += count_before(node, size) - count_before(node, c);
     }
-    node->keys[i + 1] = key;
+    return c;
+}
+
+// Turns the sums of node into the count of each child's range, so they can
+// be moved around with the children, and back. pack_counts also sets the
+// node's count from them. n may change in between; the caller holds the
+// lineage lock exclusively, or has the tree to itself.
+void unpack_counts(Node *node) {
+    int size = node->n + 1;
+    for (int i = size; i > 0; i--) {
+        int j = i + (i & -i);
+        if (j <= size) node->sums[j - 1] -= node->sums[i - 1];
+    }
+}
+
+void pack_counts(Node *node) {
+    int size = node->n + 1;
+    long long count = 0;
+    for (int i = 0; i < size; i++) {
+        count += node->sums[i];
+    }
+    for (int i = 1; i <= size; i++) {
+        int j = i + (i & -i);
+        if (j <= size) node->sums[j - 1] += node->sums[i - 1];
+    }
+    node->count = count;
+}
+
+void insert_into_node(Node *node, int key) {
+    int pos = key_upper_bound(node->keys, node->n, key);
+    memmove(node->keys + pos + 1, node->keys + pos, (node->n - pos) * sizeof(int));
+    node->keys[pos] = key;
     node->n++;
+    mark_dirty(node);
 }
 
 void insert_into_leaf(const char* dataset_name, Node *node, int key, const char* line) {
@@ -69,11 +214,5 @@ void insert_into_leaf(const char* dataset_name, Node *node, int key, const char*
         printf("Failed to write data for key %d\n", key);
         return;
     }
-    int i = node->n - 1;
-    while (i >= 0 && node->keys[i] > key) {
-        node->keys[i + 1] = node->keys[i];
-        i--;
-    }
-    node->keys[i + 1] = key;
-    node->n++;
+    insert_into_node(node, key);
 }
@@ -0,0 +1,918 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../lib/pager.h"
+#include "../lib/dfh.h"
+#include "../lib/sync.h"
+#include "../lib/utils.h"
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#define PAGE_DATA_SIZE (PAGER_PAGE_SIZE - sizeof(PageHeader))
+#define NO_FRAME -1
+
+typedef struct Frame {
+    unsigned int page;
+    int pins;
+    bool dirty;
+    bool referenced;
+    bool loading;  // being read in without the pager mutex
+    unsigned char* data;
+} Frame;
+
+typedef struct PageList {
+    unsigned int* pages;
+    int count;
+    int capacity;
+} PageList;
+
+typedef struct LeafEntry {
+    char owner[PAGER_OWNER_LENGTH];
+    unsigned int head;
+    struct LeafEntry* next;
+} LeafEntry;
+
+struct Pager {
+    char path[MAX_PATH_LENGTH];
+    FILE* file;
+    unsigned int page_count;
+    Frame frames[PAGER_POOL_FRAMES];
+    int* frame_of;  // page id -> frame, NO_FRAME when not resident
+    unsigned int frame_of_capacity;
+    int clock_hand;
+    PageList free;     // marked free on disk, ready for reuse
+    PageList freed;    // unlinked since the last flush
+    PageList flushed;  // unlinked before it, until a checkpoint covers that
+    PageList retired;  // no checkpoint on disk reaches them; freed at the next flush
+    LeafEntry** leaves;
+    unsigned int leaf_buckets;
+    unsigned int leaf_count;
+    Wal* log;
+    Mutex mutex;
+    CondVar loaded;  // a frame stopped loading
+};
+
+static PageHeader* page_header(Frame* frame) {
+    return (PageHeader*)frame->data;
+}
+
+static unsigned char* page_records(Frame* frame) {
+    return frame->data + sizeof(PageHeader);
+}
+
+static void list_push(PageList* list, unsigned int page) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->pages = realloc(list->pages, list->capacity * sizeof(unsigned int));
+        if (!list->pages) {
+            memory_allocation_failed();
+        }
+    }
+    list->pages[list->count++] = page;
+}
+
+// Appends the pages of from to to and empties from.
+static void list_move(PageList* to, PageList* from) {
+    for (int i = 0; i < from->count; i++) {
+        list_push(to, from->pages[i]);
+    }
+    from->count = 0;
+}
+
+// LEAF DIRECTORY
+
+static unsigned int owner_hash(const char* owner) {
+    unsigned int hash = 5381;
+    while (*owner) {
+        hash = hash * 33 + (unsigned char)*owner++;
+    }
+    return hash;
+}
+
+static LeafEntry* leaf_find(Pager* pager, const char* owner) {
+    LeafEntry* entry = pager->leaves[owner_hash(owner) & (pager->leaf_buckets - 1)];
+    while (entry && strcmp(entry->owner, owner) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void leaf_add(Pager* pager, const char* owner, unsigned int head) {
+    if (pager->leaf_count >= pager->leaf_buckets) {
+        unsigned int buckets = pager->leaf_buckets * 2;
+        LeafEntry** grown = calloc(buckets, sizeof(LeafEntry*));
+        if (!grown) {
+            memory_allocation_failed();
+        }
+        for (unsigned int i = 0; i < pager->leaf_buckets; i++) {
+            LeafEntry* entry = pager->leaves[i];
+            while (entry) {
+                LeafEntry* next = entry->next;
+                unsigned int bucket = owner_hash(entry->owner) & (buckets - 1);
+                entry->next = grown[bucket];
+                grown[bucket] = entry;
+                entry = next;
+            }
+        }
+        free(pager->leaves);
+        pager->leaves = grown;
+        pager->leaf_buckets = buckets;
+    }
+
+    LeafEntry* entry = malloc(sizeof(LeafEntry));
+    if (!entry) {
+        memory_allocation_failed();
+    }
+    strncpy(entry->owner, owner, PAGER_OWNER_LENGTH - 1);
+    entry->owner[PAGER_OWNER_LENGTH - 1] = '\0';
+    entry->head = head;
+    unsigned int bucket = owner_hash(owner) & (pager->leaf_buckets - 1);
+    entry->next = pager->leaves[bucket];
+    pager->leaves[bucket] = entry;
+    pager->leaf_count++;
+}
+
+static void leaf_remove(Pager* pager, const char* owner) {
+    LeafEntry** link = &pager->leaves[owner_hash(owner) & (pager->leaf_buckets - 1)];
+    while (*link && strcmp((*link)->owner, owner) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        LeafEntry* entry = *link;
+        *link = entry->next;
+        free(entry);
+        pager->leaf_count--;
+    }
+}
+
+// PAGE I/O
+
+// Pages are read and written at their offset, without the stream's position
+// or buffer, so a page can be read in while the pager mutex is released.
+static int read_at(Pager* pager, void* buffer, size_t length, unsigned long offset) {
+    #ifdef _WIN32
+        OVERLAPPED position = {0};
+        position.Offset = (DWORD)offset;
+        DWORD read = 0;
+        HANDLE handle = (HANDLE)_get_osfhandle(_fileno(pager->file));
+        if (!ReadFile(handle, buffer, (DWORD)length, &read, &position) || read != length) {
+            return DFH_ERROR_READ;
+        }
+    #else
+        size_t done = 0;
+        while (done < length) {
+            ssize_t read = pread(fileno(pager->file), (char*)buffer + done, length - done, (off_t)(offset + done));
+            if (read < 0 && errno == EINTR) continue;
+            if (read <= 0) return DFH_ERROR_READ;
+            done += (size_t)read;
+        }
+    #endif
+    return DFH_SUCCESS;
+}
+
+static int write_at(Pager* pager, const void* data, size_t length, unsigned long offset) {
+    #ifdef _WIN32
+        OVERLAPPED position = {0};
+        position.Offset = (DWORD)offset;
+        DWORD written = 0;
+        HANDLE handle = (HANDLE)_get_osfhandle(_fileno(pager->file));
+        if (!WriteFile(handle, data, (DWORD)length, &written, &position) || written != length) {
+            return DFH_ERROR_WRITE;
+        }
+    #else
+        size_t done = 0;
+        while (done < length) {
+            ssize_t written = pwrite(fileno(pager->file), (const char*)data + done, length - done, (off_t)(offset + done));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return DFH_ERROR_WRITE;
+            done += (size_t)written;
+        }
+    #endif
+    return DFH_SUCCESS;
+}
+
+static int write_page(Pager* pager, unsigned int page, const void* data) {
+    return write_at(pager, data, PAGER_PAGE_SIZE, (unsigned long)page * PAGER_PAGE_SIZE);
+}
+
+static int read_page(Pager* pager, unsigned int page, void* data) {
+    return read_at(pager, data, PAGER_PAGE_SIZE, (unsigned long)page * PAGER_PAGE_SIZE);
+}
+
+// BUFFER POOL
+
+static void track_page(Pager* pager, unsigned int page) {
+    if (page < pager->frame_of_capacity) return;
+    unsigned int capacity = pager->frame_of_capacity ? pager->frame_of_capacity : 256;
+    while (capacity <= page) capacity *= 2;
+    int* grown = realloc(pager->frame_of, capacity * sizeof(int));
+    if (!grown) {
+        memory_allocation_failed();
+    }
+    for (unsigned int i = pager->frame_of_capacity; i < capacity; i++) {
+        grown[i] = NO_FRAME;
+    }
+    pager->frame_of = grown;
+    pager->frame_of_capacity = capacity;
+}
+
+// Writes a dirty frame's page to the file, once the log has every change
+// it may hold.
+static int write_back(Pager* pager, Frame* frame) {
+    if (pager->log && wal_sync(pager->log) != DFH_SUCCESS) {
+        printf("Warning: Failed to sync the log before writing back page %u of %s\n", frame->page, pager->path);
+        return DFH_ERROR_WRITE;
+    }
+    if (write_page(pager, frame->page, frame->data) != DFH_SUCCESS) {
+        printf("Warning: Failed to write back page %u of %s\n", frame->page, pager->path);
+        return DFH_ERROR_WRITE;
+    }
+    frame->dirty = false;
+    return DFH_SUCCESS;
+}
+
+// Picks a frame with the CLOCK algorithm, writing back its page if dirty.
+static Frame* evict_frame(Pager* pager) {
+    for (int scanned = 0; scanned < 2 * PAGER_POOL_FRAMES; scanned++) {
+        Frame* frame = &pager->frames[pager->clock_hand];
+        pager->clock_hand = (pager->clock_hand + 1) % PAGER_POOL_FRAMES;
+        if (frame->pins > 0) continue;
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+        if (frame->page != 0) {
+            if (frame->dirty && write_back(pager, frame) != DFH_SUCCESS) continue;
+            pager->frame_of[frame->page] = NO_FRAME;
+            frame->page = 0;
+        }
+        return frame;
+    }
+    printf("Error: Buffer pool of %s has no unpinned frame\n", pager->path);
+    return NULL;
+}
+
+// Pins a page in the pool, reading it from disk unless it is brand new.
+// Caller holds the pager mutex. It is released while the page is read in,
+// with the frame pinned and marked loading, so other pages stay reachable
+// meanwhile; anyone pinning the same page waits for the read.
+static Frame* pin_page(Pager* pager, unsigned int page, bool fresh) {
+    track_page(pager, page);
+    int index = pager->frame_of[page];
+    if (index != NO_FRAME) {
+        Frame* frame = &pager->frames[index];
+        frame->pins++;
+        frame->referenced = true;
+        while (frame->loading) {
+            COND_WAIT(&pager->loaded, &pager->mutex);
+        }
+        if (frame->page != page) {
+            frame->pins--;
+            return NULL;
+        }
+        return frame;
+    }
+
+    Frame* frame = evict_frame(pager);
+    if (!frame) return NULL;
+    frame->page = page;
+    frame->pins = 1;
+    frame->dirty = fresh;
+    frame->referenced = true;
+    pager->frame_of[page] = (int)(frame - pager->frames);
+    if (fresh) {
+        memset(frame->data, 0, PAGER_PAGE_SIZE);
+        return frame;
+    }
+
+    frame->loading = true;
+    MUTEX_UNLOCK(&pager->mutex);
+    int result = read_page(pager, page, frame->data);
+    MUTEX_LOCK(&pager->mutex);
+    frame->loading = false;
+    COND_BROADCAST(&pager->loaded);
+    if (result != DFH_SUCCESS) {
+        pager->frame_of[page] = NO_FRAME;
+        frame->page = 0;
+        frame->pins--;
+        return NULL;
+    }
+    return frame;
+}
+
+static void unpin_page(Frame* frame, bool dirty) {
+    frame->pins--;
+    if (dirty) {
+        frame->dirty = true;
+    }
+}
+
+static int flush_frames(Pager* pager) {
+    if (pager->log && wal_sync(pager->log) != DFH_SUCCESS) {
+        return DFH_ERROR_WRITE;
+    }
+    int result = DFH_SUCCESS;
+    for (int i = 0; i < PAGER_POOL_FRAMES; i++) {
+        Frame* frame = &pager->frames[i];
+        if (frame->page != 0 && frame->dirty) {
+            if (write_page(pager, frame->page, frame->data) == DFH_SUCCESS) {
+                frame->dirty = false;
+            } else {
+                result = DFH_ERROR_WRITE;
+            }
+        }
+    }
+    return result;
+}
+
+static int sync_pages(Pager* pager) {
+    #ifdef _WIN32
+        return _commit(_fileno(pager->file)) == 0 ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #else
+        return fsync(fileno(pager->file)) == 0 ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    #endif
+}
+
+// PAGE ALLOCATION
+
+static Frame* allocate_page(Pager* pager, const char* owner, unsigned int flags) {
+    unsigned int page;
+    if (pager->free.count > 0) {
+        page = pager->free.pages[--pager->free.count];
+    } else {
+        page = pager->page_count++;
+    }
+
+    Frame* frame = pin_page(pager, page, true);
+    if (!frame) return NULL;
+    memset(frame->data, 0, PAGER_PAGE_SIZE);
+    PageHeader* header = page_header(frame);
+    header->flags = flags;
+    strncpy(header->owner, owner, PAGER_OWNER_LENGTH - 1);
+    frame->dirty = true;
+    return frame;
+}
+
+// Takes a page out of use once it is unlinked. Pages are written back in
+// any order, so until a flush has the unlink on disk, and a checkpoint that
+// no longer reaches the page, the file may still lead to it: it keeps its
+// contents until then, and is only reused once it is marked free on disk.
+static void release_page(Pager* pager, Frame* frame) {
+    list_push(&pager->freed, frame->page);
+    unpin_page(frame, false);
+}
+
+// Marks the retired pages free on disk, before the sync that lets them be
+// reused. Caller holds the pager mutex.
+static int free_retired(Pager* pager) {
+    for (int i = 0; i < pager->retired.count; i++) {
+        Frame* frame = pin_page(pager, pager->retired.pages[i], true);
+        if (!frame) return DFH_ERROR_WRITE;
+        memset(frame->data, 0, PAGER_PAGE_SIZE);
+        page_header(frame)->flags = PAGE_FREE;
+        unpin_page(frame, true);
+    }
+    return DFH_SUCCESS;
+}
+
+// RECORDS WITHIN A PAGE
+
+// Returns the byte offset of key among the page's records, or -1.
+static int find_record(Frame* frame, int key) {
+    PageHeader* header = page_header(frame);
+    unsigned char* records = page_records(frame);
+    unsigned int offset = 0;
+    for (unsigned short i = 0; i < header->count; i++) {
+        PageRecord record;
+        memcpy(&record, records + offset, sizeof(record));
+        if (record.key == key) {
+            return (int)offset;
+        }
+        offset += sizeof(record) + record.length;
+    }
+    return -1;
+}
+
+static void remove_record(Frame* frame, int offset) {
+    PageHeader* header = page_header(frame);
+    unsigned char* records = page_records(frame);
+    PageRecord record;
+    memcpy(&record, records + offset, sizeof(record));
+    unsigned int size = sizeof(record) + record.length;
+    memmove(records + offset, records + offset + size, header->used - offset - size);
+    header->used -= size;
+    header->count--;
+}
+
+static bool page_has_room(Frame* frame, unsigned int size) {
+    return page_header(frame)->used + size <= PAGE_DATA_SIZE;
+}
+
+static void append_record(Frame* frame, int key, const char* line, unsigned int length, bool newline) {
+    PageHeader* header = page_header(frame);
+    unsigned char* cursor = page_records(frame) + header->used;
+    PageRecord record = { key, (unsigned short)(length + (newline ? 1 : 0)) };
+    memcpy(cursor, &record, sizeof(record));
+    memcpy(cursor + sizeof(record), line, length);
+    if (newline) {
+        cursor[sizeof(record) + length] = '\n';
+    }
+    header->used += sizeof(record) + record.length;
+    header->count++;
+}
+
+// STORE LIFECYCLE
+
+// Rewrites the header of page, which is not in the pool.
+static int patch_header(Pager* pager, unsigned int page, const PageHeader* header) {
+    unsigned char* data = malloc(PAGER_PAGE_SIZE);
+    if (!data) {
+        memory_allocation_failed();
+    }
+    int result = read_page(pager, page, data);
+    if (result == DFH_SUCCESS) {
+        memcpy(data, header, sizeof(PageHeader));
+        result = write_page(pager, page, data);
+    }
+    free(data);
+    return result;
+}
+
+// Rebuilds the leaf directory and the free list from the page headers.
+// After a crash the file holds whichever pages were written back, so a
+// chain may lead past the end of the file, to a page that was never
+// written, or to one another chain has taken since: it is cut at the first
+// page that is not its own. The chain is whole up to there, since the
+// pages written after the last checkpoint are redone from the log. Pages
+// no chain reaches are marked free before anything can reuse them.
+static int scan_pages(Pager* pager) {
+    unsigned int count = pager->page_count;
+    PageHeader* headers = malloc((size_t)count * sizeof(PageHeader));
+    unsigned char* reached = calloc(count, 1);
+    if (!headers || !reached) {
+        memory_allocation_failed();
+    }
+
+    int result = DFH_SUCCESS;
+    for (unsigned int page = 1; page < count && result == DFH_SUCCESS; page++) {
+        result = read_at(pager, &headers[page], sizeof(PageHeader), (unsigned long)page * PAGER_PAGE_SIZE);
+        headers[page].owner[PAGER_OWNER_LENGTH - 1] = '\0';
+    }
+
+    bool repaired = false;
+    for (unsigned int head = 1; head < count && result == DFH_SUCCESS; head++) {
+        if ((headers[head].flags & (PAGE_HEAD | PAGE_FREE)) != PAGE_HEAD || reached[head]) continue;
+        reached[head] = 1;
+        leaf_add(pager, headers[head].owner, head);
+        unsigned int page = head;
+        unsigned int next = headers[page].next;
+        while (next != 0) {
+            if (next >= count || reached[next] || headers[next].flags != 0 ||
+                strcmp(headers[next].owner, headers[head].owner) != 0) {
+                headers[page].next = 0;
+                result = patch_header(pager, page, &headers[page]);
+                repaired = true;
+                break;
+            }
+            reached[next] = 1;
+            page = next;
+            next = headers[page].next;
+        }
+    }
+
+    unsigned char* blank = calloc(1, PAGER_PAGE_SIZE);
+    if (!blank) {
+        memory_allocation_failed();
+    }
+    ((PageHeader*)blank)->flags = PAGE_FREE;
+    for (unsigned int page = 1; page < count && result == DFH_SUCCESS; page++) {
+        if (reached[page]) continue;
+        if (headers[page].flags != PAGE_FREE) {
+            result = write_page(pager, page, blank);
+            repaired = true;
+        }
+        list_push(&pager->free, page);
+    }
+    if (repaired && result == DFH_SUCCESS) {
+        result = sync_pages(pager);
+    }
+    free(blank);
+    free(reached);
+    free(headers);
+    return result;
+}
+
+static int open_page_file(Pager* pager) {
+    PagerFileHeader file_header = { PAGER_MAGIC, PAGER_PAGE_SIZE };
+    pager->file = fopen(pager->path, "r+b");
+    if (!pager->file) {
+        if (errno != ENOENT) return DFH_ERROR_OPEN;
+        pager->file = fopen(pager->path, "w+b");
+        if (!pager->file) return DFH_ERROR_OPEN;
+
+        unsigned char* page = calloc(1, PAGER_PAGE_SIZE);
+        if (!page) {
+            memory_allocation_failed();
+        }
+        memcpy(page, &file_header, sizeof(file_header));
+        int result = write_page(pager, 0, page);
+        free(page);
+        pager->page_count = 1;
+        return result;
+    }
+
+    PagerFileHeader existing;
+    if (read_at(pager, &existing, sizeof(existing), 0) != DFH_SUCCESS ||
+        existing.magic != PAGER_MAGIC || existing.page_size != PAGER_PAGE_SIZE) {
+        printf("Error: %s is not a page file with %d byte pages\n", pager->path, PAGER_PAGE_SIZE);
+        return DFH_ERROR_READ;
+    }
+    if (fseek(pager->file, 0, SEEK_END) != 0) {
+        return DFH_ERROR_SEEK;
+    }
+    long size = ftell(pager->file);
+    pager->page_count = size > 0 ? (unsigned int)(size / PAGER_PAGE_SIZE) : 1;
+    return scan_pages(pager);
+}
+
+Pager* pager_open(const char* dataset_name) {
+    Pager* pager = calloc(1, sizeof(Pager));
+    if (!pager) {
+        memory_allocation_failed();
+    }
+    snprintf(pager->path, MAX_PATH_LENGTH, "%s/pages.db", dataset_name);
+    pager->leaf_buckets = 256;
+    pager->leaves = calloc(pager->leaf_buckets, sizeof(LeafEntry*));
+    unsigned char* pool = malloc((size_t)PAGER_POOL_FRAMES * PAGER_PAGE_SIZE);
+    if (!pager->leaves || !pool) {
+        memory_allocation_failed();
+    }
+    for (int i = 0; i < PAGER_POOL_FRAMES; i++) {
+        pager->frames[i].data = pool + (size_t)i * PAGER_PAGE_SIZE;
+    }
+    MUTEX_INIT(&pager->mutex);
+    COND_INIT(&pager->loaded);
+
+    if (open_page_file(pager) != DFH_SUCCESS) {
+        printf("Failed to open page file %s\n", pager->path);
+        pager_close(pager);
+        return NULL;
+    }
+    return pager;
+}
+
+void pager_close(Pager* pager) {
+    if (!pager) return;
+
+    if (pager->file) {
+        if (flush_frames(pager) != DFH_SUCCESS) {
+            printf("Warning: Failed to flush pages of %s\n", pager->path);
+        }
+        fclose(pager->file);
+    }
+    MUTEX_DESTROY(&pager->mutex);
+    COND_DESTROY(&pager->loaded);
+
+    for (unsigned int i = 0; i < pager->leaf_buckets; i++) {
+        LeafEntry* entry = pager->leaves[i];
+        while (entry) {
+            LeafEntry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(pager->leaves);
+    free(pager->frames[0].data);
+    free(pager->frame_of);
+    free(pager->free.pages);
+    free(pager->freed.pages);
+    free(pager->flushed.pages);
+    free(pager->retired.pages);
+    free(pager);
+}
+
+// Writes back every dirty page and syncs the page file. The retired pages
+// are marked free with them and can be reused from then on; the pages
+// unlinked so far wait for the checkpoint this flush is for.
+int pager_flush(Pager* pager) {
+    MUTEX_LOCK(&pager->mutex);
+    int result = free_retired(pager);
+    if (result == DFH_SUCCESS) {
+        result = flush_frames(pager);
+    }
+    if (result == DFH_SUCCESS) {
+        result = sync_pages(pager);
+    }
+    if (result == DFH_SUCCESS) {
+        list_move(&pager->free, &pager->retired);
+        list_move(&pager->flushed, &pager->freed);
+    }
+    MUTEX_UNLOCK(&pager->mutex);
+    return result;
+}
+
+// Called once a checkpoint that followed a flush is on disk: neither it nor
+// the chains in the file reach the pages unlinked before that flush.
+void pager_checkpointed(Pager* pager) {
+    MUTEX_LOCK(&pager->mutex);
+    list_move(&pager->retired, &pager->flushed);
+    MUTEX_UNLOCK(&pager->mutex);
+}
+
+void pager_attach_log(Pager* pager, Wal* wal) {
+    MUTEX_LOCK(&pager->mutex);
+    pager->log = wal;
+    MUTEX_UNLOCK(&pager->mutex);
+}
+
+// LEAF OPERATIONS
+
+// Returns the directory entry of owner, giving it a head page if it has
+// none yet. Caller holds the pager mutex.
+static LeafEntry* open_leaf(Pager* pager, const char* owner) {
+    LeafEntry* leaf = leaf_find(pager, owner);
+    if (leaf) return leaf;
+    Frame* frame = allocate_page(pager, owner, PAGE_HEAD);
+    if (!frame) return NULL;
+    leaf_add(pager, owner, frame->page);
+    unpin_page(frame, true);
+    return leaf_find(pager, owner);
+}
+
+int pager_create_leaf(Pager* pager, const char* owner) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = open_leaf(pager, owner);
+    MUTEX_UNLOCK(&pager->mutex);
+    return leaf ? DFH_SUCCESS : DFH_ERROR_WRITE;
+}
+
+// The head page stops being one on disk right away, so that a leaf written
+// again after its pages were dropped does not come back with two.
+int pager_drop_leaf(Pager* pager, const char* owner) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = leaf_find(pager, owner);
+    unsigned int page = leaf ? leaf->head : 0;
+    while (page != 0) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) {
+            MUTEX_UNLOCK(&pager->mutex);
+            return DFH_ERROR_READ;
+        }
+        if (page == leaf->head) {
+            page_header(frame)->flags = 0;
+            write_back(pager, frame);
+        }
+        page = page_header(frame)->next;
+        release_page(pager, frame);
+    }
+    leaf_remove(pager, owner);
+    MUTEX_UNLOCK(&pager->mutex);
+    return DFH_SUCCESS;
+}
+
+int pager_put(Pager* pager, const char* owner, int key, const char* line, size_t length) {
+    bool newline = length == 0 || line[length - 1] != '\n';
+    unsigned int size = sizeof(PageRecord) + (unsigned int)length + (newline ? 1 : 0);
+    if (size > PAGE_DATA_SIZE) {
+        return DFH_ERROR_WRITE;
+    }
+
+    // Like a leaf file, a leaf whose pages were dropped comes back on write.
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = open_leaf(pager, owner);
+    if (!leaf) {
+        MUTEX_UNLOCK(&pager->mutex);
+        return DFH_ERROR_WRITE;
+    }
+
+    // Drop any previous record for the key and remember the first page
+    // with room; the chain's tail stays pinned in case it must grow.
+    Frame* target = NULL;
+    Frame* tail = NULL;
+    unsigned int page = leaf->head;
+    while (page != 0) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) {
+            if (target) unpin_page(target, false);
+            if (tail) unpin_page(tail, false);
+            MUTEX_UNLOCK(&pager->mutex);
+            return DFH_ERROR_READ;
+        }
+        int offset = find_record(frame, key);
+        if (offset >= 0) {
+            remove_record(frame, offset);
+            frame->dirty = true;
+        }
+        if (tail) {
+            unpin_page(tail, false);
+        }
+        tail = frame;
+        if (!target && page_has_room(frame, size)) {
+            target = frame;
+            frame->pins++;
+        }
+        page = page_header(frame)->next;
+    }
+
+    int result = DFH_SUCCESS;
+    if (!target) {
+        target = allocate_page(pager, owner, 0);
+        if (target) {
+            page_header(tail)->next = target->page;
+            tail->dirty = true;
+        } else {
+            result = DFH_ERROR_WRITE;
+        }
+    }
+    if (target) {
+        append_record(target, key, line, (unsigned int)length, newline);
+        unpin_page(target, true);
+    }
+    unpin_page(tail, false);
+    MUTEX_UNLOCK(&pager->mutex);
+    return result;
+}
+
+int pager_get(Pager* pager, const char* owner, int key, char* buffer, size_t buffer_size) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = leaf_find(pager, owner);
+    if (!leaf) {
+        MUTEX_UNLOCK(&pager->mutex);
+        return DFH_ERROR_OPEN;
+    }
+
+    unsigned int page = leaf->head;
+    while (page != 0) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) break;
+        int offset = find_record(frame, key);
+        if (offset >= 0) {
+            PageRecord record;
+            memcpy(&record, page_records(frame) + offset, sizeof(record));
+            size_t length = record.length < buffer_size - 1 ? record.length : buffer_size - 1;
+            memcpy(buffer, page_records(frame) + offset + sizeof(record), length);
+            buffer[length] = '\0';
+            unpin_page(frame, false);
+            MUTEX_UNLOCK(&pager->mutex);
+            return DFH_SUCCESS;
+        }
+        page = page_header(frame)->next;
+        unpin_page(frame, false);
+    }
+    MUTEX_UNLOCK(&pager->mutex);
+    return DFH_ERROR_READ;
+}
+
+static int compare_keys(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Removes the records of owner whose key is in keys (sorted), or with keep
+// set those whose key is not. Empty overflow pages are unlinked and freed;
+// the head page stays.
+int pager_filter(Pager* pager, const char* owner, const int* keys, int num_keys, bool keep) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = leaf_find(pager, owner);
+    if (!leaf) {
+        MUTEX_UNLOCK(&pager->mutex);
+        return keep ? DFH_SUCCESS : DFH_ERROR_OPEN;
+    }
+
+    Frame* previous = NULL;
+    unsigned int page = leaf->head;
+    while (page != 0) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) {
+            if (previous) unpin_page(previous, false);
+            MUTEX_UNLOCK(&pager->mutex);
+            return DFH_ERROR_READ;
+        }
+        PageHeader* header = page_header(frame);
+        unsigned int offset = 0;
+        while (offset < header->used) {
+            PageRecord record;
+            memcpy(&record, page_records(frame) + offset, sizeof(record));
+            bool listed = bsearch(&record.key, keys, num_keys, sizeof(int), compare_keys) != NULL;
+            if (listed == keep) {
+                offset += sizeof(record) + record.length;
+                continue;
+            }
+            remove_record(frame, (int)offset);
+            frame->dirty = true;
+        }
+        page = header->next;
+        if (previous && header->count == 0) {
+            page_header(previous)->next = page;
+            previous->dirty = true;
+            release_page(pager, frame);
+            continue;
+        }
+        if (previous) unpin_page(previous, false);
+        previous = frame;
+    }
+    if (previous) unpin_page(previous, false);
+    MUTEX_UNLOCK(&pager->mutex);
+    return DFH_SUCCESS;
+}
+
+// Copies the records of source with keys in keys (sorted) to the end of
+// dest's chain, after dropping those dest already has for them. source is
+// left as it is.
+int pager_copy(Pager* pager, const char* source, const char* dest, const int* keys, int num_keys) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* source_leaf = leaf_find(pager, source);
+    if (!source_leaf) {
+        MUTEX_UNLOCK(&pager->mutex);
+        return DFH_SUCCESS;
+    }
+    unsigned int source_head = source_leaf->head;
+    LeafEntry* dest_leaf = open_leaf(pager, dest);
+    if (!dest_leaf) {
+        MUTEX_UNLOCK(&pager->mutex);
+        return DFH_ERROR_WRITE;
+    }
+
+    Frame* tail = NULL;
+    unsigned int page = dest_leaf->head;
+    while (page != 0) {
+        if (tail) unpin_page(tail, false);
+        tail = pin_page(pager, page, false);
+        if (!tail) {
+            MUTEX_UNLOCK(&pager->mutex);
+            return DFH_ERROR_READ;
+        }
+        PageHeader* header = page_header(tail);
+        unsigned int offset = 0;
+        while (offset < header->used) {
+            PageRecord record;
+            memcpy(&record, page_records(tail) + offset, sizeof(record));
+            if (bsearch(&record.key, keys, num_keys, sizeof(int), compare_keys)) {
+                remove_record(tail, (int)offset);
+                tail->dirty = true;
+            } else {
+                offset += sizeof(record) + record.length;
+            }
+        }
+        page = header->next;
+    }
+
+    int result = DFH_SUCCESS;
+    page = source_head;
+    while (page != 0 && result == DFH_SUCCESS) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) {
+            result = DFH_ERROR_READ;
+            break;
+        }
+        PageHeader* header = page_header(frame);
+        unsigned int offset = 0;
+        for (; offset < header->used; offset += sizeof(PageRecord)) {
+            PageRecord record;
+            memcpy(&record, page_records(frame) + offset, sizeof(record));
+            const char* line = (const char*)page_records(frame) + offset + sizeof(record);
+            offset += record.length;
+            if (!bsearch(&record.key, keys, num_keys, sizeof(int), compare_keys)) continue;
+            if (!page_has_room(tail, sizeof(record) + record.length)) {
+                Frame* grown = allocate_page(pager, dest, 0);
+                if (!grown) {
+                    result = DFH_ERROR_WRITE;
+                    break;
+                }
+                page_header(tail)->next = grown->page;
+                unpin_page(tail, true);
+                tail = grown;
+            }
+            append_record(tail, record.key, line, record.length, false);
+            tail->dirty = true;
+        }
+        page = header->next;
+        unpin_page(frame, false);
+    }
+    unpin_page(tail, false);
+    MUTEX_UNLOCK(&pager->mutex);
+    return result;
+}
+
+bool pager_is_empty(Pager* pager, const char* owner) {
+    MUTEX_LOCK(&pager->mutex);
+    LeafEntry* leaf = leaf_find(pager, owner);
+    bool empty = true;
+    unsigned int page = leaf ? leaf->head : 0;
+    while (page != 0 && empty) {
+        Frame* frame = pin_page(pager, page, false);
+        if (!frame) break;
+        empty = page_header(frame)->count == 0;
+        page = page_header(frame)->next;
+        unpin_page(frame, false);
+    }
+    MUTEX_UNLOCK(&pager->mutex);
+    return empty;
+}
@@ -6,6 +6,9 @@
 #include "../lib/node.h"
 #include "../lib/dfh.h"
 #include "../lib/application.h"
+#include "../lib/utils.h"
+#include "../lib/wal.h"
+#include "../lib/snapshot.h"
 
 cJSON* node_to_json(Node* node) {
     if (!node) return NULL;
@@ -64,7 +67,7 @@ cJSON* node_to_json(Node* node) {
     return json_node;
 }
 
-Node* json_to_node(const char* dataset_name, cJSON* json, Node* parent) {
+Node* json_to_node(BPT* tree, cJSON* json, Node* parent) {
     if (!json) return NULL;
     
     cJSON* is_leaf_item = cJSON_GetObjectItem(json, "is_leaf");
@@ -74,22 +77,20 @@ Node* json_to_node(const char* dataset_name, cJSON* json, Node* parent) {
     bool is_leaf = is_leaf_item->valueint;
     int n = n_item->valueint;
     
-    Node* node = create_node(dataset_name, is_leaf, n + 1);
-    if (!node) return NULL;
-    
+    Node* node = allocate_node(tree->arena, is_leaf, tree->T);
     node->n = n;
     node->parent = parent;
     
     cJSON* keys = cJSON_GetObjectItem(json, "keys");
     if (!keys) {
-        free_node(node,dataset_name);
+        free_node_and_not_file(tree, node);
         return NULL;
     }
     
     for (int i = 0; i < n; i++) {
         cJSON* key_item = cJSON_GetArrayItem(keys, i);
         if (!key_item) {
-            free_node(node,dataset_name);
+            free_node_and_not_file(tree, node);
             return NULL;
         }
         node->keys[i] = key_item->valueint;
@@ -97,40 +98,58 @@ Node* json_to_node(const char* dataset_name, cJSON* json, Node* parent) {
     
     if (is_leaf) {
         cJSON* file_pointer = cJSON_GetObjectItem(json, "file_pointer");
-        if (file_pointer && file_pointer->valuestring) {
-            node->file_pointer = strdup(file_pointer->valuestring);
-            if (!node->file_pointer) {
-                free_node(node, dataset_name);
-                return NULL;
-            }
+        if (cJSON_IsString(file_pointer) && file_pointer->valuestring[0] &&
+            strlen(file_pointer->valuestring) < DFH_FILE_POINTER_LENGTH) {
+            strcpy(node->file_pointer, file_pointer->valuestring);
+        } else {
+            generate_file_pointer(node->file_pointer);
+            dfh_create_datafile(tree->dataset_name, node->file_pointer);
         }
+        node->count = n;
     }
     if (!is_leaf) {
         cJSON* children = cJSON_GetObjectItem(json, "children");
         if (!children) {
-            free_node(node, dataset_name);
+            free_node_and_not_file(tree, node);
             return NULL;
         }
         
         for (int i = 0; i <= n; i++) {
-            node->children[i] = json_to_node(dataset_name, cJSON_GetArrayItem(children, i), node);
+            node->children[i] = json_to_node(tree, cJSON_GetArrayItem(children, i), node);
             if (!node->children[i]) {
-                free_node(node, dataset_name);
+                free_node_and_not_file(tree, node);
                 return NULL;
             }
+            node->sums[i] = node->children[i]->count;
         }
+        pack_counts(node);
     }
     
     return node;
 }
 
-int save_tree_to_json(BPT* tree) {
-    if (!tree || !tree->dataset_name) return -1;
+static int write_tree_json(BPT* tree) {
+    // The export covers the whole tree, including nodes not read yet.
+    if (tree->snapshot) {
+        tree->root = snapshot_fault_subtree(tree->snapshot, tree->root);
+    }
+
+    // Leaf records buffered by the storage engine must be on disk before
+    // the index that points at them.
+    if (dfh_flush_dataset(tree->dataset_name) != DFH_SUCCESS) return -1;
     
     cJSON* json_tree = cJSON_CreateObject();
     if (!json_tree) return -1;
     
     cJSON_AddNumberToObject(json_tree, "T", tree->T);
+    cJSON_AddStringToObject(json_tree, "storage", dfh_storage_name(tree->storage));
+    cJSON_AddNumberToObject(json_tree, "checkpoint_lsn", (double)tree->applied_lsn);
+    cJSON* json_policy = cJSON_AddObjectToObject(json_tree, "policy");
+    if (json_policy) {
+        cJSON_AddNumberToObject(json_policy, "split", tree->policy.split_percent);
+        cJSON_AddNumberToObject(json_policy, "merge", tree->policy.merge_percent);
+        cJSON_AddNumberToObject(json_policy, "hysteresis", tree->policy.hysteresis_percent);
+    }
     cJSON* json_root = node_to_json(tree->root);
     if (!json_root) {
         cJSON_Delete(json_tree);
@@ -143,19 +162,82 @@ int save_tree_to_json(BPT* tree) {
     if (!json_str) return -1;
     
     char index_path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH];
     snprintf(index_path, MAX_PATH_LENGTH, "%s/index.json", tree->dataset_name);
+    snprintf(temp_path, MAX_PATH_LENGTH, "%s/index.json.tmp", tree->dataset_name);
     
-    FILE* file = fopen(index_path, "w");
+    // Write a copy and rename it over the old index, so a crash never
+    // leaves a half written one behind.
+    FILE* file = fopen(temp_path, "w");
     if (!file) {
         free(json_str);
         return -1;
     }
     
-    fprintf(file, "%s", json_str);
-    fclose(file);
+    bool written = fputs(json_str, file) >= 0;
+    written = fclose(file) == 0 && written;
     free(json_str);
-    
-    return 0;
+    if (!written) {
+        remove(temp_path);
+        return -1;
+    }
+
+    return dfh_replace_file(temp_path, index_path) == DFH_SUCCESS ? 0 : -1;
+}
+
+// Both writers below wait for the operations in flight and hold new ones
+// off, so they see the tree at rest.
+int save_tree_to_json(BPT* tree) {
+    if (!tree || !tree->dataset_name) return -1;
+
+    RWLOCK_WRITE_LOCK(&tree->tree_lock);
+    int result = write_tree_json(tree);
+    RWLOCK_WRITE_UNLOCK(&tree->tree_lock);
+    return result;
+}
+
+int checkpoint_tree(BPT* tree) {
+    RWLOCK_WRITE_LOCK(&tree->tree_lock);
+    reclaim_retired(tree);
+    int trim_count;
+    Node** trims = find_trims(tree, &trim_count);
+    int result = 0;
+    if (save_tree_snapshot(tree) != 0) {
+        printf("Error: Could not checkpoint %s\n", tree->dataset_name);
+        result = -1;
+    } else {
+        if (wal_truncate(tree->wal, tree->applied_lsn) != DFH_SUCCESS) {
+            result = -1;
+        }
+        dfh_checkpoint_durable(tree->dataset_name);
+        release_leftovers(tree, trims, trim_count);
+    }
+    free(trims);
+    RWLOCK_WRITE_UNLOCK(&tree->tree_lock);
+    return result;
+}
+
+// Links the leaves left to right and gives every node below the root the
+// separator to its right as its high key.
+static void link_leaves(Node* node, Node** prev) {
+    if (node->is_leaf) {
+        if (*prev) (*prev)->next = node;
+        *prev = node;
+        return;
+    }
+    for (int i = 0; i <= node->n; i++) {
+        node->children[i]->high_key = i < node->n ? node->keys[i] : node->high_key;
+        link_leaves(node->children[i], prev);
+    }
+}
+
+static void replay_record(void* context, unsigned int type, int key, const char* line, Lsn lsn) {
+    BPT* tree = context;
+    if (type == WAL_INSERT) {
+        apply_insert(tree, key, line, lsn);
+    } else if (type == WAL_DELETE) {
+        apply_delete(tree, key, lsn);
+    }
 }
 
 BPT* load_tree_from_json(const char* dataset_name) {
@@ -208,7 +290,14 @@ BPT* load_tree_from_json(const char* dataset_name) {
         return NULL;
     }
     
-    BPT* tree = create_BPT(dataset_name, T_item->valueint);
+    cJSON* storage_item = cJSON_GetObjectItem(json_tree, "storage");
+    int storage = dfh_storage_from_name(cJSON_IsString(storage_item) ? storage_item->valuestring : NULL);
+    if (storage < 0) {
+        cJSON_Delete(json_tree);
+        return NULL;
+    }
+
+    BPT* tree = create_BPT(dataset_name, T_item->valueint, storage);
     if (!tree) {
         cJSON_Delete(json_tree);
         return NULL;
@@ -217,30 +306,60 @@ BPT* load_tree_from_json(const char* dataset_name) {
     cJSON* json_root = cJSON_GetObjectItem(json_tree, "root");
     if (!json_root) {
         cJSON_Delete(json_tree);
-        free(tree);
+        free_tree(tree);
         return NULL;
     }
     
-    tree->root = json_to_node(dataset_name, json_root, NULL);
+    free_node(tree, tree->root);
+    tree->root = json_to_node(tree, json_root, NULL);
     if (!tree->root) {
         cJSON_Delete(json_tree);
-        free(tree);
+        free_tree(tree);
         return NULL;
     }
     
-    Node* cursor = tree->root;
     Node* prev = NULL;
+    link_leaves(tree->root, &prev);
     
-    while (!cursor->is_leaf) {
-        cursor = cursor->children[0];
-    }
-    
-    while (cursor) {
-        if (prev) prev->next = cursor;
-        prev = cursor;
-        cursor = cursor->next;
+    cJSON* lsn_item = cJSON_GetObjectItem(json_tree, "checkpoint_lsn");
+    tree->applied_lsn = cJSON_IsNumber(lsn_item) ? (Lsn)lsn_item->valuedouble : 0;
+
+    // Exports older than policies leave the defaults in place.
+    cJSON* policy_item = cJSON_GetObjectItem(json_tree, "policy");
+    if (policy_item) {
+        cJSON* split = cJSON_GetObjectItem(policy_item, "split");
+        cJSON* merge = cJSON_GetObjectItem(policy_item, "merge");
+        cJSON* hysteresis = cJSON_GetObjectItem(policy_item, "hysteresis");
+        TreePolicy policy = tree->policy;
+        if (cJSON_IsNumber(split)) policy.split_percent = split->valueint;
+        if (cJSON_IsNumber(merge)) policy.merge_percent = merge->valueint;
+        if (cJSON_IsNumber(hysteresis)) policy.hysteresis_percent = hysteresis->valueint;
+        if (valid_policy(&policy)) {
+            tree->policy = policy;
+        }
     }
-    
     cJSON_Delete(json_tree);
     return tree;
+}
+
+// Loads the binary snapshot, or index.json for datasets that were never
+// checkpointed in the binary format or whose snapshot is unreadable, then
+// replays the operations logged since and checkpoints so the next load
+// starts from here. Leaves the replay left underfull wait for the
+// rebalancer, which starts only once the tree is complete.
+BPT* load_tree(const char* dataset_name) {
+    BPT* tree = load_tree_snapshot(dataset_name);
+    if (!tree) {
+        tree = load_tree_from_json(dataset_name);
+    }
+    if (!tree) return NULL;
+
+    Lsn checkpoint_lsn = tree->applied_lsn;
+    wal_replay(tree->wal, checkpoint_lsn, replay_record, tree);
+    if (tree->applied_lsn != checkpoint_lsn || !tree->snapshot) {
+        tree->checkpoint_due = false;
+        checkpoint_tree(tree);
+    }
+    start_rebalancer(tree);
+    return tree;
 }
\ No newline at end of file
@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include "../lib/segment.h"
+#include "../lib/dfh.h"
+#include "../lib/sync.h"
+#include "../lib/utils.h"
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+typedef struct SegmentRef {
+    unsigned int segment;
+    unsigned int offset;
+    unsigned int length;
+} SegmentRef;
+
+typedef struct SegmentSlot {
+    int key;
+    bool used;
+    bool doomed;  // deleted; the tombstone waits for the next sync
+    SegmentRef ref;
+} SegmentSlot;
+
+typedef struct SegmentFile {
+    unsigned int id;
+    FILE* reader;
+    unsigned long size;
+    unsigned long dead;
+} SegmentFile;
+
+struct SegmentStore {
+    char dataset_name[MAX_PATH_LENGTH];
+    SegmentSlot* slots;
+    size_t capacity;
+    size_t count;
+    SegmentFile* segments;
+    int segment_count;
+    int segment_capacity;
+    FILE* writer;
+    int* doomed;
+    int doomed_count;
+    int doomed_capacity;
+    Mutex mutex;
+    CondVar wake;
+    Thread compactor;
+    bool compactor_running;
+    bool stopping;
+};
+
+static unsigned long record_size(unsigned int length) {
+    return sizeof(SegmentRecordHeader) + length;
+}
+
+// Returns false if the path does not fit in MAX_PATH_LENGTH.
+static bool segment_path(const SegmentStore* store, unsigned int id, char* path) {
+    int length = snprintf(path, MAX_PATH_LENGTH, "%s/data/segment_%08u.log", store->dataset_name, id);
+    if (length < 0 || length >= MAX_PATH_LENGTH) {
+        printf("Error: Segment path for %s is too long\n", store->dataset_name);
+        return false;
+    }
+    return true;
+}
+
+// DIRECTORY (open addressing, linear probing)
+
+static size_t slot_for(int key, size_t capacity) {
+    return ((unsigned int)key * 2654435761u) & (capacity - 1);
+}
+
+static SegmentSlot* dir_find(SegmentStore* store, int key) {
+    size_t mask = store->capacity - 1;
+    for (size_t i = slot_for(key, store->capacity); store->slots[i].used; i = (i + 1) & mask) {
+        if (store->slots[i].key == key) {
+            return &store->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void dir_grow(SegmentStore* store) {
+    SegmentSlot* old_slots = store->slots;
+    size_t old_capacity = store->capacity;
+
+    store->capacity = old_capacity * 2;
+    store->slots = calloc(store->capacity, sizeof(SegmentSlot));
+    if (!store->slots) {
+        memory_allocation_failed();
+    }
+
+    size_t mask = store->capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old_slots[i].used) continue;
+        size_t j = slot_for(old_slots[i].key, store->capacity);
+        while (store->slots[j].used) j = (j + 1) & mask;
+        store->slots[j] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+// Points key at ref. Returns true and fills *old if the key had a record.
+static bool dir_put(SegmentStore* store, int key, SegmentRef ref, SegmentRef* old) {
+    SegmentSlot* slot = dir_find(store, key);
+    if (slot) {
+        *old = slot->ref;
+        slot->ref = ref;
+        slot->doomed = false;
+        return true;
+    }
+
+    if ((store->count + 1) * 10 > store->capacity * 7) {
+        dir_grow(store);
+    }
+    size_t mask = store->capacity - 1;
+    size_t i = slot_for(key, store->capacity);
+    while (store->slots[i].used) i = (i + 1) & mask;
+    store->slots[i].used = true;
+    store->slots[i].doomed = false;
+    store->slots[i].key = key;
+    store->slots[i].ref = ref;
+    store->count++;
+    return false;
+}
+
+static bool dir_remove(SegmentStore* store, int key, SegmentRef* old) {
+    SegmentSlot* slot = dir_find(store, key);
+    if (!slot) return false;
+    *old = slot->ref;
+
+    // Backward-shift deletion keeps probe chains intact without tombstones.
+    size_t mask = store->capacity - 1;
+    size_t hole = (size_t)(slot - store->slots);
+    size_t j = hole;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!store->slots[j].used) break;
+        size_t home = slot_for(store->slots[j].key, store->capacity);
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (!stays) {
+            store->slots[hole] = store->slots[j];
+            hole = j;
+        }
+    }
+    store->slots[hole].used = false;
+    store->count--;
+    return true;
+}
+
+// SEGMENT FILES
+
+static SegmentFile* find_segment(SegmentStore* store, unsigned int id) {
+    int low = 0, high = store->segment_count - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (store->segments[mid].id == id) {
+            return &store->segments[mid];
+        } else if (store->segments[mid].id < id) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+static SegmentFile* add_segment(SegmentStore* store, unsigned int id) {
+    if (store->segment_count == store->segment_capacity) {
+        store->segment_capacity = store->segment_capacity ? store->segment_capacity * 2 : 8;
+        store->segments = realloc(store->segments, store->segment_capacity * sizeof(SegmentFile));
+        if (!store->segments) {
+            memory_allocation_failed();
+        }
+    }
+    SegmentFile* segment = &store->segments[store->segment_count++];
+    segment->id = id;
+    segment->reader = NULL;
+    segment->size = 0;
+    segment->dead = 0;
+    return segment;
+}
+
+static FILE* segment_reader(SegmentStore* store, SegmentFile* segment) {
+    if (!segment->reader) {
+        char path[MAX_PATH_LENGTH];
+        if (!segment_path(store, segment->id, path)) return NULL;
+        segment->reader = fopen(path, "rb");
+    }
+    return segment->reader;
+}
+
+static void mark_dead(SegmentStore* store, SegmentRef ref) {
+    SegmentFile* segment = find_segment(store, ref.segment);
+    if (segment) {
+        segment->dead += record_size(ref.length);
+    }
+}
+
+static bool sync_writer(SegmentStore* store) {
+    if (fflush(store->writer) != 0) return false;
+    #ifdef _WIN32
+        return _commit(_fileno(store->writer)) == 0;
+    #else
+        return fsync(fileno(store->writer)) == 0;
+    #endif
+}
+
+static int open_active_segment(SegmentStore* store, unsigned int id) {
+    if (store->writer) {
+        fclose(store->writer);
+    }
+    store->writer = NULL;
+    char path[MAX_PATH_LENGTH];
+    if (!segment_path(store, id, path)) return DFH_ERROR_OPEN;
+    store->writer = fopen(path, "ab");
+    if (!store->writer) {
+        printf("Failed to open segment %s: %s\n", path, strerror(errno));
+        return DFH_ERROR_OPEN;
+    }
+    if (!find_segment(store, id)) {
+        add_segment(store, id);
+    }
+    return DFH_SUCCESS;
+}
+
+// Appends one record to the active segment, rolling over to a new segment
+// once the current one is full. Caller holds the store mutex.
+static int append_record(SegmentStore* store, int key, const char* payload, unsigned int length,
+                         unsigned int flags, SegmentRef* ref) {
+    SegmentFile* active = &store->segments[store->segment_count - 1];
+    bool needs_newline = !(flags & SEGMENT_TOMBSTONE) && (length == 0 || payload[length - 1] != '\n');
+    unsigned int stored_length = length + (needs_newline ? 1 : 0);
+
+    if (active->size > 0 && active->size + record_size(stored_length) > SEGMENT_MAX_SIZE) {
+        if (open_active_segment(store, active->id + 1) != DFH_SUCCESS) {
+            return DFH_ERROR_OPEN;
+        }
+        active = &store->segments[store->segment_count - 1];
+    }
+
+    SegmentRecordHeader header = { SEGMENT_MAGIC, key, stored_length, flags };
+    bool ok = fwrite(&header, sizeof(header), 1, store->writer) == 1 &&
+              (length == 0 || fwrite(payload, 1, length, store->writer) == length) &&
+              (!needs_newline || fputc('\n', store->writer) != EOF) &&
+              fflush(store->writer) == 0;
+    if (!ok) {
+        return DFH_ERROR_WRITE;
+    }
+
+    ref->segment = active->id;
+    ref->offset = (unsigned int)active->size;
+    ref->length = stored_length;
+    active->size += record_size(stored_length);
+    return DFH_SUCCESS;
+}
+
+// Appends the tombstones of the keys deleted since the last sync and not
+// written again. Caller holds the store mutex.
+static int bury_doomed(SegmentStore* store) {
+    int result = DFH_SUCCESS;
+    int i = 0;
+    for (; i < store->doomed_count; i++) {
+        int key = store->doomed[i];
+        SegmentSlot* slot = dir_find(store, key);
+        if (!slot || !slot->doomed) continue;
+        SegmentRef ref;
+        result = append_record(store, key, NULL, 0, SEGMENT_TOMBSTONE, &ref);
+        if (result != DFH_SUCCESS) break;
+        SegmentRef old;
+        dir_remove(store, key, &old);
+        mark_dead(store, old);
+        mark_dead(store, ref);
+    }
+    if (i > 0) {
+        store->doomed_count -= i;
+        memmove(store->doomed, store->doomed + i, store->doomed_count * sizeof(int));
+    }
+    return result;
+}
+
+// Replays one segment into the directory. Returns false if the segment ends
+// in a torn record, which must not be appended to.
+static bool scan_segment(SegmentStore* store, SegmentFile* segment) {
+    FILE* file = segment_reader(store, segment);
+    if (!file) return false;
+
+    SegmentRecordHeader header;
+    unsigned long offset = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.magic != SEGMENT_MAGIC || fseek(file, (long)header.length, SEEK_CUR) != 0) {
+            break;
+        }
+        SegmentRef ref = { segment->id, (unsigned int)offset, header.length };
+        SegmentRef old;
+        if (header.flags & SEGMENT_TOMBSTONE) {
+            if (dir_remove(store, header.key, &old)) {
+                mark_dead(store, old);
+            }
+            segment->dead += record_size(header.length);
+        } else if (dir_put(store, header.key, ref, &old)) {
+            mark_dead(store, old);
+        }
+        offset += record_size(header.length);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    segment->size = size > 0 ? (unsigned long)size : 0;
+    if (segment->size != offset) {
+        segment->dead += segment->size - offset;
+        return false;
+    }
+    return true;
+}
+
+static int compare_ids(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+static int load_segments(SegmentStore* store) {
+    char data_path[MAX_PATH_LENGTH];
+    int length = snprintf(data_path, MAX_PATH_LENGTH, "%s/data", store->dataset_name);
+    if (length < 0 || length >= MAX_PATH_LENGTH) {
+        printf("Error: Data path for %s is too long\n", store->dataset_name);
+        return DFH_ERROR_OPEN;
+    }
+
+    unsigned int* ids = NULL;
+    int id_count = 0, id_capacity = 0;
+    DIR* dir = opendir(data_path);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            unsigned int id;
+            char expected[64];
+            if (sscanf(entry->d_name, "segment_%8u.log", &id) != 1) continue;
+            snprintf(expected, sizeof(expected), "segment_%08u.log", id);
+            if (strcmp(expected, entry->d_name) != 0) continue;
+            if (id_count == id_capacity) {
+                id_capacity = id_capacity ? id_capacity * 2 : 16;
+                ids = realloc(ids, id_capacity * sizeof(unsigned int));
+                if (!ids) {
+                    memory_allocation_failed();
+                }
+            }
+            ids[id_count++] = id;
+        }
+        closedir(dir);
+    }
+    if (id_count > 1) {
+        qsort(ids, id_count, sizeof(unsigned int), compare_ids);
+    }
+
+    bool clean_tail = false;
+    for (int i = 0; i < id_count; i++) {
+        clean_tail = scan_segment(store, add_segment(store, ids[i]));
+    }
+
+    int result;
+    if (id_count == 0) {
+        result = open_active_segment(store, 1);
+    } else if (clean_tail && store->segments[store->segment_count - 1].size < SEGMENT_MAX_SIZE) {
+        result = open_active_segment(store, ids[id_count - 1]);
+    } else {
+        result = open_active_segment(store, ids[id_count - 1] + 1);
+    }
+    free(ids);
+    return result;
+}
+
+// COMPACTION
+
+// Rewrites the live records of the oldest sealed segment that is at least
+// half dead, then deletes it. Returns 1 if a segment was reclaimed.
+int segment_compact(SegmentStore* store) {
+    MUTEX_LOCK(&store->mutex);
+    SegmentFile* victim = NULL;
+    for (int i = 0; i < store->segment_count - 1; i++) {
+        SegmentFile* segment = &store->segments[i];
+        if (segment->size > 0 && segment->dead * 2 >= segment->size) {
+            victim = segment;
+            break;
+        }
+    }
+    if (!victim || store->stopping) {
+        MUTEX_UNLOCK(&store->mutex);
+        return 0;
+    }
+    unsigned int victim_id = victim->id;
+    char path[MAX_PATH_LENGTH];
+    bool named = segment_path(store, victim_id, path);
+    MUTEX_UNLOCK(&store->mutex);
+    if (!named) return 0;
+
+    // Sealed segments are immutable, so they can be read without the lock.
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+
+    SegmentRecordHeader header;
+    unsigned long offset = 0;
+    char* payload = NULL;
+    unsigned int payload_capacity = 0;
+    int result = DFH_SUCCESS;
+    while (result == DFH_SUCCESS && fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.magic != SEGMENT_MAGIC) break;
+        if (header.length > payload_capacity) {
+            payload_capacity = header.length;
+            payload = realloc(payload, payload_capacity);
+            if (!payload) {
+                memory_allocation_failed();
+            }
+        }
+        if (header.length > 0 && fread(payload, 1, header.length, file) != header.length) break;
+
+        MUTEX_LOCK(&store->mutex);
+        SegmentSlot* slot = dir_find(store, header.key);
+        SegmentRef ref;
+        if (header.flags & SEGMENT_TOMBSTONE) {
+            // Keep the tombstone while an older segment may still hold the key.
+            if (!slot && store->segments[0].id != victim_id) {
+                result = append_record(store, header.key, NULL, 0, SEGMENT_TOMBSTONE, &ref);
+                if (result == DFH_SUCCESS) mark_dead(store, ref);
+            }
+        } else if (slot && slot->ref.segment == victim_id && slot->ref.offset == offset) {
+            result = append_record(store, header.key, payload, header.length, 0, &ref);
+            if (result == DFH_SUCCESS) slot->ref = ref;
+        }
+        MUTEX_UNLOCK(&store->mutex);
+        offset += record_size(header.length);
+    }
+    free(payload);
+    fclose(file);
+    if (result != DFH_SUCCESS) return 0;
+
+    // The copies must be on disk before the only other copy goes.
+    MUTEX_LOCK(&store->mutex);
+    if (!sync_writer(store)) {
+        MUTEX_UNLOCK(&store->mutex);
+        return 0;
+    }
+    victim = find_segment(store, victim_id);
+    if (victim->reader) {
+        fclose(victim->reader);
+    }
+    int index = (int)(victim - store->segments);
+    memmove(victim, victim + 1, (store->segment_count - index - 1) * sizeof(SegmentFile));
+    store->segment_count--;
+    MUTEX_UNLOCK(&store->mutex);
+
+    if (remove(path) != 0) {
+        printf("Warning: Failed to delete compacted segment %s\n", path);
+    }
+    return 1;
+}
+
+static THREAD_PROC(segment_compactor, arg) {
+    SegmentStore* store = (SegmentStore*)arg;
+    MUTEX_LOCK(&store->mutex);
+    while (!store->stopping) {
+        COND_TIMEDWAIT(&store->wake, &store->mutex, SEGMENT_COMPACT_INTERVAL_MS);
+        if (store->stopping) break;
+        MUTEX_UNLOCK(&store->mutex);
+        while (segment_compact(store) > 0) {
+        }
+        MUTEX_LOCK(&store->mutex);
+    }
+    MUTEX_UNLOCK(&store->mutex);
+    THREAD_RETURN;
+}
+
+// STORE LIFECYCLE
+
+SegmentStore* segment_store_open(const char* dataset_name) {
+    SegmentStore* store = calloc(1, sizeof(SegmentStore));
+    if (!store) {
+        memory_allocation_failed();
+    }
+    strncpy(store->dataset_name, dataset_name, MAX_PATH_LENGTH - 1);
+    store->capacity = 1024;
+    store->slots = calloc(store->capacity, sizeof(SegmentSlot));
+    if (!store->slots) {
+        memory_allocation_failed();
+    }
+    MUTEX_INIT(&store->mutex);
+    COND_INIT(&store->wake);
+
+    if (load_segments(store) != DFH_SUCCESS) {
+        segment_store_close(store);
+        return NULL;
+    }
+
+    if (THREAD_START(&store->compactor, segment_compactor, store) == 0) {
+        store->compactor_running = true;
+    } else {
+        printf("Warning: Could not start segment compactor for %s\n", dataset_name);
+    }
+    return store;
+}
+
+void segment_store_close(SegmentStore* store) {
+    if (!store) return;
+
+    if (store->compactor_running) {
+        MUTEX_LOCK(&store->mutex);
+        store->stopping = true;
+        COND_SIGNAL(&store->wake);
+        MUTEX_UNLOCK(&store->mutex);
+        THREAD_JOIN(store->compactor);
+    }
+    MUTEX_DESTROY(&store->mutex);
+    COND_DESTROY(&store->wake);
+
+    // The log is closed, and so synced, before the dataset it records.
+    if (store->writer) {
+        bury_doomed(store);
+        fclose(store->writer);
+    }
+    for (int i = 0; i < store->segment_count; i++) {
+        if (store->segments[i].reader) {
+            fclose(store->segments[i].reader);
+        }
+    }
+    free(store->segments);
+    free(store->slots);
+    free(store->doomed);
+    free(store);
+}
+
+// RECORD OPERATIONS
+
+int segment_put(SegmentStore* store, int key, const char* line, size_t length) {
+    MUTEX_LOCK(&store->mutex);
+    SegmentRef ref, old;
+    int result = append_record(store, key, line, (unsigned int)length, 0, &ref);
+    if (result == DFH_SUCCESS && dir_put(store, key, ref, &old)) {
+        mark_dead(store, old);
+    }
+    MUTEX_UNLOCK(&store->mutex);
+    return result;
+}
+
+int segment_get(SegmentStore* store, int key, char* buffer, size_t buffer_size) {
+    MUTEX_LOCK(&store->mutex);
+    SegmentSlot* slot = dir_find(store, key);
+    if (!slot || slot->doomed) {
+        MUTEX_UNLOCK(&store->mutex);
+        return DFH_ERROR_READ;
+    }
+
+    SegmentFile* segment = find_segment(store, slot->ref.segment);
+    FILE* file = segment ? segment_reader(store, segment) : NULL;
+    if (!file) {
+        MUTEX_UNLOCK(&store->mutex);
+        return DFH_ERROR_OPEN;
+    }
+
+    size_t length = slot->ref.length < buffer_size - 1 ? slot->ref.length : buffer_size - 1;
+    long offset = (long)(slot->ref.offset + sizeof(SegmentRecordHeader));
+    if (fseek(file, offset, SEEK_SET) != 0) {
+        MUTEX_UNLOCK(&store->mutex);
+        return DFH_ERROR_SEEK;
+    }
+    size_t read = fread(buffer, 1, length, file);
+    buffer[read] = '\0';
+    MUTEX_UNLOCK(&store->mutex);
+    return read == length ? DFH_SUCCESS : DFH_ERROR_READ;
+}
+
+// Deletes the record of key. Appends reach the file at once, and the log
+// record of the delete may not be durable yet, so the tombstone is only
+// appended by the next segment_sync; until then the key reads as absent.
+int segment_delete(SegmentStore* store, int key) {
+    MUTEX_LOCK(&store->mutex);
+    SegmentSlot* slot = dir_find(store, key);
+    if (slot && !slot->doomed) {
+        if (store->doomed_count == store->doomed_capacity) {
+            store->doomed_capacity = store->doomed_capacity ? store->doomed_capacity * 2 : 64;
+            store->doomed = realloc(store->doomed, store->doomed_capacity * sizeof(int));
+            if (!store->doomed) {
+                memory_allocation_failed();
+            }
+        }
+        store->doomed[store->doomed_count++] = key;
+        slot->doomed = true;
+    }
+    MUTEX_UNLOCK(&store->mutex);
+    return DFH_SUCCESS;
+}
+
+// Makes every record appended so far durable, along with the tombstones of
+// the keys deleted meanwhile and the segment files created or removed since
+// the last sync. The caller has synced the log first.
+int segment_sync(SegmentStore* store) {
+    MUTEX_LOCK(&store->mutex);
+    bool synced = bury_doomed(store) == DFH_SUCCESS && sync_writer(store);
+    MUTEX_UNLOCK(&store->mutex);
+    if (!synced) return DFH_ERROR_WRITE;
+    return dfh_sync_directory(store->dataset_name);
+}
+
+bool segment_contains(SegmentStore* store, int key) {
+    MUTEX_LOCK(&store->mutex);
+    SegmentSlot* slot = dir_find(store, key);
+    bool found = slot && !slot->doomed;
+    MUTEX_UNLOCK(&store->mutex);
+    return found;
+}
@@ -91,6 +91,51 @@ void parse_path_params(Request* req) {
                 req->path_param_count++;
             }
         }
+        // For select index parameter
+        else if (strcmp(token, "select") == 0) {
+            char* value = strtok(NULL, "/");
+            if (value) {
+                strncpy(req->path_params[req->path_param_count].key, "select", MAX_PARAM_LENGTH - 1);
+                strncpy(req->path_params[req->path_param_count].value, value, MAX_PARAM_LENGTH - 1);
+                req->path_param_count++;
+            }
+        }
+        // For split percent parameter
+        else if (strcmp(token, "split") == 0) {
+            char* value = strtok(NULL, "/");
+            if (value) {
+                strncpy(req->path_params[req->path_param_count].key, "split", MAX_PARAM_LENGTH - 1);
+                strncpy(req->path_params[req->path_param_count].value, value, MAX_PARAM_LENGTH - 1);
+                req->path_param_count++;
+            }
+        }
+        // For merge percent parameter
+        else if (strcmp(token, "merge") == 0) {
+            char* value = strtok(NULL, "/");
+            if (value) {
+                strncpy(req->path_params[req->path_param_count].key, "merge", MAX_PARAM_LENGTH - 1);
+                strncpy(req->path_params[req->path_param_count].value, value, MAX_PARAM_LENGTH - 1);
+                req->path_param_count++;
+            }
+        }
+        // For hysteresis percent parameter
+        else if (strcmp(token, "hysteresis") == 0) {
+            char* value = strtok(NULL, "/");
+            if (value) {
+                strncpy(req->path_params[req->path_param_count].key, "hysteresis", MAX_PARAM_LENGTH - 1);
+                strncpy(req->path_params[req->path_param_count].value, value, MAX_PARAM_LENGTH - 1);
+                req->path_param_count++;
+            }
+        }
+        // For storage engine parameter
+        else if (strcmp(token, "storage") == 0) {
+            char* value = strtok(NULL, "/");
+            if (value) {
+                strncpy(req->path_params[req->path_param_count].key, "storage", MAX_PARAM_LENGTH - 1);
+                strncpy(req->path_params[req->path_param_count].value, value, MAX_PARAM_LENGTH - 1);
+                req->path_param_count++;
+            }
+        }
         
         token = strtok(NULL, "/");
     }
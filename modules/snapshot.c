@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#include "../lib/snapshot.h"
+#include "../lib/dfh.h"
+#include "../lib/utils.h"
+
+#define SNAPSHOT_DATA_OFFSET (2 * SNAPSHOT_HEADER_SIZE)
+
+typedef struct SlotList {
+    unsigned int* slots;
+    size_t count;
+    size_t capacity;
+} SlotList;
+
+struct Snapshot {
+    char path[MAX_PATH_LENGTH];
+    FILE* file;
+    int T;
+    size_t stride;
+    unsigned int slot_count;
+    unsigned long long generation;
+    SlotList free;     // reusable by this checkpoint
+    SlotList retired;  // reusable once the next header is durable
+    Mutex retire_mutex;  // merges in different subtrees release slots at once
+    bool damaged;      // the last checkpoint failed; rewrite every node
+    const char* data;  // the file as loaded, for nodes not read yet
+    size_t size;
+    unsigned int mapped_slots;
+    unsigned char* reached;  // per mapped slot: whether the load found it, and at which level
+    Arena* arena;      // the tree's, for nodes read from the mapping
+    RWLock* lineage;   // the tree's, for counts taken off a damaged leaf
+};
+
+static size_t slot_stride(int T) {
+    size_t children = (size_t)(T + 1) * (sizeof(unsigned int) + sizeof(long long));
+    size_t tail = children > DFH_FILE_POINTER_LENGTH ? children : DFH_FILE_POINTER_LENGTH;
+    size_t stride = sizeof(SnapshotSlot) + (size_t)T * sizeof(int) + tail;
+    return (stride + 7) & ~(size_t)7;
+}
+
+static long slot_offset(const Snapshot* snapshot, unsigned int slot) {
+    return SNAPSHOT_DATA_OFFSET + (long)(slot - 1) * (long)snapshot->stride;
+}
+
+static void list_push(SlotList* list, unsigned int slot) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->slots = realloc(list->slots, list->capacity * sizeof(unsigned int));
+        if (!list->slots) {
+            memory_allocation_failed();
+        }
+    }
+    list->slots[list->count++] = slot;
+}
+
+static unsigned int take_slot(Snapshot* snapshot) {
+    if (snapshot->free.count > 0) {
+        return snapshot->free.slots[--snapshot->free.count];
+    }
+    return ++snapshot->slot_count;
+}
+
+static unsigned int header_checksum(const SnapshotHeader* header) {
+    const unsigned char* bytes = (const unsigned char*)header;
+    size_t size = offsetof(SnapshotHeader, checksum);
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    const unsigned char* tail = (const unsigned char*)&header->generation;
+    for (size_t i = 0; i < sizeof(header->generation) + sizeof(header->checkpoint_lsn); i++) {
+        hash = (hash ^ tail[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool sync_file(FILE* file) {
+    if (fflush(file) != 0) return false;
+    #ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+    #else
+        return fsync(fileno(file)) == 0;
+    #endif
+}
+
+static const char* map_snapshot(const char* path, size_t* size) {
+    const char* data = NULL;
+    *size = 0;
+    #ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return NULL;
+        LARGE_INTEGER length;
+        if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+            HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (map) {
+                data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(map);
+            }
+            if (data) *size = (size_t)length.QuadPart;
+        }
+        CloseHandle(file);
+    #else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return NULL;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                data = view;
+                *size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+    #endif
+    return data;
+}
+
+static void unmap_snapshot(const char* data, size_t size) {
+    #ifdef _WIN32
+        (void)size;
+        UnmapViewOfFile(data);
+    #else
+        munmap((void*)data, size);
+    #endif
+}
+
+// SAVING
+
+// Nodes never read from the snapshot keep their slots, which no checkpoint
+// overwrites while they are referenced.
+static void mark_subtree_dirty(Node* node) {
+    if (!node->loaded) return;
+    node->dirty = true;
+    if (!node->is_leaf) {
+        for (int c = 0; c <= node->n; c++) {
+            mark_subtree_dirty(node->children[c]);
+        }
+    }
+}
+
+// Writes the dirty nodes under node children first, so every parent is
+// written with the new slots of its children. Clean subtrees are skipped.
+static bool write_dirty(Snapshot* snapshot, Node* node, char* buffer) {
+    if (!node->dirty) return true;
+
+    if (!node->is_leaf) {
+        for (int c = 0; c <= node->n; c++) {
+            if (!write_dirty(snapshot, node->children[c], buffer)) return false;
+        }
+    }
+
+    if (node->slot != SNAPSHOT_NO_SLOT) {
+        list_push(&snapshot->retired, node->slot);
+    }
+    node->slot = take_slot(snapshot);
+
+    memset(buffer, 0, snapshot->stride);
+    SnapshotSlot head = { node->is_leaf ? SNAPSHOT_LEAF : 0, (unsigned int)node->n };
+    memcpy(buffer, &head, sizeof(head));
+    memcpy(buffer + sizeof(head), node->keys, node->n * sizeof(int));
+    char* tail = buffer + sizeof(head) + (size_t)snapshot->T * sizeof(int);
+    if (node->is_leaf) {
+        strncpy(tail, node->file_pointer, DFH_FILE_POINTER_LENGTH - 1);
+    } else {
+        char* counts = tail + (size_t)(snapshot->T + 1) * sizeof(unsigned int);
+        for (int c = 0; c <= node->n; c++) {
+            memcpy(tail + c * sizeof(unsigned int), &node->children[c]->slot, sizeof(unsigned int));
+            memcpy(counts + c * sizeof(long long), &node->children[c]->count, sizeof(long long));
+        }
+    }
+
+    if (fseek(snapshot->file, slot_offset(snapshot, node->slot), SEEK_SET) != 0 ||
+        fwrite(buffer, snapshot->stride, 1, snapshot->file) != 1) {
+        return false;
+    }
+    node->dirty = false;
+    return true;
+}
+
+static Snapshot* snapshot_create(BPT* tree) {
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    if (!snapshot) {
+        memory_allocation_failed();
+    }
+    snprintf(snapshot->path, MAX_PATH_LENGTH, "%s/index.bin", tree->dataset_name);
+    snapshot->T = tree->T;
+    snapshot->stride = slot_stride(tree->T);
+    snapshot->arena = tree->arena;
+    snapshot->lineage = &tree->lineage_lock;
+    snapshot->file = fopen(snapshot->path, "w+b");
+    if (!snapshot->file) {
+        free(snapshot);
+        return NULL;
+    }
+    MUTEX_INIT(&snapshot->retire_mutex);
+    return snapshot;
+}
+
+int save_tree_snapshot(BPT* tree) {
+    if (!tree || !tree->root) return -1;
+
+    // Leaf records buffered by the storage engine must be on disk before
+    // the index that points at them.
+    if (dfh_flush_dataset(tree->dataset_name) != DFH_SUCCESS) return -1;
+
+    Snapshot* snapshot = tree->snapshot;
+    if (!snapshot) {
+        snapshot = snapshot_create(tree);
+        if (!snapshot) return -1;
+        tree->snapshot = snapshot;
+        mark_subtree_dirty(tree->root);
+    } else if (snapshot->damaged) {
+        mark_subtree_dirty(tree->root);
+    }
+
+    char* buffer = malloc(snapshot->stride > SNAPSHOT_HEADER_SIZE ? snapshot->stride : SNAPSHOT_HEADER_SIZE);
+    if (!buffer) {
+        memory_allocation_failed();
+    }
+
+    // Nodes first, then the header that makes them the current tree.
+    bool written = write_dirty(snapshot, tree->root, buffer) && sync_file(snapshot->file);
+    if (written) {
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = SNAPSHOT_MAGIC;
+        header.T = (unsigned int)tree->T;
+        header.storage = (unsigned int)tree->storage;
+        header.root = tree->root->slot;
+        header.slot_count = snapshot->slot_count;
+        header.split_percent = (unsigned int)tree->policy.split_percent;
+        header.merge_percent = (unsigned int)tree->policy.merge_percent;
+        header.hysteresis_percent = (unsigned int)tree->policy.hysteresis_percent;
+        header.generation = snapshot->generation + 1;
+        header.checkpoint_lsn = tree->applied_lsn;
+        header.checksum = header_checksum(&header);
+
+        memset(buffer, 0, SNAPSHOT_HEADER_SIZE);
+        memcpy(buffer, &header, sizeof(header));
+        long offset = (long)(header.generation % 2) * SNAPSHOT_HEADER_SIZE;
+        written = fseek(snapshot->file, offset, SEEK_SET) == 0 &&
+                  fwrite(buffer, SNAPSHOT_HEADER_SIZE, 1, snapshot->file) == 1 &&
+                  sync_file(snapshot->file);
+    }
+    free(buffer);
+
+    if (!written) {
+        printf("Error: Could not write index snapshot %s\n", snapshot->path);
+        snapshot->damaged = true;
+        return -1;
+    }
+
+    // Slots the previous snapshot used are free once the new one is durable.
+    snapshot->generation++;
+    snapshot->damaged = false;
+    for (size_t i = 0; i < snapshot->retired.count; i++) {
+        list_push(&snapshot->free, snapshot->retired.slots[i]);
+    }
+    snapshot->retired.count = 0;
+    return 0;
+}
+
+void snapshot_release(Snapshot* snapshot, unsigned int slot) {
+    if (snapshot && slot != SNAPSHOT_NO_SLOT) {
+        MUTEX_LOCK(&snapshot->retire_mutex);
+        list_push(&snapshot->retired, slot);
+        MUTEX_UNLOCK(&snapshot->retire_mutex);
+    }
+}
+
+void snapshot_close(Snapshot* snapshot) {
+    if (!snapshot) return;
+    if (snapshot->file) fclose(snapshot->file);
+    if (snapshot->data) unmap_snapshot(snapshot->data, snapshot->size);
+    free(snapshot->reached);
+    free(snapshot->free.slots);
+    free(snapshot->retired.slots);
+    MUTEX_DESTROY(&snapshot->retire_mutex);
+    free(snapshot);
+}
+
+// LOADING
+
+static bool read_header(const char* data, size_t size, SnapshotHeader* header) {
+    memset(header, 0, sizeof(*header));
+    bool found = false;
+    for (int copy = 0; copy < 2; copy++) {
+        if (size < (size_t)(copy + 1) * SNAPSHOT_HEADER_SIZE) break;
+        SnapshotHeader candidate;
+        memcpy(&candidate, data + copy * SNAPSHOT_HEADER_SIZE, sizeof(candidate));
+        if (candidate.magic != SNAPSHOT_MAGIC || candidate.checksum != header_checksum(&candidate)) {
+            continue;
+        }
+        if (!found || candidate.generation > header->generation) {
+            *header = candidate;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static void read_slot(const Snapshot* snapshot, unsigned int slot, SnapshotSlot* head) {
+    memcpy(head, snapshot->data + slot_offset(snapshot, slot), sizeof(*head));
+}
+
+static unsigned int read_child(const Snapshot* snapshot, unsigned int slot, int c) {
+    const char* tail = snapshot->data + slot_offset(snapshot, slot) + sizeof(SnapshotSlot) +
+                       (size_t)snapshot->T * sizeof(int);
+    unsigned int child;
+    memcpy(&child, tail + c * sizeof(unsigned int), sizeof(child));
+    return child;
+}
+
+static long long read_count(const Snapshot* snapshot, unsigned int slot, int c) {
+    const char* counts = snapshot->data + slot_offset(snapshot, slot) + sizeof(SnapshotSlot) +
+                         (size_t)snapshot->T * sizeof(int) + (size_t)(snapshot->T + 1) * sizeof(unsigned int);
+    long long count;
+    memcpy(&count, counts + c * sizeof(long long), sizeof(count));
+    return count;
+}
+
+// Values of Snapshot.reached
+#define SLOT_UNREACHED 0
+#define SLOT_INTERNAL 1
+#define SLOT_LEAF 2
+
+// Walks the internal nodes of the stored tree, checking that every slot is
+// in range and reached once, which rejects cycles and shared children.
+// Leaves all sit at depth height and are only marked, never read;
+// snapshot_fault checks each one when it is first used.
+static bool scan_tree(const Snapshot* snapshot, unsigned int slot, unsigned int depth,
+                      unsigned int height, unsigned char* visited) {
+    if (slot == SNAPSHOT_NO_SLOT || slot > snapshot->mapped_slots || visited[slot]) return false;
+    visited[slot] = depth == height ? SLOT_LEAF : SLOT_INTERNAL;
+    if (depth == height) return true;
+
+    SnapshotSlot head;
+    read_slot(snapshot, slot, &head);
+    if ((head.flags & SNAPSHOT_LEAF) || head.n >= (unsigned int)snapshot->T) {
+        return false;
+    }
+    for (unsigned int c = 0; c <= head.n; c++) {
+        if (!scan_tree(snapshot, read_child(snapshot, slot, (int)c), depth + 1, height, visited)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A node not read yet is only a Node header with its slot and its count,
+// which its parent's slot records.
+static Node* create_stub(Snapshot* snapshot, unsigned int slot, Node* parent, long long high_key,
+                         long long count) {
+    Node* stub = allocate_stub(snapshot->arena);
+    stub->slot = slot;
+    stub->parent = parent;
+    stub->high_key = high_key;
+    stub->count = count;
+    stub->loaded = false;
+    return stub;
+}
+
+// Reads a node that so far was only a reference to its slot and returns it
+// in place of the stub, which is left to the caller. Its children become references in
+// turn, each with the separator to its right as its high key. Sibling links
+// are left unset; next_leaf finds neighbours through the parents.
+Node* snapshot_fault(Snapshot* snapshot, Node* stub) {
+    SnapshotSlot head;
+    bool intact = stub->slot != SNAPSHOT_NO_SLOT && stub->slot <= snapshot->mapped_slots;
+    if (intact) {
+        read_slot(snapshot, stub->slot, &head);
+        intact = head.n < (unsigned int)snapshot->T &&
+                 ((head.flags & SNAPSHOT_LEAF) != 0) == (snapshot->reached[stub->slot] == SLOT_LEAF);
+    }
+    for (unsigned int c = 0; intact && !(head.flags & SNAPSHOT_LEAF) && c <= head.n; c++) {
+        unsigned int child = read_child(snapshot, stub->slot, (int)c);
+        intact = child != SNAPSHOT_NO_SLOT && child <= snapshot->mapped_slots;
+    }
+    if (!intact) {
+        // The load checked every internal slot, so this is a leaf. Its keys
+        // are lost; it comes back empty under a new file, and the damaged
+        // snapshot is rewritten whole at the next checkpoint.
+        printf("Error: Index snapshot %s has a damaged node in slot %u\n", snapshot->path, stub->slot);
+        snapshot->damaged = true;
+        Node* node = allocate_node(snapshot->arena, true, snapshot->T);
+        generate_file_pointer(node->file_pointer);
+        node->parent = stub->parent;
+        node->high_key = stub->high_key;
+        node->count = stub->count;
+        int key = node->high_key == LLONG_MAX ? INT_MAX : (int)(node->high_key - 1);
+        add_count(snapshot->lineage, node, key, -stub->count);
+        return node;
+    }
+    bool is_leaf = (head.flags & SNAPSHOT_LEAF) != 0;
+
+    Node* node = allocate_node(snapshot->arena, is_leaf, snapshot->T);
+    node->slot = stub->slot;
+    node->parent = stub->parent;
+    node->high_key = stub->high_key;
+    node->n = (int)head.n;
+    node->dirty = false;
+
+    const char* data = snapshot->data + slot_offset(snapshot, node->slot) + sizeof(head);
+    memcpy(node->keys, data, head.n * sizeof(int));
+
+    if (is_leaf) {
+        memcpy(node->file_pointer, data + (size_t)snapshot->T * sizeof(int), DFH_FILE_POINTER_LENGTH);
+        node->file_pointer[DFH_FILE_POINTER_LENGTH - 1] = '\0';
+        node->count = node->n;
+        return node;
+    }
+
+    for (int c = 0; c <= node->n; c++) {
+        long long high_key = c < node->n ? node->keys[c] : node->high_key;
+        long long count = read_count(snapshot, node->slot, c);
+        node->children[c] = create_stub(snapshot, read_child(snapshot, node->slot, c), node, high_key, count);
+        node->sums[c] = count;
+    }
+    pack_counts(node);
+    return node;
+}
+
+Node* snapshot_fault_subtree(Snapshot* snapshot, Node* node) {
+    if (!node->loaded) {
+        Node* stub = node;
+        node = snapshot_fault(snapshot, stub);
+        deallocate_node(snapshot->arena, stub);
+    }
+    if (!node->is_leaf) {
+        for (int c = 0; c <= node->n; c++) {
+            node->children[c] = snapshot_fault_subtree(snapshot, node->children[c]);
+        }
+    }
+    return node;
+}
+
+// Maps the snapshot and reads only its root. The rest of the tree is read
+// from the mapping as traversals reach it, so load time and memory follow
+// the part of the tree actually used.
+BPT* load_tree_snapshot(const char* dataset_name) {
+    char index_path[MAX_PATH_LENGTH];
+    snprintf(index_path, MAX_PATH_LENGTH, "%s/index.bin", dataset_name);
+
+    size_t size;
+    const char* data = map_snapshot(index_path, &size);
+    if (!data) return NULL;
+
+    SnapshotHeader header;
+    bool valid = read_header(data, size, &header) && header.T >= 3 &&
+                 header.storage <= STORAGE_PAGES &&
+                 size >= SNAPSHOT_DATA_OFFSET + (size_t)header.slot_count * slot_stride((int)header.T);
+    if (!valid) {
+        printf("Error: Index snapshot %s is damaged\n", index_path);
+        unmap_snapshot(data, size);
+        return NULL;
+    }
+
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    if (!snapshot) {
+        memory_allocation_failed();
+    }
+    snprintf(snapshot->path, MAX_PATH_LENGTH, "%s", index_path);
+    MUTEX_INIT(&snapshot->retire_mutex);
+    snapshot->T = (int)header.T;
+    snapshot->stride = slot_stride(snapshot->T);
+    snapshot->slot_count = header.slot_count;
+    snapshot->mapped_slots = header.slot_count;
+    snapshot->generation = header.generation;
+    snapshot->data = data;
+    snapshot->size = size;
+
+    // The height comes from the leftmost path; the scan then checks the
+    // internal levels against it.
+    unsigned int height = 0;
+    unsigned int slot = header.root;
+    while (slot != SNAPSHOT_NO_SLOT && slot <= header.slot_count && height < 64) {
+        SnapshotSlot head;
+        read_slot(snapshot, slot, &head);
+        if (head.flags & SNAPSHOT_LEAF) break;
+        slot = read_child(snapshot, slot, 0);
+        height++;
+    }
+
+    unsigned char* visited = calloc((size_t)header.slot_count + 1, 1);
+    if (!visited) {
+        memory_allocation_failed();
+    }
+    valid = scan_tree(snapshot, header.root, 0, height, visited);
+    if (valid) {
+        snapshot->file = fopen(index_path, "r+b");
+    }
+    if (!valid || !snapshot->file) {
+        printf("Error: Index snapshot %s is damaged\n", index_path);
+        free(visited);
+        snapshot_close(snapshot);
+        return NULL;
+    }
+
+    // Whatever the tree does not reach was left over by earlier checkpoints.
+    for (unsigned int free_slot = header.slot_count; free_slot >= 1; free_slot--) {
+        if (visited[free_slot] == SLOT_UNREACHED) list_push(&snapshot->free, free_slot);
+    }
+    snapshot->reached = visited;
+
+    BPT* tree = create_BPT(dataset_name, (int)header.T, (int)header.storage);
+    if (!tree) {
+        snapshot_close(snapshot);
+        return NULL;
+    }
+
+    TreePolicy policy = { (int)header.split_percent, (int)header.merge_percent, (int)header.hysteresis_percent };
+    if (valid_policy(&policy)) {
+        tree->policy = policy;
+    }
+
+    free_node(tree, tree->root);
+    snapshot->arena = tree->arena;
+    snapshot->lineage = &tree->lineage_lock;
+    Node* stub = create_stub(snapshot, header.root, NULL, LLONG_MAX, 0);
+    tree->root = snapshot_fault(snapshot, stub);
+    deallocate_node(snapshot->arena, stub);
+    tree->snapshot = snapshot;
+    tree->applied_lsn = header.checkpoint_lsn;
+    return tree;
+}
@@ -1,5 +1,9 @@
 #include<stdio.h>
 #include<stdlib.h>
+#include<limits.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+#endif
 #include "../lib/utils.h"
 
 void memory_allocation_failed(){
@@ -7,19 +11,85 @@ void memory_allocation_failed(){
     exit(1);
 }
 
-int binary_search(int *arr, int n, int key) {
-    int low = 0, high = n - 1;
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-        if (arr[mid] == key) {
-            return mid;
-        } else if (arr[mid] < key) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
+// KEY SEARCH
+
+// Sorted key arrays are narrowed with a branchless binary search until a
+// short window is left, which is scanned with SIMD compares. The kernel is
+// picked once at runtime from what the CPU supports.
+
+#define KEY_SCAN_WINDOW 32
+
+typedef int (*KeyScan)(const int *keys, int n, int key);
+
+static int scan_scalar(const int *keys, int n, int key) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        count += keys[i] <= key;
+    }
+    return count;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KEY_SCAN_X86
+
+// The keys are sorted, so the first lane greater than key is the answer.
+__attribute__((target("sse2")))
+static int scan_sse2(const int *keys, int n, int key) {
+    __m128i needle = _mm_set1_epi32(key);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, needle)));
+        if (mask) return i + __builtin_ctz((unsigned int)mask);
+    }
+    return i + scan_scalar(keys + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const int *keys, int n, int key) {
+    __m256i needle = _mm256_set1_epi32(key);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(block, needle)));
+        if (mask) return i + __builtin_ctz((unsigned int)mask);
+    }
+    return i + scan_sse2(keys + i, n - i, key);
+}
+#endif
+
+static int scan_dispatch(const int *keys, int n, int key);
+static KeyScan scan_keys = scan_dispatch;
+
+static int scan_dispatch(const int *keys, int n, int key) {
+    KeyScan scan = scan_scalar;
+    #ifdef KEY_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            scan = scan_avx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            scan = scan_sse2;
         }
+    #endif
+    scan_keys = scan;
+    return scan(keys, n, key);
+}
+
+// Number of keys <= key: the child to descend into, or the position after
+// the last equal key.
+int key_upper_bound(const int *keys, int n, int key) {
+    const int *base = keys;
+    while (n > KEY_SCAN_WINDOW) {
+        int half = n / 2;
+        base = base[half] <= key ? base + half : base;
+        n -= half;
     }
-    return -1;
+    return (int)(base - keys) + scan_keys(base, n, key);
+}
+
+int binary_search(int *arr, int n, int key) {
+    int pos = key == INT_MIN ? 0 : key_upper_bound(arr, n, key - 1);
+    return (pos < n && arr[pos] == key) ? pos : -1;
 }
 
 char** append(char **arr, int *size, int *capacity, char* new_element) {
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lib/versions.h"
+#include "../lib/sync.h"
+#include "../lib/utils.h"
+
+typedef struct VersionRecord {
+    int key;
+    Version version;  // the write that replaced this image
+    bool present;
+    char* line;
+} VersionRecord;
+
+struct VersionStore {
+    Version current;  // last version handed to a write
+    int scans;        // open scans, read by writers without the mutex
+    Mutex mutex;      // guards the pins and the records
+    Version* pins;
+    int pin_count;
+    int pin_capacity;
+    VersionRecord* records;
+    int record_count;
+    int record_capacity;
+};
+
+VersionStore* versions_create(void) {
+    VersionStore* store = calloc(1, sizeof(VersionStore));
+    if (!store) {
+        memory_allocation_failed();
+    }
+    MUTEX_INIT(&store->mutex);
+    return store;
+}
+
+void versions_destroy(VersionStore* store) {
+    if (!store) return;
+    for (int i = 0; i < store->record_count; i++) {
+        free(store->records[i].line);
+    }
+    free(store->records);
+    free(store->pins);
+    MUTEX_DESTROY(&store->mutex);
+    free(store);
+}
+
+// Frees every image no scan can still ask for. The caller holds the mutex.
+static void reclaim(VersionStore* store) {
+    Version oldest = 0;
+    for (int i = 0; i < store->pin_count; i++) {
+        if (i == 0 || store->pins[i] < oldest) oldest = store->pins[i];
+    }
+    int kept = 0;
+    for (int i = 0; i < store->record_count; i++) {
+        if (store->pin_count > 0 && store->records[i].version > oldest) {
+            store->records[kept++] = store->records[i];
+        } else {
+            free(store->records[i].line);
+        }
+    }
+    store->record_count = kept;
+}
+
+// The scan count goes up before the version is read, so a write numbered
+// after the pin is bound to see the scan and keep its image.
+Version versions_pin(VersionStore* store) {
+    MUTEX_LOCK(&store->mutex);
+    __atomic_add_fetch(&store->scans, 1, __ATOMIC_SEQ_CST);
+    Version pinned = __atomic_load_n(&store->current, __ATOMIC_SEQ_CST);
+    if (store->pin_count == store->pin_capacity) {
+        store->pin_capacity = store->pin_capacity ? store->pin_capacity * 2 : 8;
+        store->pins = realloc(store->pins, store->pin_capacity * sizeof(Version));
+        if (!store->pins) {
+            memory_allocation_failed();
+        }
+    }
+    store->pins[store->pin_count++] = pinned;
+    MUTEX_UNLOCK(&store->mutex);
+    return pinned;
+}
+
+void versions_unpin(VersionStore* store, Version pinned) {
+    MUTEX_LOCK(&store->mutex);
+    for (int i = 0; i < store->pin_count; i++) {
+        if (store->pins[i] == pinned) {
+            store->pins[i] = store->pins[--store->pin_count];
+            break;
+        }
+    }
+    __atomic_sub_fetch(&store->scans, 1, __ATOMIC_SEQ_CST);
+    reclaim(store);
+    MUTEX_UNLOCK(&store->mutex);
+}
+
+// Taken by a write while its leaf is latched, before the record changes.
+Version versions_next(VersionStore* store) {
+    return __atomic_add_fetch(&store->current, 1, __ATOMIC_SEQ_CST);
+}
+
+// Whether a write has to read the image it replaces; false while no scan
+// is open, which leaves writes their old cost.
+bool versions_wanted(VersionStore* store) {
+    return __atomic_load_n(&store->scans, __ATOMIC_SEQ_CST) > 0;
+}
+
+// Position of the first record whose key is at least key.
+static int lower_bound(const VersionStore* store, long long key) {
+    int low = 0, high = store->record_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (store->records[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Keeps the image a write numbered version replaces: the record's line, or
+// its absence when line is NULL. It is dropped unless a scan pinned an older
+// version.
+void versions_keep(VersionStore* store, Version version, int key, const char* line, size_t length) {
+    MUTEX_LOCK(&store->mutex);
+    bool needed = false;
+    for (int i = 0; i < store->pin_count && !needed; i++) {
+        needed = store->pins[i] < version;
+    }
+    if (!needed) {
+        MUTEX_UNLOCK(&store->mutex);
+        return;
+    }
+
+    if (store->record_count == store->record_capacity) {
+        store->record_capacity = store->record_capacity ? store->record_capacity * 2 : 64;
+        store->records = realloc(store->records, store->record_capacity * sizeof(VersionRecord));
+        if (!store->records) {
+            memory_allocation_failed();
+        }
+    }
+    // Records stay sorted by key and then version. Versions only grow, so a
+    // record goes after every other one for its key.
+    int position = lower_bound(store, key + 1LL);
+    memmove(&store->records[position + 1], &store->records[position],
+            (store->record_count - position) * sizeof(VersionRecord));
+    store->record_count++;
+    VersionRecord* record = &store->records[position];
+    record->key = key;
+    record->version = version;
+    record->present = line != NULL;
+    record->line = NULL;
+    if (line) {
+        record->line = malloc(length + 1);
+        if (!record->line) {
+            memory_allocation_failed();
+        }
+        memcpy(record->line, line, length);
+        record->line[length] = '\0';
+    }
+    MUTEX_UNLOCK(&store->mutex);
+}
+
+// Fills *images, sorted by key, with the image at version pinned of every key
+// in [low_key, high_key] written since then. The oldest write after the pin
+// replaced exactly that image. Returns the number of images.
+int versions_collect(VersionStore* store, Version pinned, int low_key, int high_key, VersionImage** images) {
+    *images = NULL;
+    MUTEX_LOCK(&store->mutex);
+    int first = lower_bound(store, low_key);
+    int end = lower_bound(store, high_key + 1LL);
+    if (first < end) {
+        *images = malloc((end - first) * sizeof(VersionImage));
+        if (!*images) {
+            memory_allocation_failed();
+        }
+    }
+
+    int distinct = 0;
+    for (int i = first; i < end; i++) {
+        VersionRecord* record = &store->records[i];
+        if (record->version <= pinned) continue;
+        if (distinct > 0 && (*images)[distinct - 1].key == record->key) continue;
+        VersionImage* image = &(*images)[distinct++];
+        image->key = record->key;
+        image->present = record->present;
+        image->line = record->line ? strdup(record->line) : NULL;
+    }
+    MUTEX_UNLOCK(&store->mutex);
+    if (distinct == 0) {
+        free(*images);
+        *images = NULL;
+    }
+    return distinct;
+}
+
+void versions_free_images(VersionImage* images, int count) {
+    for (int i = 0; i < count; i++) {
+        free(images[i].line);
+    }
+    free(images);
+}
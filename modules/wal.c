@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../lib/wal.h"
+#include "../lib/dfh.h"
+#include "../lib/sync.h"
+#include "../lib/utils.h"
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+#else
+    #include <unistd.h>
+#endif
+
+#define WAL_BUFFER_SIZE (64u * 1024u)
+#define WAL_MAX_RECORD (16u * 1024u * 1024u)
+
+typedef struct WalBuffer {
+    char* data;
+    size_t size;
+    size_t capacity;
+} WalBuffer;
+
+struct Wal {
+    char path[MAX_PATH_LENGTH];
+    FILE* file;
+    Mutex mutex;
+    CondVar flushed;
+    WalBuffer active;  // records appended since the last write
+    WalBuffer spare;   // handed back by the last flushing leader
+    Lsn next_lsn;
+    Lsn durable_lsn;
+    unsigned long size;
+    bool flushing;
+    bool failed;
+};
+
+static unsigned int fnv1a(unsigned int hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int record_checksum(const WalRecordHeader* header, const char* line) {
+    unsigned int hash = 2166136261u;
+    hash = fnv1a(hash, &header->type, sizeof(header->type));
+    hash = fnv1a(hash, &header->lsn, sizeof(header->lsn));
+    hash = fnv1a(hash, &header->key, sizeof(header->key));
+    hash = fnv1a(hash, &header->length, sizeof(header->length));
+    return fnv1a(hash, line, header->length);
+}
+
+static void buffer_reserve(WalBuffer* buffer, size_t extra) {
+    if (buffer->size + extra <= buffer->capacity) return;
+    size_t capacity = buffer->capacity ? buffer->capacity : WAL_BUFFER_SIZE;
+    while (capacity < buffer->size + extra) capacity *= 2;
+    char* data = realloc(buffer->data, capacity);
+    if (!data) {
+        memory_allocation_failed();
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+static bool write_batch(FILE* file, const char* data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, file) != size) return false;
+    if (fflush(file) != 0) return false;
+    #ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+    #else
+        return fsync(fileno(file)) == 0;
+    #endif
+}
+
+static int truncate_log(const char* path, long length) {
+    #ifdef _WIN32
+        int fd = _open(path, _O_RDWR | _O_BINARY);
+        if (fd < 0) return -1;
+        int result = _chsize(fd, length);
+        _close(fd);
+        return result;
+    #else
+        return truncate(path, length);
+    #endif
+}
+
+// Reads records in order, handing those after after_lsn to apply. Stops at
+// the first record that is incomplete or fails its checksum: that is the
+// tail of a write interrupted by a crash, and it was never acknowledged.
+static int scan_log(const char* path, Lsn after_lsn, WalApply apply, void* context,
+                    long* valid_end, Lsn* last_lsn) {
+    *valid_end = 0;
+    *last_lsn = 0;
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return DFH_SUCCESS;
+
+    size_t capacity = MAX_LINE_SIZE;
+    char* line = malloc(capacity);
+    if (!line) {
+        memory_allocation_failed();
+    }
+
+    WalRecordHeader header;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.magic != WAL_MAGIC || header.length > WAL_MAX_RECORD) break;
+        if (header.length + 1 > capacity) {
+            capacity = header.length + 1;
+            char* grown = realloc(line, capacity);
+            if (!grown) {
+                memory_allocation_failed();
+            }
+            line = grown;
+        }
+        if (header.length > 0 && fread(line, 1, header.length, file) != header.length) break;
+        line[header.length] = '\0';
+        if (record_checksum(&header, line) != header.checksum) break;
+
+        if (apply && header.lsn > after_lsn) {
+            apply(context, header.type, header.key, line, header.lsn);
+        }
+        *valid_end += (long)(sizeof(header) + header.length);
+        *last_lsn = header.lsn;
+    }
+
+    free(line);
+    fclose(file);
+    return DFH_SUCCESS;
+}
+
+Wal* wal_open(const char* dataset_name) {
+    Wal* wal = calloc(1, sizeof(Wal));
+    if (!wal) {
+        memory_allocation_failed();
+    }
+    snprintf(wal->path, MAX_PATH_LENGTH, "%s/wal.log", dataset_name);
+
+    long valid_end;
+    Lsn last_lsn;
+    scan_log(wal->path, 0, NULL, NULL, &valid_end, &last_lsn);
+
+    // Cut off a torn tail so new records follow the last complete one.
+    FILE* existing = fopen(wal->path, "rb");
+    if (existing) {
+        fseek(existing, 0, SEEK_END);
+        long size = ftell(existing);
+        fclose(existing);
+        if (size > valid_end) {
+            printf("Warning: Discarding %ld bytes of incomplete log records in %s\n",
+                   size - valid_end, wal->path);
+            if (truncate_log(wal->path, valid_end) != 0) {
+                printf("Error: Could not truncate %s\n", wal->path);
+                free(wal);
+                return NULL;
+            }
+        }
+    }
+
+    wal->file = fopen(wal->path, "ab");
+    if (!wal->file) {
+        printf("Error: Could not open log file %s\n", wal->path);
+        free(wal);
+        return NULL;
+    }
+
+    wal->size = (unsigned long)valid_end;
+    wal->next_lsn = last_lsn + 1;
+    wal->durable_lsn = last_lsn;
+    MUTEX_INIT(&wal->mutex);
+    COND_INIT(&wal->flushed);
+    return wal;
+}
+
+void wal_close(Wal* wal) {
+    if (!wal) return;
+    wal_commit(wal, wal->next_lsn - 1);
+    fclose(wal->file);
+    MUTEX_DESTROY(&wal->mutex);
+    COND_DESTROY(&wal->flushed);
+    free(wal->active.data);
+    free(wal->spare.data);
+    free(wal);
+}
+
+Lsn wal_append(Wal* wal, unsigned int type, int key, const char* line) {
+    WalRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = WAL_MAGIC;
+    header.type = type;
+    header.key = key;
+    header.length = line ? (unsigned int)strlen(line) : 0;
+
+    MUTEX_LOCK(&wal->mutex);
+    header.lsn = wal->next_lsn++;
+    header.checksum = record_checksum(&header, line);
+    buffer_reserve(&wal->active, sizeof(header) + header.length);
+    memcpy(wal->active.data + wal->active.size, &header, sizeof(header));
+    if (header.length > 0) {
+        memcpy(wal->active.data + wal->active.size + sizeof(header), line, header.length);
+    }
+    wal->active.size += sizeof(header) + header.length;
+    MUTEX_UNLOCK(&wal->mutex);
+
+    return header.lsn;
+}
+
+// Returns once every record up to lsn is on disk. The first caller to find
+// no write in progress becomes the leader: it takes the whole buffer, writes
+// and syncs it outside the lock, and wakes everyone whose record it covered.
+// Callers arriving meanwhile keep appending to the other buffer and are
+// written together by the next leader.
+int wal_commit(Wal* wal, Lsn lsn) {
+    MUTEX_LOCK(&wal->mutex);
+    while (wal->durable_lsn < lsn && !wal->failed) {
+        if (wal->flushing) {
+            COND_WAIT(&wal->flushed, &wal->mutex);
+            continue;
+        }
+
+        wal->flushing = true;
+        WalBuffer batch = wal->active;
+        Lsn batch_lsn = wal->next_lsn - 1;
+        wal->active = wal->spare;
+        wal->active.size = 0;
+        MUTEX_UNLOCK(&wal->mutex);
+
+        bool written = write_batch(wal->file, batch.data, batch.size);
+
+        MUTEX_LOCK(&wal->mutex);
+        if (written) {
+            wal->durable_lsn = batch_lsn;
+            wal->size += (unsigned long)batch.size;
+        } else {
+            printf("Error: Could not write log file %s\n", wal->path);
+            wal->failed = true;
+        }
+        batch.size = 0;
+        wal->spare = batch;
+        wal->flushing = false;
+        COND_BROADCAST(&wal->flushed);
+    }
+    int result = wal->durable_lsn >= lsn ? DFH_SUCCESS : DFH_ERROR_WRITE;
+    MUTEX_UNLOCK(&wal->mutex);
+    return result;
+}
+
+// Returns once every record appended so far is on disk.
+int wal_sync(Wal* wal) {
+    MUTEX_LOCK(&wal->mutex);
+    Lsn last_lsn = wal->next_lsn - 1;
+    MUTEX_UNLOCK(&wal->mutex);
+    return wal_commit(wal, last_lsn);
+}
+
+int wal_replay(Wal* wal, Lsn after_lsn, WalApply apply, void* context) {
+    // A checkpoint may have emptied the log; numbering continues after it.
+    MUTEX_LOCK(&wal->mutex);
+    if (wal->next_lsn <= after_lsn) {
+        wal->next_lsn = after_lsn + 1;
+        wal->durable_lsn = after_lsn;
+    }
+    MUTEX_UNLOCK(&wal->mutex);
+
+    long valid_end;
+    Lsn last_lsn;
+    return scan_log(wal->path, after_lsn, apply, context, &valid_end, &last_lsn);
+}
+
+// Empties the log once a checkpoint covers every record in it. Records that
+// are appended but not yet applied keep the log as it is until a later one.
+int wal_truncate(Wal* wal, Lsn checkpoint_lsn) {
+    int result = DFH_SUCCESS;
+    MUTEX_LOCK(&wal->mutex);
+    if (!wal->failed && !wal->flushing && wal->active.size == 0 &&
+        wal->next_lsn - 1 == checkpoint_lsn && wal->size > 0) {
+        FILE* file = fopen(wal->path, "wb");
+        if (file) {
+            fclose(wal->file);
+            wal->file = file;
+            wal->size = 0;
+        } else {
+            result = DFH_ERROR_WRITE;
+        }
+    }
+    MUTEX_UNLOCK(&wal->mutex);
+    return result;
+}
+
+unsigned long wal_size(Wal* wal) {
+    MUTEX_LOCK(&wal->mutex);
+    unsigned long size = wal->size;
+    MUTEX_UNLOCK(&wal->mutex);
+    return size;
+}
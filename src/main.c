@@ -10,6 +10,7 @@
 #include "../lib/persister.h"
 #include "../lib/dfh.h"
 #include "../lib/service.h"
+#include "../lib/epoch.h"
 #include <cJSON.h>
 #include <ws2tcpip.h>  // For INET_ADDRSTRLEN and inet_ntop
 
@@ -35,6 +36,7 @@ void remove_dataset_from_file(const char* name);
 typedef struct Dataset {
     char name[MAX_PATH_LENGTH];
     BPT* tree;
+    BPT* evicting;  // unlinked by the cleanup thread, not freed yet
     time_t last_accessed;
 } Dataset;
 
@@ -48,10 +50,14 @@ void update_access_time(int index) {
     LeaveCriticalSection(&datasets_mutex);
 }
 
+// Inactive trees are unlinked first and freed only once every request that
+// may have found one has left its epoch. A request for the dataset in
+// between takes its tree back instead of loading a second copy.
 DWORD WINAPI cleanup_inactive_datasets(LPVOID arg) {
     (void)arg;
     while (1) {
         time_t current_time = time(NULL);
+        int evicted = 0;
         EnterCriticalSection(&datasets_mutex);
         
         for (int i = 0; i < dataset_count; i++) {
@@ -60,13 +66,28 @@ DWORD WINAPI cleanup_inactive_datasets(LPVOID arg) {
                 if (diff > INACTIVE_TIMEOUT) {
                     printf("Freeing inactive dataset: %s (inactive for %.1f minutes)\n", 
                            datasets[i].name, diff/60);
-                    free_tree(datasets[i].tree);
+                    datasets[i].evicting = datasets[i].tree;
                     datasets[i].tree = NULL;
+                    evicted++;
                 }
             }
         }
         
         LeaveCriticalSection(&datasets_mutex);
+
+        if (evicted > 0) {
+            epoch_synchronize();
+            EnterCriticalSection(&datasets_mutex);
+            for (int i = 0; i < dataset_count; i++) {
+                if (datasets[i].evicting != NULL) {
+                    // Fold the log into the index so the next load replays nothing
+                    checkpoint_tree(datasets[i].evicting);
+                    free_tree(datasets[i].evicting);
+                    datasets[i].evicting = NULL;
+                }
+            }
+            LeaveCriticalSection(&datasets_mutex);
+        }
         Sleep(CHECK_INTERVAL * 1000);
     }
     return 0;
@@ -100,6 +121,7 @@ void load_datasets() {
 
         strncpy(datasets[dataset_count].name, line, MAX_PATH_LENGTH - 1);
         datasets[dataset_count].tree = NULL;
+        datasets[dataset_count].evicting = NULL;
         datasets[dataset_count].last_accessed = time(NULL);
         dataset_count++;
         
@@ -119,8 +141,12 @@ BPT* find_BPT_by_name(const char* name) {
             found_index = i;
             if (datasets[i].tree) {
                 tree = datasets[i].tree;
+            } else if (datasets[i].evicting) {
+                tree = datasets[i].evicting;
+                datasets[i].tree = tree;
+                datasets[i].evicting = NULL;
             } else {
-                tree = load_tree_from_json(datasets[i].name);
+                tree = load_tree(datasets[i].name);
                 if (tree) {
                     datasets[i].tree = tree;
                 }
@@ -137,6 +163,17 @@ BPT* find_BPT_by_name(const char* name) {
     return tree;
 }
 
+// Takes the split, merge and hysteresis parameters given into policy,
+// keeping its values for those left out.
+static void read_policy_params(Request* req, TreePolicy* policy) {
+    Param* split_param = get_path_param(req, "split");
+    Param* merge_param = get_path_param(req, "merge");
+    Param* hysteresis_param = get_path_param(req, "hysteresis");
+    if (split_param) policy->split_percent = atoi(split_param->value);
+    if (merge_param) policy->merge_percent = atoi(merge_param->value);
+    if (hysteresis_param) policy->hysteresis_percent = atoi(hysteresis_param->value);
+}
+
 DWORD WINAPI handle_client(LPVOID client_socket) {
     SOCKET sock = (SOCKET)client_socket;
     struct sockaddr_in client_addr;
@@ -231,6 +268,9 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
         return 1;
     }
     log_request(dataset_param->value, buffer, client_ip, client_port);
+
+    // A tree found from here on is not freed before the request leaves
+    int epoch = epoch_enter();
     BPT* tree = NULL;
     if (strcmp(req.method, "POST") != 0 || !strstr(req.path, "/create")) {
         tree = find_BPT_by_name(dataset_param->value);
@@ -240,6 +280,7 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                 "{\"error\": \"Dataset '%s' not found\", \"code\": 404}", 
                 dataset_param->value);
             send(sock, error, strlen(error), 0);
+            epoch_exit(epoch);
             free(buffer);
             closesocket(sock);
             return 1;
@@ -284,6 +325,26 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                 }
             }
         } 
+        else if (strstr(req.path, "/policy")) {
+            TreePolicy policy;
+            read_dataset_policy(tree, &policy);
+            read_policy_params(&req, &policy);
+            if (!valid_policy(&policy)) {
+                const char* error = "{\"error\": \"Invalid split or merge policy\", \"code\": 400}";
+                send(sock, error, strlen(error), 0);
+            } else if (set_dataset_policy(tree, &policy) != 0) {
+                const char* error = "{\"error\": \"Failed to save policy\", \"code\": 500}";
+                send(sock, error, strlen(error), 0);
+            } else {
+                cJSON* response = cJSON_CreateObject();
+                cJSON_AddBoolToObject(response, "success", true);
+                cJSON_AddItemToObject(response, "policy", policy_to_json(&policy));
+                char* json_str = cJSON_Print(response);
+                send(sock, json_str, strlen(json_str), 0);
+                free(json_str);
+                cJSON_Delete(response);
+            }
+        }
         else if (strstr(req.path, "/create")) {
             Param* order_param = get_path_param(&req, "order");
             if (!order_param) {
@@ -291,9 +352,20 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                 send(sock, error, strlen(error), 0);
             } else {
                 int T = atoi(order_param->value);
+                Param* storage_param = get_path_param(&req, "storage");
+                int storage = dfh_storage_from_name(storage_param ? storage_param->value : NULL);
+                TreePolicy policy;
+                default_policy(&policy);
+                read_policy_params(&req, &policy);
                 if (T < 3) {
                     const char* error = "{\"error\": \"Order must be at least 3\", \"code\": 400}";
                     send(sock, error, strlen(error), 0);
+                } else if (storage < 0) {
+                    const char* error = "{\"error\": \"Unknown storage engine\", \"code\": 400}";
+                    send(sock, error, strlen(error), 0);
+                } else if (!valid_policy(&policy)) {
+                    const char* error = "{\"error\": \"Invalid split or merge policy\", \"code\": 400}";
+                    send(sock, error, strlen(error), 0);
                 } else {
                     EnterCriticalSection(&datasets_mutex);
                     
@@ -303,17 +375,19 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                             LeaveCriticalSection(&datasets_mutex);
                             const char* error = "{\"error\": \"Dataset already exists\", \"code\": 400}";
                             send(sock, error, strlen(error), 0);
+                            epoch_exit(epoch);
                             return 0;
                         }
                     }
                     
                     // Create new dataset
-                    BPT* new_tree = create_dataset(dataset_param->value, T);
+                    BPT* new_tree = create_dataset(dataset_param->value, T, storage, &policy);
                     if (new_tree) {
                         // Add to datasets array
                         if (dataset_count < MAX_DATASET_NUMBER) {
                             strncpy(datasets[dataset_count].name, dataset_param->value, MAX_PATH_LENGTH - 1);
                             datasets[dataset_count].tree = new_tree;
+                            datasets[dataset_count].evicting = NULL;
                             datasets[dataset_count].last_accessed = time(NULL);
                             dataset_count++;
                             
@@ -324,6 +398,8 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                             cJSON_AddBoolToObject(response, "success", true);
                             cJSON_AddStringToObject(response, "message", "Dataset created successfully");
                             cJSON_AddNumberToObject(response, "order", T);
+                            cJSON_AddStringToObject(response, "storage", dfh_storage_name(storage));
+                            cJSON_AddItemToObject(response, "policy", policy_to_json(&policy));
                             char* json_str = cJSON_Print(response);
                             send(sock, json_str, strlen(json_str), 0);
                             free(json_str);
@@ -391,6 +467,98 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                 }
             }
         }
+        else if (strstr(req.path, "/count")) {
+            Param* start_param = get_path_param(&req, "start");
+            Param* end_param = get_path_param(&req, "end");
+            if (!start_param || !end_param) {
+                const char* error = "{\"error\": \"Missing count parameters\", \"code\": 400}";
+                send(sock, error, strlen(error), 0);
+            } else {
+                int start = atoi(start_param->value);
+                int end = atoi(end_param->value);
+                if (start > end) {
+                    const char* error = "{\"error\": \"Invalid range: start > end\", \"code\": 400}";
+                    send(sock, error, strlen(error), 0);
+                } else {
+                    cJSON* result = count_range_dataset(tree, start, end);
+                    if (result) {
+                        char* json_str = cJSON_Print(result);
+                        send(sock, json_str, strlen(json_str), 0);
+                        free(json_str);
+                        cJSON_Delete(result);
+                    } else {
+                        const char* error = "{\"error\": \"Count failed\", \"code\": 500}";
+                        send(sock, error, strlen(error), 0);
+                    }
+                }
+            }
+        }
+        else if (strstr(req.path, "/rank")) {
+            Param* key_param = get_path_param(&req, "key");
+            if (!key_param) {
+                const char* error = "{\"error\": \"Missing key parameter\", \"code\": 400}";
+                send(sock, error, strlen(error), 0);
+            } else {
+                cJSON* result = rank_key_dataset(tree, atoi(key_param->value));
+                if (result) {
+                    char* json_str = cJSON_Print(result);
+                    send(sock, json_str, strlen(json_str), 0);
+                    free(json_str);
+                    cJSON_Delete(result);
+                } else {
+                    const char* error = "{\"error\": \"Rank failed\", \"code\": 500}";
+                    send(sock, error, strlen(error), 0);
+                }
+            }
+        }
+        else if (strstr(req.path, "/select")) {
+            Param* index_param = get_path_param(&req, "select");
+            if (!index_param) {
+                const char* error = "{\"error\": \"Missing index parameter\", \"code\": 400}";
+                send(sock, error, strlen(error), 0);
+            } else {
+                long long index = atoll(index_param->value);
+                cJSON* result = select_index_dataset(tree, index);
+                if (result) {
+                    char* json_str = cJSON_Print(result);
+                    send(sock, json_str, strlen(json_str), 0);
+                    free(json_str);
+                    cJSON_Delete(result);
+                } else {
+                    char error[256];
+                    snprintf(error, sizeof(error),
+                        "{\"error\": \"Index %lld out of range\", \"code\": 404}", index);
+                    send(sock, error, strlen(error), 0);
+                }
+            }
+        }
+        else if (strstr(req.path, "/policy")) {
+            cJSON* result = get_dataset_policy(tree);
+            if (result) {
+                char* json_str = cJSON_Print(result);
+                send(sock, json_str, strlen(json_str), 0);
+                free(json_str);
+                cJSON_Delete(result);
+            } else {
+                const char* error = "{\"error\": \"Policy unavailable\", \"code\": 500}";
+                send(sock, error, strlen(error), 0);
+            }
+        }
+        else if (strstr(req.path, "/export")) {
+            // Readable dump of the index for debugging; loading uses index.bin
+            cJSON* response = cJSON_CreateObject();
+            if (save_tree_to_json(tree) == 0) {
+                cJSON_AddBoolToObject(response, "success", true);
+                cJSON_AddStringToObject(response, "file", "index.json");
+            } else {
+                cJSON_AddBoolToObject(response, "success", false);
+                cJSON_AddStringToObject(response, "error", "Export failed");
+            }
+            char* json_str = cJSON_Print(response);
+            send(sock, json_str, strlen(json_str), 0);
+            free(json_str);
+            cJSON_Delete(response);
+        }
     }
     else if (strcmp(req.method, "DELETE") == 0) {
         if (strstr(req.path, "/key")) {
@@ -423,20 +591,30 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
             for (int i = 0; i < dataset_count; i++) {
                 if (strcmp(datasets[i].name, dataset_param->value) == 0) {
                     found_index = i;
-                    if (datasets[i].tree) {
-                        free_tree(datasets[i].tree);
-                    }
                     break;
                 }
             }
             
             if (found_index >= 0) {
+                BPT* dropped = datasets[found_index].tree ? datasets[found_index].tree
+                                                          : datasets[found_index].evicting;
                 remove_dataset_from_file(dataset_param->value);
                 for (int i = found_index; i < dataset_count - 1; i++) {
                     datasets[i] = datasets[i + 1];
                 }
                 dataset_count--;
+                LeaveCriticalSection(&datasets_mutex);
+
+                // Requests that found the tree before it was unlinked may
+                // still be using it. The files go before the reply, so the
+                // name can be created again as soon as the client has it.
+                epoch_exit(epoch);
+                epoch_synchronize();
+                if (dropped) {
+                    free_tree(dropped);
+                }
                 delete_dataset(dataset_param->value);
+                epoch = epoch_enter();
                 
                 cJSON* response = cJSON_CreateObject();
                 cJSON_AddBoolToObject(response, "success", true);
@@ -446,14 +624,14 @@ DWORD WINAPI handle_client(LPVOID client_socket) {
                 free(json_str);
                 cJSON_Delete(response);
             } else {
+                LeaveCriticalSection(&datasets_mutex);
                 const char* error = "{\"error\": \"Dataset not found\", \"code\": 404}";
                 send(sock, error, strlen(error), 0);
             }
-            
-            LeaveCriticalSection(&datasets_mutex);
         }
     }
 
+    epoch_exit(epoch);
     free(buffer);
     closesocket(sock);
     return 0;
@@ -546,6 +724,9 @@ int main() {
     CloseHandle(server_thread);
     DeleteCriticalSection(&datasets_mutex);
     for (int i = 0; i < dataset_count; i++) {
+        if (datasets[i].tree) {
+            checkpoint_tree(datasets[i].tree);
+        }
         free_tree(datasets[i].tree);
     }
     return 0;